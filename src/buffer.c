@@ -4,16 +4,84 @@
 \*=========================================================================*/
 #include "luasocket.h"
 #include "buffer.h"
+#include "bytes.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* layout of the length prefix of a frame */
+typedef struct t_framespec_ {
+    size_t size;            /* number of bytes in the prefix */
+    int little;             /* little endian if not zero */
+} t_framespec;
+typedef t_framespec *p_framespec;
+
+/* largest frame length prefix, in bytes */
+#define FRAME_MAXPREFIX 8
 
 /*=========================================================================*\
 * Internal function prototypes
 \*=========================================================================*/
 static int recvraw(p_buffer buf, size_t wanted, luaL_Buffer *b);
 static int recvline(p_buffer buf, luaL_Buffer *b);
-static int recvall(p_buffer buf, luaL_Buffer *b);
+static void addline(luaL_Buffer *b, const char *data, size_t count);
+static void pushline(lua_State *L, const char *data, size_t count);
+static int recvall(p_buffer buf, size_t total, luaL_Buffer *b);
+static int recvuntil(p_buffer buf, const char *delim, size_t dlen,
+    size_t max, size_t total, luaL_Buffer *b);
+static const char *finddelim(const char *data, size_t count,
+    const char *delim, size_t dlen, size_t *keep);
+static int recvavail(p_buffer buf, size_t max, luaL_Buffer *b);
+static void checkframespec(lua_State *L, int arg, p_framespec spec);
+static size_t checkframemax(lua_State *L, int arg);
+static int framelength(p_framespec spec, const char *header, size_t *len);
+static int recvframe(p_buffer buf, p_framespec spec, size_t max,
+    const char *part, size_t size, char *header, size_t *hgot, luaL_Buffer *b);
+static int pushframe(lua_State *L, p_buffer buf, p_framespec spec, size_t max);
+static void pushframepart(lua_State *L, int err, const char *header,
+    size_t hgot, luaL_Buffer *b);
+static int recvinto(p_buffer buf, char *data, size_t wanted, size_t *got);
+static int recvdirect(p_buffer buf, char *data, size_t wanted, size_t *got);
 static int buffer_get(p_buffer buf, const char **data, size_t *count);
+static int buffer_fill(p_buffer buf, const char **data, size_t *count);
 static void buffer_skip(p_buffer buf, size_t count);
+static void buffer_release(p_buffer buf);
+static void buffer_markstart(p_buffer buf);
+static void buffer_adapt(p_buffer buf, size_t got);
+static int sendslice(lua_State *L, p_buffer buf, const char *data,
+    size_t size);
 static int sendraw(p_buffer buf, const char *data, size_t count, size_t *sent);
+static int sendvraw(p_buffer buf, t_iovec *iov, int iovcnt, size_t *sent);
+static int buffer_writev(p_buffer buf, t_iovec *iov, int n, size_t *sent);
+static int buffer_write(p_buffer buf, const char *data, size_t count, size_t *sent);
+static void buffer_releaseout(p_buffer buf);
+static size_t buffer_roundsize(double n);
+static p_bufferpool bufferpool_open(lua_State *L);
+static char *bufferpool_get(p_bufferpool pool, size_t size);
+static void bufferpool_put(p_bufferpool pool, char *data, size_t size);
+static void bufferpool_trim(p_bufferpool pool);
+static int bufferpool_gc(lua_State *L);
+static int global_getbufferpool(lua_State *L);
+static int global_setbufferpool(lua_State *L);
+
+/* functions in library namespace */
+static luaL_Reg func[] = {
+    {"getbufferpool", global_getbufferpool},
+    {"setbufferpool", global_setbufferpool},
+    {NULL, NULL}
+};
+
+/* largest block a luaL_Buffer hands out in one piece */
+#if LUA_VERSION_NUM == 501
+#define PREPMAX ((size_t) LUAL_BUFFERSIZE)
+#else
+#define PREPMAX ((size_t) -1)
+#endif
+
+/* the address of this variable is the registry key of the pool */
+static char bufferpool_key;
 
 /* min and max macros */
 #ifndef MIN
@@ -30,19 +98,43 @@ static int sendraw(p_buffer buf, const char *data, size_t count, size_t *sent);
 * Initializes module
 \*-------------------------------------------------------------------------*/
 int buffer_open(lua_State *L) {
-    (void) L;
+    /* create the pool before any object can reference it */
+    bufferpool_open(L);
+    luaL_setfuncs(L, func, 0);
     return 0;
 }
 
 /*-------------------------------------------------------------------------*\
 * Initializes C structure
 \*-------------------------------------------------------------------------*/
-void buffer_init(p_buffer buf, p_io io, p_timeout tm) {
+void buffer_init(lua_State *L, p_buffer buf, p_io io, p_timeout tm) {
     buf->first = buf->last = 0;
+    buf->size = 0;
+    buf->data = NULL;
+    buf->pool = bufferpool_open(L);
+    buf->outmax = buf->outsize = buf->outlen = 0;
+    buf->out = NULL;
+    buf->want = BUF_SIZE;
+    buf->adaptive = 0;
+    buf->lows = 0;
+#ifdef LUASOCKET_DEBUG
+    buf->recvs = buf->sends = 0;
+#endif
     buf->io = io;
     buf->tm = tm;
     buf->received = buf->sent = 0;
-    buf->birthday = timeout_gettime();
+    buf->birthday = timeout_monotime();
+}
+
+/*-------------------------------------------------------------------------*\
+* Discards any buffered data, including output that was never flushed, and
+* gives the storage back to the pool
+\*-------------------------------------------------------------------------*/
+void buffer_destroy(p_buffer buf) {
+    buf->first = buf->last = 0;
+    buffer_release(buf);
+    buf->outlen = 0;
+    buffer_releaseout(buf);
 }
 
 /*-------------------------------------------------------------------------*\
@@ -51,8 +143,16 @@ void buffer_init(p_buffer buf, p_io io, p_timeout tm) {
 int buffer_meth_getstats(lua_State *L, p_buffer buf) {
     lua_pushnumber(L, (lua_Number) buf->received);
     lua_pushnumber(L, (lua_Number) buf->sent);
-    lua_pushnumber(L, timeout_gettime() - buf->birthday);
-    return 3;
+    lua_pushnumber(L, timeout_monotime() - buf->birthday);
+    lua_pushnumber(L, (lua_Number) (buf->size + buf->outsize));
+#ifdef LUASOCKET_DEBUG
+    /* push number of calls made to the IO driver */
+    lua_pushnumber(L, (lua_Number) buf->recvs);
+    lua_pushnumber(L, (lua_Number) buf->sends);
+    return 6;
+#else
+    return 4;
+#endif
 }
 
 /*-------------------------------------------------------------------------*\
@@ -61,7 +161,65 @@ int buffer_meth_getstats(lua_State *L, p_buffer buf) {
 int buffer_meth_setstats(lua_State *L, p_buffer buf) {
     buf->received = (long) luaL_optnumber(L, 2, (lua_Number) buf->received);
     buf->sent = (long) luaL_optnumber(L, 3, (lua_Number) buf->sent);
-    if (lua_isnumber(L, 4)) buf->birthday = timeout_gettime() - lua_tonumber(L, 4);
+    if (lua_isnumber(L, 4)) buf->birthday = timeout_monotime() - lua_tonumber(L, 4);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:getbuffersize() interface
+\*-------------------------------------------------------------------------*/
+int buffer_meth_getbuffersize(lua_State *L, p_buffer buf) {
+    lua_pushnumber(L, (lua_Number) buf->want);
+    lua_pushstring(L, buf->adaptive? "adaptive": "fixed");
+    return 2;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:setbuffersize() interface
+* Lua Input: base, size [, mode]
+*   size: buffer size in bytes, rounded up to a power of two
+*   mode: "fixed" or "adaptive". (default: fixed)
+\*-------------------------------------------------------------------------*/
+int buffer_meth_setbuffersize(lua_State *L, p_buffer buf) {
+    static const char *modes[] = { "fixed", "adaptive", NULL };
+    double n = luaL_checknumber(L, 2);
+    luaL_argcheck(L, n > 0, 2, "invalid buffer size");
+    buf->want = buffer_roundsize(n);
+    buf->adaptive = luaL_checkoption(L, 3, "fixed", modes);
+    buf->lows = 0;
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:getoutputbuffer() interface
+\*-------------------------------------------------------------------------*/
+int buffer_meth_getoutputbuffer(lua_State *L, p_buffer buf) {
+    lua_pushnumber(L, (lua_Number) buf->outmax);
+    lua_pushnumber(L, (lua_Number) buf->outlen);
+    return 2;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:setoutputbuffer() interface
+* Lua Input: base, size
+*   size: high-water mark in bytes, rounded up to a power of two, or 0 to
+*   disable output buffering
+\*-------------------------------------------------------------------------*/
+int buffer_meth_setoutputbuffer(lua_State *L, p_buffer buf) {
+    double n = luaL_checknumber(L, 2);
+    int err;
+    luaL_argcheck(L, n >= 0, 2, "invalid buffer size");
+    /* pending output was accepted under the old setting */
+    buffer_markstart(buf);
+    err = buffer_flush(buf);
+    if (err != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, buf->io->error(buf->io->ctx, err));
+        return 2;
+    }
+    buf->outmax = n > 0? buffer_roundsize(n): 0;
     lua_pushnumber(L, 1);
     return 1;
 }
@@ -70,56 +228,195 @@ int buffer_meth_setstats(lua_State *L, p_buffer buf) {
 * object:send() interface
 \*-------------------------------------------------------------------------*/
 int buffer_meth_send(lua_State *L, p_buffer buf) {
-    int top = lua_gettop(L);
-    int err = IO_DONE;
-    size_t size = 0, sent = 0;
+    size_t size = 0;
     const char *data = luaL_checklstring(L, 2, &size);
-    long start = (long) luaL_optnumber(L, 3, 1);
-    long end = (long) luaL_optnumber(L, 4, -1);
-    timeout_markstart(buf->tm);
-    if (start < 0) start = (long) (size+start+1);
-    if (end < 0) end = (long) (size+end+1);
-    if (start < 1) start = (long) 1;
-    if (end > (long) size) end = (long) size;
-    if (start <= end) err = sendraw(buf, data+start-1, end-start+1, &sent);
+    return sendslice(L, buf, data, size);
+}
+
+/*-------------------------------------------------------------------------*\
+* object:sendfrom() interface
+\*-------------------------------------------------------------------------*/
+int buffer_meth_sendfrom(lua_State *L, p_buffer buf) {
+    p_bytes bytes = bytes_check(L, 2);
+    return sendslice(L, buf, bytes->data, bytes->size);
+}
+
+/*-------------------------------------------------------------------------*\
+* object:sendv() interface
+* Lua Input: base, pieces
+*   pieces: an array of strings, or the strings themselves as arguments
+* Lua Returns
+*   on success: total number of bytes sent
+*   on error: nil, error message, number of bytes sent
+\*-------------------------------------------------------------------------*/
+int buffer_meth_sendv(lua_State *L, p_buffer buf) {
+    int top = lua_gettop(L);
+    int err, first = 2, n, i;
+    size_t sent = 0;
+    t_iovec local[IO_IOVMAX], *iov = local;
+    /* pieces in an array are moved to the stack, where they stay anchored */
+    if (lua_istable(L, 2)) {
+        n = (int) lua_rawlen(L, 2);
+        luaL_checkstack(L, n + 1, "too many pieces");
+        for (i = 1; i <= n; i++) {
+            lua_rawgeti(L, 2, i);
+            if (!lua_isstring(L, -1))
+                luaL_argerror(L, 2, "array of strings expected");
+        }
+        first = top + 1;
+    } else {
+        n = top - 1;
+        for (i = 0; i < n; i++) luaL_checkstring(L, first + i);
+    }
+    /* one extra slot for pending output, which must leave first */
+    if (n + 1 > IO_IOVMAX)
+        iov = (t_iovec *) lua_newuserdata(L, (n + 1) * sizeof(t_iovec));
+    for (i = 0; i < n; i++)
+        iov[i+1].data = lua_tolstring(L, first + i, &iov[i+1].count);
+    buffer_markstart(buf);
+    err = buffer_writev(buf, iov, n, &sent);
+    lua_settop(L, top);
     /* check if there was an error */
     if (err != IO_DONE) {
         lua_pushnil(L);
         lua_pushstring(L, buf->io->error(buf->io->ctx, err));
-        lua_pushnumber(L, (lua_Number) (sent+start-1));
+        lua_pushnumber(L, (lua_Number) sent);
     } else {
-        lua_pushnumber(L, (lua_Number) (sent+start-1));
+        lua_pushnumber(L, (lua_Number) sent);
         lua_pushnil(L);
         lua_pushnil(L);
     }
 #ifdef LUASOCKET_DEBUG
     /* push time elapsed during operation as the last return value */
-    lua_pushnumber(L, timeout_gettime() - timeout_getstart(buf->tm));
+    lua_pushnumber(L, timeout_monotime() - buf->start);
 #endif
     return lua_gettop(L) - top;
 }
 
+/*-------------------------------------------------------------------------*\
+* object:sendframe() interface
+* Lua Input: base, data [, spec]
+*   spec: length prefix layout, such as ">I4" (the default) or "<I2"
+* Lua Returns
+*   on success: total number of bytes sent, prefix included
+*   on error: nil, error message, number of bytes sent
+\*-------------------------------------------------------------------------*/
+int buffer_meth_sendframe(lua_State *L, p_buffer buf) {
+    int err, top = lua_gettop(L);
+    size_t size, len, sent = 0, i;
+    char header[FRAME_MAXPREFIX];
+    t_framespec spec;
+    t_iovec iov[3];
+    const char *data = luaL_checklstring(L, 2, &size);
+    checkframespec(L, 3, &spec);
+    for (i = 0, len = size; i < spec.size; i++, len >>= 8)
+        header[spec.little? i: spec.size-1-i] = (char) (len & 0xff);
+    luaL_argcheck(L, len == 0, 2, "too large for the frame prefix");
+    iov[1].data = header;
+    iov[1].count = spec.size;
+    iov[2].data = data;
+    iov[2].count = size;
+    buffer_markstart(buf);
+    err = buffer_writev(buf, iov, 2, &sent);
+    if (err != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, buf->io->error(buf->io->ctx, err));
+        lua_pushnumber(L, (lua_Number) sent);
+    } else {
+        lua_pushnumber(L, (lua_Number) sent);
+        lua_pushnil(L);
+        lua_pushnil(L);
+    }
+#ifdef LUASOCKET_DEBUG
+    /* push time elapsed during operation as the last return value */
+    lua_pushnumber(L, timeout_monotime() - buf->start);
+#endif
+    return lua_gettop(L) - top;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:flush() interface
+\*-------------------------------------------------------------------------*/
+int buffer_meth_flush(lua_State *L, p_buffer buf) {
+    int err;
+    buffer_markstart(buf);
+    err = buffer_flush(buf);
+    if (err != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, buf->io->error(buf->io->ctx, err));
+        lua_pushnumber(L, (lua_Number) buf->outlen);
+        return 3;
+    }
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
 /*-------------------------------------------------------------------------*\
 * object:receive() interface
 \*-------------------------------------------------------------------------*/
 int buffer_meth_receive(lua_State *L, p_buffer buf) {
-    int err = IO_DONE, top;
-    luaL_Buffer b;
-    size_t size;
-    const char *part = luaL_optlstring(L, 3, "", &size);
-    timeout_markstart(buf->tm);
     /* make sure we don't confuse buffer stuff with arguments */
     lua_settop(L, 3);
-    top = lua_gettop(L);
+    return buffer_receive(L, buf, 0, 0);
+}
+
+/*-------------------------------------------------------------------------*\
+* Receives a pattern, with the pattern and prefix at stack indices 2 and 3,
+* pushing the results of object:receive(). The caller holds another held
+* bytes of the result ahead of the prefix, of which received came from the
+* transport, so that counted patterns and end of file take them into
+* account. Calls that continue an earlier one use this.
+\*-------------------------------------------------------------------------*/
+int buffer_receive(lua_State *L, p_buffer buf, size_t held,
+        size_t received) {
+    int err = IO_DONE, top = lua_gettop(L);
+    luaL_Buffer b;
+    size_t size, before;
+    const char *delim = NULL;
+    size_t dlen = 0, max = (size_t) -1, avail = 0;
+    const char *part = luaL_optlstring(L, 3, "", &size);
+    buffer_markstart(buf);
+    before = held + size;
+    /* the delimiter stays anchored by the pattern table */
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "available");
+        if (!lua_isnil(L, -1)) {
+            double n = lua_tonumber(L, -1);
+            luaL_argcheck(L, lua_isnumber(L, -1) && n >= 1, 2,
+                "invalid available length");
+            avail = (size_t) n;
+            lua_pop(L, 1);
+        } else {
+            lua_pop(L, 1);
+            lua_getfield(L, 2, "delimiter");
+            delim = lua_tolstring(L, -1, &dlen);
+            luaL_argcheck(L, delim && dlen > 0 && dlen <= BUF_MINSIZE, 2,
+                "invalid delimiter");
+            lua_getfield(L, 2, "max");
+            if (!lua_isnil(L, -1)) {
+                double n = lua_tonumber(L, -1);
+                luaL_argcheck(L, lua_isnumber(L, -1) && n >= 0, 2,
+                    "invalid maximum length");
+                max = (size_t) n;
+            }
+            lua_pop(L, 2);
+        }
+    }
     /* initialize buffer with optional extra prefix
      * (useful for concatenating previous partial results) */
     luaL_buffinit(L, &b);
     luaL_addlstring(&b, part, size);
     /* receive new patterns */
-    if (!lua_isnumber(L, 2)) {
+    if (avail) {
+        err = recvavail(buf, avail, &b);
+    } else if (delim) {
+        err = recvuntil(buf, delim, dlen, max, before, &b);
+    } else if (!lua_isnumber(L, 2)) {
         const char *p= luaL_optstring(L, 2, "*l");
         if (p[0] == '*' && p[1] == 'l') err = recvline(buf, &b);
-        else if (p[0] == '*' && p[1] == 'a') err = recvall(buf, &b);
+        else if (p[0] == '*' && p[1] == 'a')
+            err = recvall(buf, received, &b);
+        else if (p[0] == '*' && p[1] == 'r') err = recvavail(buf, buf->want, &b);
         else luaL_argcheck(L, 0, 2, "invalid receive pattern");
     /* get a fixed number of bytes (minus what was already partially
      * received) */
@@ -127,8 +424,8 @@ int buffer_meth_receive(lua_State *L, p_buffer buf) {
         double n = lua_tonumber(L, 2);
         size_t wanted = (size_t) n;
         luaL_argcheck(L, n >= 0, 2, "invalid receive pattern");
-        if (size == 0 || wanted > size)
-            err = recvraw(buf, wanted-size, &b);
+        if (before == 0 || wanted > before)
+            err = recvraw(buf, wanted-before, &b);
     }
     /* check if there was an error */
     if (err != IO_DONE) {
@@ -146,7 +443,227 @@ int buffer_meth_receive(lua_State *L, p_buffer buf) {
     }
 #ifdef LUASOCKET_DEBUG
     /* push time elapsed during operation as the last return value */
-    lua_pushnumber(L, timeout_gettime() - timeout_getstart(buf->tm));
+    lua_pushnumber(L, timeout_monotime() - buf->start);
+#endif
+    return lua_gettop(L) - top;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:peek() interface
+* Lua Input: base, count
+*   count: number of bytes wanted, at most the receive buffer size
+* Lua Returns
+*   on success: the next count bytes, which are not consumed
+*   on error: nil, error message, the bytes that did arrive
+* Waits for count bytes in the receive buffer, so that later receives
+* return them again.
+\*-------------------------------------------------------------------------*/
+int buffer_meth_peek(lua_State *L, p_buffer buf) {
+    int err, top = lua_gettop(L);
+    size_t count = 0, room = buf->data? buf->size: buf->want;
+    const char *data = NULL;
+    double n = luaL_checknumber(L, 2);
+    size_t wanted = (size_t) n;
+    luaL_argcheck(L, n >= 1 && wanted <= room, 2,
+        "count must be between 1 and the buffer size");
+    buffer_markstart(buf);
+    err = buffer_get(buf, &data, &count);
+    while (err == IO_DONE && count < wanted)
+        err = buffer_fill(buf, &data, &count);
+    if (err != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, buf->io->error(buf->io->ctx, err));
+        lua_pushlstring(L, data? data: "", data? count: 0);
+    } else {
+        lua_pushlstring(L, data, wanted);
+        lua_pushnil(L);
+        lua_pushnil(L);
+    }
+#ifdef LUASOCKET_DEBUG
+    /* push time elapsed during operation as the last return value */
+    lua_pushnumber(L, timeout_monotime() - buf->start);
+#endif
+    return lua_gettop(L) - top;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:receivelines() interface
+* Lua Input: base [, max [, prefix]]
+*   max: maximum number of lines to return
+*   prefix: partial result of a previous call, prepended to the first line
+* Lua Returns
+*   on success: an array with at least one line
+*   on error: nil, error message, partial first line
+* Only the first line may wait for the transport. The others are the
+* complete lines already buffered when it arrives.
+\*-------------------------------------------------------------------------*/
+int buffer_meth_receivelines(lua_State *L, p_buffer buf) {
+    int err, top, n = 0;
+    luaL_Buffer b;
+    size_t size;
+    double max = luaL_optnumber(L, 2, (double) INT_MAX);
+    const char *part = luaL_optlstring(L, 3, "", &size);
+    luaL_argcheck(L, max >= 1, 2, "invalid maximum number of lines");
+    buffer_markstart(buf);
+    /* make sure we don't confuse buffer stuff with arguments */
+    lua_settop(L, 3);
+    top = lua_gettop(L);
+    lua_newtable(L);
+    luaL_buffinit(L, &b);
+    luaL_addlstring(&b, part, size);
+    err = recvline(buf, &b);
+    luaL_pushresult(&b);
+    if (err != IO_DONE) {
+        /* replace the table with nil, and report the partial line */
+        lua_pushnil(L);
+        lua_replace(L, top+1);
+        lua_pushstring(L, buf->io->error(buf->io->ctx, err));
+        lua_insert(L, -2);
+    } else {
+        lua_rawseti(L, top+1, ++n);
+        while (n < max && !buffer_isempty(buf)) {
+            const char *data = buf->data + buf->first, *nl;
+            nl = (const char *) memchr(data, '\n', buf->last - buf->first);
+            if (!nl) break;
+            pushline(L, data, (size_t) (nl - data));
+            lua_rawseti(L, top+1, ++n);
+            buffer_skip(buf, (size_t) (nl - data) + 1);
+        }
+        lua_pushnil(L);
+        lua_pushnil(L);
+    }
+#ifdef LUASOCKET_DEBUG
+    /* push time elapsed during operation as the last return value */
+    lua_pushnumber(L, timeout_monotime() - buf->start);
+#endif
+    return lua_gettop(L) - top;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:receiveframe() interface
+* Lua Input: base [, spec [, max [, prefix]]]
+*   spec: length prefix layout, such as ">I4" (the default) or "<I2"
+*   max: largest frame length accepted
+*   prefix: partial result of a previous call
+* Lua Returns
+*   on success: the frame, without its length prefix
+*   on error: nil, error message, partial frame, length prefix included
+\*-------------------------------------------------------------------------*/
+int buffer_meth_receiveframe(lua_State *L, p_buffer buf) {
+    int err, top;
+    luaL_Buffer b;
+    t_framespec spec;
+    char header[FRAME_MAXPREFIX];
+    size_t size, hgot = 0, max;
+    const char *part = luaL_optlstring(L, 4, "", &size);
+    checkframespec(L, 2, &spec);
+    max = checkframemax(L, 3);
+    buffer_markstart(buf);
+    /* make sure we don't confuse buffer stuff with arguments */
+    lua_settop(L, 4);
+    top = lua_gettop(L);
+    /* a whole frame already buffered is pushed as is */
+    if (size == 0 && pushframe(L, buf, &spec, max)) {
+        lua_pushnil(L);
+        lua_pushnil(L);
+    } else {
+        luaL_buffinit(L, &b);
+        err = recvframe(buf, &spec, max, part, size, header, &hgot, &b);
+        pushframepart(L, err, header, hgot, &b);
+        if (err != IO_DONE) {
+            lua_pushstring(L, buf->io->error(buf->io->ctx, err));
+            lua_pushvalue(L, -2);
+            lua_pushnil(L);
+            lua_replace(L, -4);
+        } else {
+            lua_pushnil(L);
+            lua_pushnil(L);
+        }
+    }
+#ifdef LUASOCKET_DEBUG
+    /* push time elapsed during operation as the last return value */
+    lua_pushnumber(L, timeout_monotime() - buf->start);
+#endif
+    return lua_gettop(L) - top;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:receiveframes() interface
+* Lua Input: base [, spec [, max [, prefix]]]
+*   same as receiveframe
+* Lua Returns
+*   on success: an array with at least one frame
+*   on error: nil, error message, partial first frame
+* Only the first frame may wait for the transport. The others are the
+* complete frames already buffered when it arrives.
+\*-------------------------------------------------------------------------*/
+int buffer_meth_receiveframes(lua_State *L, p_buffer buf) {
+    int err, top, n = 0;
+    luaL_Buffer b;
+    t_framespec spec;
+    char header[FRAME_MAXPREFIX];
+    size_t size, hgot = 0, max;
+    const char *part = luaL_optlstring(L, 4, "", &size);
+    checkframespec(L, 2, &spec);
+    max = checkframemax(L, 3);
+    buffer_markstart(buf);
+    /* make sure we don't confuse buffer stuff with arguments */
+    lua_settop(L, 4);
+    top = lua_gettop(L);
+    lua_newtable(L);
+    if (size == 0 && pushframe(L, buf, &spec, max)) err = IO_DONE;
+    else {
+        luaL_buffinit(L, &b);
+        err = recvframe(buf, &spec, max, part, size, header, &hgot, &b);
+        pushframepart(L, err, header, hgot, &b);
+    }
+    if (err != IO_DONE) {
+        /* replace the table with nil, and report the partial frame */
+        lua_pushnil(L);
+        lua_replace(L, top+1);
+        lua_pushstring(L, buf->io->error(buf->io->ctx, err));
+        lua_insert(L, -2);
+    } else {
+        do lua_rawseti(L, top+1, ++n);
+        while (pushframe(L, buf, &spec, max));
+        lua_pushnil(L);
+        lua_pushnil(L);
+    }
+#ifdef LUASOCKET_DEBUG
+    /* push time elapsed during operation as the last return value */
+    lua_pushnumber(L, timeout_monotime() - buf->start);
+#endif
+    return lua_gettop(L) - top;
+}
+
+/*-------------------------------------------------------------------------*\
+* object:receiveinto() interface
+* Lua Input: base, bytes [, offset [, count]]
+*   offset: where the data goes, 1 by default
+*   count: number of bytes to receive, the rest of the object by default
+* Lua Returns
+*   on success: count
+*   on error: nil, error message, number of bytes received
+\*-------------------------------------------------------------------------*/
+int buffer_meth_receiveinto(lua_State *L, p_buffer buf) {
+    int err, top = lua_gettop(L);
+    size_t count, got = 0;
+    p_bytes bytes = bytes_check(L, 2);
+    size_t start = bytes_checkrange(L, bytes, 3, &count);
+    buffer_markstart(buf);
+    err = recvinto(buf, bytes->data + start, count, &got);
+    if (err != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, buf->io->error(buf->io->ctx, err));
+        lua_pushnumber(L, (lua_Number) got);
+    } else {
+        lua_pushnumber(L, (lua_Number) got);
+        lua_pushnil(L);
+        lua_pushnil(L);
+    }
+#ifdef LUASOCKET_DEBUG
+    /* push time elapsed during operation as the last return value */
+    lua_pushnumber(L, timeout_monotime() - buf->start);
 #endif
     return lua_gettop(L) - top;
 }
@@ -158,9 +675,84 @@ int buffer_isempty(p_buffer buf) {
     return buf->first >= buf->last;
 }
 
+/*-------------------------------------------------------------------------*\
+* Sends all pending output. Whatever could not be sent stays pending.
+\*-------------------------------------------------------------------------*/
+int buffer_flush(p_buffer buf) {
+    int err = IO_DONE;
+    if (buf->outlen > 0) {
+        size_t sent = 0;
+        err = sendraw(buf, buf->out, buf->outlen, &sent);
+        buf->outlen -= sent;
+        if (buf->outlen > 0) memmove(buf->out, buf->out + sent, buf->outlen);
+    }
+    if (buf->outlen == 0) buffer_releaseout(buf);
+    return err;
+}
+
+/*=========================================================================*\
+* Global Lua functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Returns the number of idle bytes kept by the pool, and its maximum
+\*-------------------------------------------------------------------------*/
+static int global_getbufferpool(lua_State *L) {
+    p_bufferpool pool = bufferpool_open(L);
+    lua_pushnumber(L, (lua_Number) pool->idle);
+    lua_pushnumber(L, (lua_Number) pool->max);
+    return 2;
+}
+
+/*-------------------------------------------------------------------------*\
+* Sets the maximum number of idle bytes kept by the pool
+\*-------------------------------------------------------------------------*/
+static int global_setbufferpool(lua_State *L) {
+    p_bufferpool pool = bufferpool_open(L);
+    double max = luaL_checknumber(L, 1);
+    luaL_argcheck(L, max >= 0, 1, "invalid pool size");
+    pool->max = (size_t) max;
+    bufferpool_trim(pool);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
 /*=========================================================================*\
 * Internal functions
 \*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Sends the part of data selected by the optional i and j arguments, which
+* work like in string.sub, and pushes the results of send
+\*-------------------------------------------------------------------------*/
+static int sendslice(lua_State *L, p_buffer buf, const char *data,
+        size_t size) {
+    int top = lua_gettop(L);
+    int err = IO_DONE;
+    size_t sent = 0;
+    long start = (long) luaL_optnumber(L, 3, 1);
+    long end = (long) luaL_optnumber(L, 4, -1);
+    buffer_markstart(buf);
+    if (start < 0) start = (long) (size+start+1);
+    if (end < 0) end = (long) (size+end+1);
+    if (start < 1) start = (long) 1;
+    if (end > (long) size) end = (long) size;
+    if (start <= end) err = buffer_write(buf, data+start-1, end-start+1, &sent);
+    /* check if there was an error */
+    if (err != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, buf->io->error(buf->io->ctx, err));
+        lua_pushnumber(L, (lua_Number) (sent+start-1));
+    } else {
+        lua_pushnumber(L, (lua_Number) (sent+start-1));
+        lua_pushnil(L);
+        lua_pushnil(L);
+    }
+#ifdef LUASOCKET_DEBUG
+    /* push time elapsed during operation as the last return value */
+    lua_pushnumber(L, timeout_monotime() - buf->start);
+#endif
+    return lua_gettop(L) - top;
+}
+
 /*-------------------------------------------------------------------------*\
 * Sends a block of data (unbuffered)
 \*-------------------------------------------------------------------------*/
@@ -174,6 +766,9 @@ static int sendraw(p_buffer buf, const char *data, size_t count, size_t *sent) {
         size_t done = 0;
         size_t step = (count-total <= STEPSIZE)? count-total: STEPSIZE;
         err = io->send(io->ctx, data+total, step, &done, tm);
+#ifdef LUASOCKET_DEBUG
+        buf->sends++;
+#endif
         total += done;
     }
     *sent = total;
@@ -182,17 +777,131 @@ static int sendraw(p_buffer buf, const char *data, size_t count, size_t *sent) {
 }
 
 /*-------------------------------------------------------------------------*\
-* Reads a fixed number of bytes (buffered)
+* Sends a sequence of pieces with as few calls to the transport as the
+* driver allows. The pieces are consumed from the iov array as they go out.
+\*-------------------------------------------------------------------------*/
+static int sendvraw(p_buffer buf, t_iovec *iov, int iovcnt, size_t *sent) {
+    p_io io = buf->io;
+    size_t total = 0;
+    int err = IO_DONE;
+    /* drivers without vectored output get one piece at a time */
+    if (!io->sendv) {
+        while (iovcnt > 0 && err == IO_DONE) {
+            size_t done = 0;
+            err = sendraw(buf, iov->data, iov->count, &done);
+            total += done;
+            iov++; iovcnt--;
+        }
+        *sent = total;
+        return err;
+    }
+    while (iovcnt > 0 && err == IO_DONE) {
+        size_t done = 0;
+        err = io->sendv(io->ctx, iov, MIN(iovcnt, IO_IOVMAX), &done, buf->tm);
+#ifdef LUASOCKET_DEBUG
+        buf->sends++;
+#endif
+        total += done;
+        /* skip what went out, resuming mid-piece if needed */
+        while (iovcnt > 0 && done >= iov->count) {
+            done -= iov->count;
+            iov++; iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->data += done;
+            iov->count -= done;
+        }
+    }
+    *sent = total;
+    buf->sent += total;
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Sends the n pieces in iov[1..n] as one message. Small messages join the
+* pending output. Otherwise pending output takes the free slot iov[0] and
+* everything leaves in a single vectored send. Returns the number of bytes
+* of the message that were sent.
+\*-------------------------------------------------------------------------*/
+static int buffer_writev(p_buffer buf, t_iovec *iov, int n, size_t *sent) {
+    int err = IO_DONE, cnt = 0, i;
+    size_t total = 0, pending = buf->outlen, done = 0;
+    *sent = 0;
+    for (i = 1; i <= n; i++) total += iov[i].count;
+    if (buf->outmax > 0 && buf->outlen + total < buf->outmax) {
+        for (i = 1; i <= n && err == IO_DONE; i++) {
+            err = buffer_write(buf, iov[i].data, iov[i].count, &done);
+            *sent += done;
+        }
+        return err;
+    }
+    if (pending > 0) {
+        iov[cnt].data = buf->out;
+        iov[cnt++].count = pending;
+    }
+    for (i = 1; i <= n; i++)
+        if (iov[i].count > 0) iov[cnt++] = iov[i];
+    err = sendvraw(buf, iov, cnt, &done);
+    if (done < pending) {
+        buf->outlen -= done;
+        memmove(buf->out, buf->out + done, buf->outlen);
+    } else {
+        buf->outlen = 0;
+        *sent = done - pending;
+    }
+    if (buf->outlen == 0) buffer_releaseout(buf);
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Sends a block of data, or holds it as pending output if output buffering
+* is enabled and the high-water mark has not been reached. Upon return,
+* sent holds the number of bytes accepted, either sent or pending.
+\*-------------------------------------------------------------------------*/
+static int buffer_write(p_buffer buf, const char *data, size_t count,
+        size_t *sent) {
+    int err;
+    *sent = 0;
+    if (buf->outmax == 0) return sendraw(buf, data, count, sent);
+    /* pending output goes first, and must fit below the high-water mark */
+    if (buf->outlen + count >= buf->outmax) {
+        if ((err = buffer_flush(buf)) != IO_DONE) return err;
+        /* nothing to gain from copying large blocks */
+        if (count >= buf->outmax) return sendraw(buf, data, count, sent);
+    }
+    if (!buf->out) {
+        buf->out = bufferpool_get(buf->pool, buf->outmax);
+        if (!buf->out) return ENOMEM;
+        buf->outsize = buf->outmax;
+    }
+    memcpy(buf->out + buf->outlen, data, count);
+    buf->outlen += count;
+    *sent = count;
+    return IO_DONE;
+}
+
+/*-------------------------------------------------------------------------*\
+* Reads a fixed number of bytes (buffered). Once the buffer is drained, a
+* large remainder is read straight into the result, in steps that grow
+* with what was received so far so that a bogus size does not reserve
+* memory the peer never fills
 \*-------------------------------------------------------------------------*/
 static int recvraw(p_buffer buf, size_t wanted, luaL_Buffer *b) {
     int err = IO_DONE;
     size_t total = 0;
     while (err == IO_DONE) {
         size_t count; const char *data;
-        err = buffer_get(buf, &data, &count);
-        count = MIN(count, wanted - total);
-        luaL_addlstring(b, data, count);
-        buffer_skip(buf, count);
+        if (buffer_isempty(buf) && wanted - total >= buf->want) {
+            size_t step = MIN(wanted - total, MAX(total, buf->want));
+            step = MIN(step, PREPMAX);
+            err = recvdirect(buf, luaL_prepbuffsize(b, step), step, &count);
+            luaL_addsize(b, count);
+        } else {
+            err = buffer_get(buf, &data, &count);
+            count = MIN(count, wanted - total);
+            luaL_addlstring(b, data, count);
+            buffer_skip(buf, count);
+        }
         total += count;
         if (total >= wanted) break;
     }
@@ -200,17 +909,82 @@ static int recvraw(p_buffer buf, size_t wanted, luaL_Buffer *b) {
 }
 
 /*-------------------------------------------------------------------------*\
-* Reads everything until the connection is closed (buffered)
+* Reads a fixed number of bytes into caller memory. Buffered data is used
+* first. Requests at least as large as the buffer skip it and go straight
+* from the transport to the destination.
 \*-------------------------------------------------------------------------*/
-static int recvall(p_buffer buf, luaL_Buffer *b) {
+static int recvinto(p_buffer buf, char *data, size_t wanted, size_t *got) {
     int err = IO_DONE;
     size_t total = 0;
-    while (err == IO_DONE) {
-        const char *data; size_t count;
-        err = buffer_get(buf, &data, &count);
+    while (total < wanted && err == IO_DONE) {
+        size_t count; const char *buffered;
+        if (buffer_isempty(buf) && wanted - total >= buf->want) {
+            err = recvdirect(buf, data + total, wanted - total, &count);
+            total += count;
+            break;
+        }
+        err = buffer_get(buf, &buffered, &count);
+        count = MIN(count, wanted - total);
+        if (count > 0) memcpy(data + total, buffered, count);
+        buffer_skip(buf, count);
         total += count;
-        luaL_addlstring(b, data, count);
+    }
+    *got = total;
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Reads a fixed number of bytes from the transport into caller memory,
+* bypassing the buffer, which must be empty
+\*-------------------------------------------------------------------------*/
+static int recvdirect(p_buffer buf, char *data, size_t wanted, size_t *got) {
+    p_io io = buf->io;
+    int err = IO_DONE;
+    size_t total = 0;
+    /* the peer may be waiting on our pending output before replying */
+    if (buf->outlen > 0) err = buffer_flush(buf);
+    while (total < wanted && err == IO_DONE) {
+        size_t done = 0;
+        err = io->recv(io->ctx, data + total, wanted - total, &done, buf->tm);
+#ifdef LUASOCKET_DEBUG
+        buf->recvs++;
+#endif
+        total += done;
+    }
+    buf->received += total;
+    *got = total;
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Reads everything until the connection is closed. Whatever is buffered
+* goes first, the rest is read straight into the result in growing steps.
+* total counts bytes an earlier call already received, which make the end
+* of file a success even if nothing more arrives
+\*-------------------------------------------------------------------------*/
+static int recvall(p_buffer buf, size_t total, luaL_Buffer *b) {
+    p_io io = buf->io;
+    int err = IO_DONE;
+    size_t step = MIN(buf->want, PREPMAX);
+    if (!buffer_isempty(buf)) {
+        size_t count = buf->last - buf->first;
+        luaL_addlstring(b, buf->data + buf->first, count);
         buffer_skip(buf, count);
+        total += count;
+    }
+    /* the peer may be waiting on our pending output before replying */
+    if (buf->outlen > 0) err = buffer_flush(buf);
+    while (err == IO_DONE) {
+        size_t got = 0;
+        err = io->recv(io->ctx, luaL_prepbuffsize(b, step), step, &got,
+            buf->tm);
+#ifdef LUASOCKET_DEBUG
+        buf->recvs++;
+#endif
+        luaL_addsize(b, got);
+        buf->received += got;
+        total += got;
+        if (got == step) step = MIN(step << 1, MIN(BUF_MAXSIZE, PREPMAX));
     }
     if (err == IO_CLOSED) {
         if (total > 0) return IO_DONE;
@@ -218,6 +992,208 @@ static int recvall(p_buffer buf, luaL_Buffer *b) {
     } else return err;
 }
 
+/*-------------------------------------------------------------------------*\
+* Parses a frame prefix layout: an optional '<' (little endian) or '>' (big
+* endian, the default), followed by 'I' and the size in bytes: 1, 2, 4 or 8
+\*-------------------------------------------------------------------------*/
+static void checkframespec(lua_State *L, int arg, p_framespec spec) {
+    const char *p = luaL_optstring(L, arg, ">I4");
+    spec->little = 0;
+    spec->size = 0;
+    if (*p == '<' || *p == '>') spec->little = (*p++ == '<');
+    if (*p == 'I') {
+        p++;
+        while (*p >= '0' && *p <= '9' && spec->size <= FRAME_MAXPREFIX)
+            spec->size = spec->size*10 + (size_t) (*p++ - '0');
+    }
+    if (*p != '\0' || (spec->size != 1 && spec->size != 2 &&
+            spec->size != 4 && spec->size != 8))
+        luaL_argerror(L, arg, "invalid frame prefix");
+}
+
+/*-------------------------------------------------------------------------*\
+* Gets the optional largest frame length, unlimited by default
+\*-------------------------------------------------------------------------*/
+static size_t checkframemax(lua_State *L, int arg) {
+    double n;
+    if (lua_isnoneornil(L, arg)) return (size_t) -1;
+    n = luaL_checknumber(L, arg);
+    luaL_argcheck(L, n >= 0, arg, "invalid maximum length");
+    return (size_t) n;
+}
+
+/*-------------------------------------------------------------------------*\
+* Decodes a frame length prefix. Fails with IO_LIMIT if it does not fit
+* in a size_t.
+\*-------------------------------------------------------------------------*/
+static int framelength(p_framespec spec, const char *header, size_t *len) {
+    size_t i, n = 0;
+    for (i = 0; i < spec->size; i++) {
+        unsigned char c = (unsigned char)
+            header[spec->little? spec->size-1-i: i];
+        if (n > ((size_t) -1 >> 8)) return IO_LIMIT;
+        n = (n << 8) | c;
+    }
+    *len = n;
+    return IO_DONE;
+}
+
+/*-------------------------------------------------------------------------*\
+* Reads a whole frame. The partial result of a previous call, length prefix
+* included, is taken first. The prefix goes to header, the rest of the
+* frame to b. Fails with IO_LIMIT, after consuming the prefix, if the frame
+* is longer than max.
+\*-------------------------------------------------------------------------*/
+static int recvframe(p_buffer buf, p_framespec spec, size_t max,
+        const char *part, size_t size, char *header, size_t *hgot,
+        luaL_Buffer *b) {
+    int err = IO_DONE;
+    size_t len, have = MIN(size, spec->size), got = 0;
+    memcpy(header, part, have);
+    /* what is left of the partial result belongs to the frame itself */
+    part += have;
+    size -= have;
+    if (have < spec->size) {
+        err = recvinto(buf, header + have, spec->size - have, &got);
+        have += got;
+    }
+    *hgot = have;
+    if (err != IO_DONE) return err;
+    if ((err = framelength(spec, header, &len)) != IO_DONE) return err;
+    /* a partial result never holds more than its own frame */
+    if (len > max || size > len) return IO_LIMIT;
+    luaL_addlstring(b, part, size);
+    if (len > size) err = recvraw(buf, len - size, b);
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Pushes the next frame if it is completely buffered. Returns 0, pushing
+* nothing, otherwise.
+\*-------------------------------------------------------------------------*/
+static int pushframe(lua_State *L, p_buffer buf, p_framespec spec,
+        size_t max) {
+    size_t count, len;
+    const char *data;
+    if (buffer_isempty(buf)) return 0;
+    count = buf->last - buf->first;
+    data = buf->data + buf->first;
+    if (count < spec->size || framelength(spec, data, &len) != IO_DONE ||
+            len > max || len > count - spec->size) return 0;
+    lua_pushlstring(L, data + spec->size, len);
+    buffer_skip(buf, spec->size + len);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Pushes the frame read by recvframe. After an error, the length prefix is
+* put back in front, so that the partial result can be passed to the next
+* call.
+\*-------------------------------------------------------------------------*/
+static void pushframepart(lua_State *L, int err, const char *header,
+        size_t hgot, luaL_Buffer *b) {
+    luaL_pushresult(b);
+    if (err != IO_DONE && hgot > 0) {
+        lua_pushlstring(L, header, hgot);
+        lua_insert(L, -2);
+        lua_concat(L, 2);
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Reads whatever is available, up to max bytes, without waiting. Buffered
+* data is returned as is; otherwise a single read is tried with a zero
+* timeout. Nothing available is not an error: the result is just empty.
+\*-------------------------------------------------------------------------*/
+static int recvavail(p_buffer buf, size_t max, luaL_Buffer *b) {
+    p_io io = buf->io;
+    p_timeout tm = buf->tm;
+    t_timeout zero;
+    size_t got = 0, step = MIN(max, MIN(BUF_MAXSIZE, PREPMAX));
+    int err = IO_DONE;
+    if (!buffer_isempty(buf)) {
+        got = MIN(max, buf->last - buf->first);
+        luaL_addlstring(b, buf->data + buf->first, got);
+        buffer_skip(buf, got);
+        return IO_DONE;
+    }
+    timeout_init(&zero, 0.0, -1.0);
+    timeout_markstart(&zero);
+    /* push out what fits, but never wait for the peer to make room */
+    if (buf->outlen > 0) {
+        buf->tm = &zero;
+        err = buffer_flush(buf);
+        buf->tm = tm;
+        if (err != IO_DONE && err != IO_TIMEOUT) return err;
+    }
+    err = io->recv(io->ctx, luaL_prepbuffsize(b, step), step, &got, &zero);
+#ifdef LUASOCKET_DEBUG
+    buf->recvs++;
+#endif
+    luaL_addsize(b, got);
+    buf->received += got;
+    if (err == IO_TIMEOUT) return IO_DONE;
+    if (err == IO_CLOSED && got > 0) return IO_DONE;
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Reads everything up to a delimiter, which is discarded from the buffer and
+* not returned. Bytes that might start the delimiter are kept in the buffer
+* until more data arrives, so that a call resumed after a timeout still
+* finds it. Fails with IO_LIMIT after max bytes without the delimiter.
+\*-------------------------------------------------------------------------*/
+static int recvuntil(p_buffer buf, const char *delim, size_t dlen,
+        size_t max, size_t total, luaL_Buffer *b) {
+    int err = IO_DONE;
+    size_t keep = 0;
+    if (total > max) return IO_LIMIT;
+    while (err == IO_DONE) {
+        size_t count, take; const char *data, *hit;
+        err = keep? buffer_fill(buf, &data, &count):
+            buffer_get(buf, &data, &count);
+        hit = finddelim(data, count, delim, dlen, &keep);
+        take = hit? (size_t) (hit - data): count - keep;
+        /* a broken connection will never complete the delimiter */
+        if (!hit && err != IO_DONE && err != IO_TIMEOUT) take = count;
+        if (take > max - total) {
+            luaL_addlstring(b, data, max - total);
+            buffer_skip(buf, max - total);
+            return IO_LIMIT;
+        }
+        luaL_addlstring(b, data, take);
+        buffer_skip(buf, take);
+        total += take;
+        if (hit) {
+            buffer_skip(buf, dlen);
+            return IO_DONE;
+        }
+    }
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Finds the first occurrence of the delimiter in the data. If there is none,
+* keep receives the length of the longest tail of the data that is a prefix
+* of the delimiter.
+\*-------------------------------------------------------------------------*/
+static const char *finddelim(const char *data, size_t count,
+        const char *delim, size_t dlen, size_t *keep) {
+    const char *p = data, *end = data + count;
+    *keep = 0;
+    while (p < end && (p = (const char *) memchr(p, delim[0], end-p))) {
+        size_t left = (size_t) (end - p);
+        if (left >= dlen) {
+            if (memcmp(p, delim, dlen) == 0) return p;
+        } else if (memcmp(p, delim, left) == 0) {
+            *keep = left;
+            return NULL;
+        }
+        p++;
+    }
+    return NULL;
+}
+
 /*-------------------------------------------------------------------------*\
 * Reads a line terminated by a CR LF pair or just by a LF. The CR and LF
 * are not returned by the function and are discarded from the buffer
@@ -225,15 +1201,13 @@ static int recvall(p_buffer buf, luaL_Buffer *b) {
 static int recvline(p_buffer buf, luaL_Buffer *b) {
     int err = IO_DONE;
     while (err == IO_DONE) {
-        size_t count, pos; const char *data;
+        size_t count, pos; const char *data, *nl = NULL;
         err = buffer_get(buf, &data, &count);
-        pos = 0;
-        while (pos < count && data[pos] != '\n') {
-            /* we ignore all \r's */
-            if (data[pos] != '\r') luaL_addchar(b, data[pos]);
-            pos++;
-        }
-        if (pos < count) { /* found '\n' */
+        /* the C library scans for the terminator many bytes at a time */
+        if (count > 0) nl = (const char *) memchr(data, '\n', count);
+        pos = nl? (size_t) (nl - data): count;
+        addline(b, data, pos);
+        if (nl) { /* found '\n' */
             buffer_skip(buf, pos+1); /* skip '\n' too */
             break; /* we are done */
         } else /* reached the end of the buffer */
@@ -242,6 +1216,36 @@ static int recvline(p_buffer buf, luaL_Buffer *b) {
     return err;
 }
 
+/*-------------------------------------------------------------------------*\
+* Appends part of a line to the result, in spans between the \r's, which
+* are all ignored
+\*-------------------------------------------------------------------------*/
+static void addline(luaL_Buffer *b, const char *data, size_t count) {
+    while (count > 0) {
+        const char *cr = (const char *) memchr(data, '\r', count);
+        size_t span = cr? (size_t) (cr - data): count;
+        luaL_addlstring(b, data, span);
+        if (!cr) break;
+        data += span+1;
+        count -= span+1;
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Pushes a complete line, without its \r's. Lines with a single CR right
+* before the LF need no copying
+\*-------------------------------------------------------------------------*/
+static void pushline(lua_State *L, const char *data, size_t count) {
+    size_t len = (count > 0 && data[count-1] == '\r')? count-1: count;
+    if (len == 0 || !memchr(data, '\r', len)) lua_pushlstring(L, data, len);
+    else {
+        luaL_Buffer b;
+        luaL_buffinit(L, &b);
+        addline(&b, data, len);
+        luaL_pushresult(&b);
+    }
+}
+
 /*-------------------------------------------------------------------------*\
 * Skips a given number of bytes from read buffer. No data is read from the
 * transport layer
@@ -249,8 +1253,78 @@ static int recvline(p_buffer buf, luaL_Buffer *b) {
 static void buffer_skip(p_buffer buf, size_t count) {
     buf->received += count;
     buf->first += count;
-    if (buffer_isempty(buf))
+    if (buffer_isempty(buf)) {
         buf->first = buf->last = 0;
+        buffer_release(buf);
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Reads more data into a buffer that is not empty, past what it holds.
+* Returns everything in the buffer.
+\*-------------------------------------------------------------------------*/
+static int buffer_fill(p_buffer buf, const char **data, size_t *count) {
+    int err = IO_DONE;
+    size_t left = buf->last - buf->first, got = 0;
+    p_io io = buf->io;
+    if (buf->outlen > 0) err = buffer_flush(buf);
+    if (err == IO_DONE) {
+        memmove(buf->data, buf->data + buf->first, left);
+        buf->first = 0;
+        buf->last = left;
+        err = io->recv(io->ctx, buf->data + left, buf->size - left, &got,
+            buf->tm);
+#ifdef LUASOCKET_DEBUG
+        buf->recvs++;
+#endif
+        buf->last += got;
+    }
+    *data = buf->data + buf->first;
+    *count = buf->last - buf->first;
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Marks the start of an operation. Debug builds also note the time on
+* their own, to report how long the operation took even when its timeout
+* does not need the start
+\*-------------------------------------------------------------------------*/
+static void buffer_markstart(p_buffer buf) {
+    timeout_markstart(buf->tm);
+#ifdef LUASOCKET_DEBUG
+    buf->start = timeout_monotime();
+#endif
+}
+
+/*-------------------------------------------------------------------------*\
+* Gives the buffer storage back to the pool
+\*-------------------------------------------------------------------------*/
+static void buffer_release(p_buffer buf) {
+    if (buf->data) {
+        bufferpool_put(buf->pool, buf->data, buf->size);
+        buf->data = NULL;
+        buf->size = 0;
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Gives the output storage back to the pool
+\*-------------------------------------------------------------------------*/
+static void buffer_releaseout(p_buffer buf) {
+    if (buf->out) {
+        bufferpool_put(buf->pool, buf->out, buf->outsize);
+        buf->out = NULL;
+        buf->outsize = 0;
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Rounds a buffer size up to a power of two within the selectable range
+\*-------------------------------------------------------------------------*/
+static size_t buffer_roundsize(double n) {
+    size_t size = BUF_MINSIZE;
+    while (size < n && size < BUF_MAXSIZE) size <<= 1;
+    return size;
 }
 
 /*-------------------------------------------------------------------------*\
@@ -263,11 +1337,141 @@ static int buffer_get(p_buffer buf, const char **data, size_t *count) {
     p_timeout tm = buf->tm;
     if (buffer_isempty(buf)) {
         size_t got;
-        err = io->recv(io->ctx, buf->data, BUF_SIZE, &got, tm);
+        /* the peer may be waiting on our pending output before replying */
+        if (buf->outlen > 0 && (err = buffer_flush(buf)) != IO_DONE) {
+            *count = 0;
+            *data = NULL;
+            return err;
+        }
+        /* storage is only attached while there is data to hold */
+        if (!buf->data) {
+            buf->data = bufferpool_get(buf->pool, buf->want);
+            if (!buf->data) {
+                *count = 0;
+                *data = NULL;
+                return ENOMEM;
+            }
+            buf->size = buf->want;
+        }
+        err = io->recv(io->ctx, buf->data, buf->size, &got, tm);
+#ifdef LUASOCKET_DEBUG
+        buf->recvs++;
+#endif
         buf->first = 0;
         buf->last = got;
+        if (buf->adaptive && got > 0) buffer_adapt(buf, got);
+        if (got == 0) buffer_release(buf);
     }
     *count = buf->last - buf->first;
-    *data = buf->data + buf->first;
+    *data = buf->data? buf->data + buf->first: NULL;
     return err;
 }
+
+/*-------------------------------------------------------------------------*\
+* Adapts the size of the next storage to how much the last receive got.
+* Storage that was filled up doubles, storage that was mostly empty a few
+* times in a row halves.
+\*-------------------------------------------------------------------------*/
+static void buffer_adapt(p_buffer buf, size_t got) {
+    if (got >= buf->size) {
+        buf->lows = 0;
+        if (buf->size < BUF_MAXSIZE) buf->want = buf->size << 1;
+    } else if (got <= buf->size/4) {
+        if (++buf->lows >= BUF_ADAPTLOWS) {
+            buf->lows = 0;
+            if (buf->size > BUF_MINSIZE) buf->want = buf->size >> 1;
+        }
+    } else buf->lows = 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the pool of the Lua state, creating it if needed
+\*-------------------------------------------------------------------------*/
+static p_bufferpool bufferpool_open(lua_State *L) {
+    p_bufferpool pool;
+    lua_pushlightuserdata(L, &bufferpool_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    pool = (p_bufferpool) lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (!pool) {
+        pool = (p_bufferpool) lua_newuserdata(L, sizeof(t_bufferpool));
+        memset(pool, 0, sizeof(t_bufferpool));
+        pool->max = BUF_POOLSIZE;
+        lua_newtable(L);
+        lua_pushstring(L, "__gc");
+        lua_pushcfunction(L, bufferpool_gc);
+        lua_rawset(L, -3);
+        lua_setmetatable(L, -2);
+        lua_pushlightuserdata(L, &bufferpool_key);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+        lua_pop(L, 1);
+    }
+    return pool;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the size class of a storage size, or -1 if it is not pooled
+\*-------------------------------------------------------------------------*/
+static int bufferpool_class(size_t size) {
+    int c = 0;
+    size_t s = (size_t) 1 << BUF_POOLMINLOG;
+    while (s < size && c < BUF_POOLCLASSES) {
+        s <<= 1;
+        c++;
+    }
+    return (s == size && c < BUF_POOLCLASSES)? c: -1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Takes storage from the pool, or allocates it if there is none idle
+\*-------------------------------------------------------------------------*/
+static char *bufferpool_get(p_bufferpool pool, size_t size) {
+    int c = bufferpool_class(size);
+    if (c >= 0 && pool->free[c]) {
+        char *data = (char *) pool->free[c];
+        pool->free[c] = *(void **) data;
+        pool->idle -= size;
+        return data;
+    }
+    return (char *) malloc(size);
+}
+
+/*-------------------------------------------------------------------------*\
+* Gives storage back to the pool, or frees it if the pool is full
+\*-------------------------------------------------------------------------*/
+static void bufferpool_put(p_bufferpool pool, char *data, size_t size) {
+    int c = bufferpool_class(size);
+    if (c >= 0 && pool->idle + size <= pool->max) {
+        *(void **) data = pool->free[c];
+        pool->free[c] = data;
+        pool->idle += size;
+    } else free(data);
+}
+
+/*-------------------------------------------------------------------------*\
+* Frees idle storage until the pool is within its maximum size
+\*-------------------------------------------------------------------------*/
+static void bufferpool_trim(p_bufferpool pool) {
+    int c;
+    for (c = BUF_POOLCLASSES-1; c >= 0 && pool->idle > pool->max; c--) {
+        size_t size = (size_t) 1 << (BUF_POOLMINLOG + c);
+        while (pool->free[c] && pool->idle > pool->max) {
+            void *data = pool->free[c];
+            pool->free[c] = *(void **) data;
+            pool->idle -= size;
+            free(data);
+        }
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Frees all idle storage when the Lua state is closed. Objects finalized
+* after the pool free their storage directly.
+\*-------------------------------------------------------------------------*/
+static int bufferpool_gc(lua_State *L) {
+    p_bufferpool pool = (p_bufferpool) lua_touserdata(L, 1);
+    pool->max = 0;
+    bufferpool_trim(pool);
+    return 0;
+}
@@ -9,8 +9,16 @@
 * LuaSocket interface for input/output on connected objects, as seen by 
 * Lua programs. 
 *
-* Input is buffered. Output is *not* buffered because there was no simple
-* way of making sure the buffered output data would ever be sent.
+* Input is buffered. Output is *not* buffered by default, because there was
+* no simple way of making sure the buffered output data would ever be sent.
+* Objects can opt in to output buffering, in which case small writes are
+* coalesced until they reach a high-water mark, until the object is
+* explicitly flushed, or until a receive has to wait on the transport.
+*
+* Buffer storage is only attached to an object while it holds unread data.
+* When the data is consumed, the storage goes back to a pool shared by all
+* objects created in the same Lua state, so idle objects cost nothing more
+* than their control structure.
 *
 * The module is built on top of the I/O abstraction defined in io.h and the
 * timeout management is done with the timeout.h interface.
@@ -19,9 +27,30 @@
 #include "io.h"
 #include "timeout.h"
 
-/* buffer size in bytes */
+/* default buffer size in bytes */
 #define BUF_SIZE 8192
 
+/* smallest storage size class kept by the pool, as a power of two */
+#define BUF_POOLMINLOG 10
+/* number of storage size classes kept by the pool (1 KB to 1 MB) */
+#define BUF_POOLCLASSES 11
+/* default maximum number of idle bytes kept by the pool */
+#define BUF_POOLSIZE (1024*1024)
+
+/* range of buffer sizes that can be selected */
+#define BUF_MINSIZE ((size_t) 1 << BUF_POOLMINLOG)
+#define BUF_MAXSIZE ((size_t) 1 << (BUF_POOLMINLOG+BUF_POOLCLASSES-1))
+/* consecutive mostly empty receives before an adaptive buffer shrinks */
+#define BUF_ADAPTLOWS 4
+
+/* pool of idle buffer storage, one per Lua state */
+typedef struct t_bufferpool_ {
+    size_t max;             /* maximum number of idle bytes kept */
+    size_t idle;            /* number of idle bytes currently kept */
+    void *free[BUF_POOLCLASSES]; /* free lists, one per size class */
+} t_bufferpool;
+typedef t_bufferpool *p_bufferpool;
+
 /* buffer control structure */
 typedef struct t_buffer_ {
     double birthday;        /* throttle support info: creation time, */
@@ -29,7 +58,19 @@ typedef struct t_buffer_ {
     p_io io;                /* IO driver used for this buffer */
     p_timeout tm;           /* timeout management for this buffer */
     size_t first, last;     /* index of first and last bytes of stored data */
-    char data[BUF_SIZE];    /* storage space for buffer data */
+    size_t size;            /* size of attached storage, 0 if detached */
+    char *data;             /* storage space for buffer data, or NULL */
+    p_bufferpool pool;      /* where storage comes from and goes back to */
+    size_t outmax;          /* output high-water mark, 0 if unbuffered */
+    size_t outsize, outlen; /* size of output storage, and bytes pending */
+    char *out;              /* output storage, attached only while pending */
+    size_t want;            /* size of storage to attach next time */
+    int adaptive;           /* adapt size to how full receives have been */
+    int lows;               /* consecutive receives that were mostly empty */
+#ifdef LUASOCKET_DEBUG
+    size_t recvs, sends;    /* number of calls made to the IO driver */
+    double start;           /* when the current operation started */
+#endif
 } t_buffer;
 typedef t_buffer *p_buffer;
 
@@ -38,12 +79,28 @@ typedef t_buffer *p_buffer;
 #endif
 
 int buffer_open(lua_State *L);
-void buffer_init(p_buffer buf, p_io io, p_timeout tm);
+void buffer_init(lua_State *L, p_buffer buf, p_io io, p_timeout tm);
+void buffer_destroy(p_buffer buf);
 int buffer_meth_getstats(lua_State *L, p_buffer buf);
 int buffer_meth_setstats(lua_State *L, p_buffer buf);
+int buffer_meth_getbuffersize(lua_State *L, p_buffer buf);
+int buffer_meth_setbuffersize(lua_State *L, p_buffer buf);
+int buffer_meth_getoutputbuffer(lua_State *L, p_buffer buf);
+int buffer_meth_setoutputbuffer(lua_State *L, p_buffer buf);
 int buffer_meth_send(lua_State *L, p_buffer buf);
+int buffer_meth_sendv(lua_State *L, p_buffer buf);
+int buffer_meth_flush(lua_State *L, p_buffer buf);
 int buffer_meth_receive(lua_State *L, p_buffer buf);
+int buffer_receive(lua_State *L, p_buffer buf, size_t held, size_t received);
+int buffer_meth_peek(lua_State *L, p_buffer buf);
+int buffer_meth_receivelines(lua_State *L, p_buffer buf);
+int buffer_meth_receiveframe(lua_State *L, p_buffer buf);
+int buffer_meth_receiveframes(lua_State *L, p_buffer buf);
+int buffer_meth_receiveinto(lua_State *L, p_buffer buf);
+int buffer_meth_sendfrom(lua_State *L, p_buffer buf);
+int buffer_meth_sendframe(lua_State *L, p_buffer buf);
 int buffer_isempty(p_buffer buf);
+int buffer_flush(p_buffer buf);
 
 #ifndef _WIN32
 #pragma GCC visibility pop
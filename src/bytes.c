@@ -0,0 +1,176 @@
+/*=========================================================================*\
+* Mutable byte buffers
+* LuaSocket toolkit
+\*=========================================================================*/
+#include "luasocket.h"
+
+#include "auxiliar.h"
+#include "bytes.h"
+
+#include <string.h>
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static int global_create(lua_State *L);
+static int meth_len(lua_State *L);
+static int meth_sub(lua_State *L);
+static int meth_find(lua_State *L);
+static int meth_set(lua_State *L);
+static void getslice(lua_State *L, size_t size, int arg, size_t *start,
+    size_t *end);
+
+/* bytes object methods */
+static luaL_Reg bytes_methods[] = {
+    {"__len",       meth_len},
+    {"__tostring",  meth_sub},
+    {"find",        meth_find},
+    {"len",         meth_len},
+    {"set",         meth_set},
+    {"sub",         meth_sub},
+    {NULL,          NULL}
+};
+
+/* functions in library namespace */
+static luaL_Reg func[] = {
+    {"bytes", global_create},
+    {NULL,    NULL}
+};
+
+/*-------------------------------------------------------------------------*\
+* Initializes module
+\*-------------------------------------------------------------------------*/
+int bytes_open(lua_State *L) {
+    auxiliar_newclass(L, "bytes{buffer}", bytes_methods);
+    luaL_setfuncs(L, func, 0);
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Makes sure argument is a bytes object
+\*-------------------------------------------------------------------------*/
+p_bytes bytes_check(lua_State *L, int objidx) {
+    return (p_bytes) auxiliar_checkclass(L, "bytes{buffer}", objidx);
+}
+
+/*-------------------------------------------------------------------------*\
+* Checks an optional offset and byte count at arg and arg+1. The count
+* defaults to the rest of the object. Returns the 0-based start.
+\*-------------------------------------------------------------------------*/
+size_t bytes_checkrange(lua_State *L, p_bytes bytes, int arg, size_t *count) {
+    lua_Number offset = luaL_optnumber(L, arg, 1);
+    lua_Number n;
+    luaL_argcheck(L, offset >= 1 && offset <= (lua_Number) bytes->size + 1,
+        arg, "offset out of range");
+    n = luaL_optnumber(L, arg+1, (lua_Number) bytes->size - offset + 1);
+    luaL_argcheck(L, n >= 0 && offset + n - 1 <= (lua_Number) bytes->size,
+        arg+1, "count out of range");
+    *count = (size_t) n;
+    return (size_t) offset - 1;
+}
+
+/*=========================================================================*\
+* Lua methods
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Returns the size of the object
+\*-------------------------------------------------------------------------*/
+static int meth_len(lua_State *L) {
+    p_bytes bytes = bytes_check(L, 1);
+    lua_pushnumber(L, (lua_Number) bytes->size);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns part of the contents as a string, like string.sub
+\*-------------------------------------------------------------------------*/
+static int meth_sub(lua_State *L) {
+    p_bytes bytes = bytes_check(L, 1);
+    size_t start, end;
+    getslice(L, bytes->size, 2, &start, &end);
+    if (start <= end) lua_pushlstring(L, bytes->data+start-1, end-start+1);
+    else lua_pushliteral(L, "");
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Finds a plain string within [i, j] and returns where it starts and ends
+\*-------------------------------------------------------------------------*/
+static int meth_find(lua_State *L) {
+    p_bytes bytes = bytes_check(L, 1);
+    size_t len, start, end;
+    const char *str = luaL_checklstring(L, 2, &len);
+    const char *p, *last;
+    getslice(L, bytes->size, 3, &start, &end);
+    /* like string.find, the empty string matches right at the start */
+    if (len == 0 && start <= end + 1) {
+        lua_pushnumber(L, (lua_Number) start);
+        lua_pushnumber(L, (lua_Number) start - 1);
+        return 2;
+    }
+    if (len == 0 || start > end || end - start + 1 < len) {
+        lua_pushnil(L);
+        return 1;
+    }
+    p = bytes->data + start - 1;
+    last = bytes->data + end - len;
+    while (p <= last && (p = (const char *) memchr(p, str[0], last-p+1))) {
+        if (memcmp(p, str, len) == 0) {
+            size_t pos = (size_t) (p - bytes->data) + 1;
+            lua_pushnumber(L, (lua_Number) pos);
+            lua_pushnumber(L, (lua_Number) (pos + len - 1));
+            return 2;
+        }
+        p++;
+    }
+    lua_pushnil(L);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Copies a string into the object at a given offset
+\*-------------------------------------------------------------------------*/
+static int meth_set(lua_State *L) {
+    p_bytes bytes = bytes_check(L, 1);
+    lua_Number offset = luaL_checknumber(L, 2);
+    size_t len;
+    const char *str = luaL_checklstring(L, 3, &len);
+    luaL_argcheck(L, offset >= 1 &&
+        offset + len - 1 <= (lua_Number) bytes->size, 2,
+        "offset out of range");
+    memcpy(bytes->data + (size_t) offset - 1, str, len);
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Creates a zero-filled object with the given size
+\*-------------------------------------------------------------------------*/
+static int global_create(lua_State *L) {
+    lua_Number n = luaL_checknumber(L, 1);
+    p_bytes bytes;
+    luaL_argcheck(L, n >= 0, 1, "invalid size");
+    bytes = (p_bytes) lua_newuserdata(L, sizeof(t_bytes) + (size_t) n);
+    bytes->size = (size_t) n;
+    memset(bytes->data, 0, bytes->size);
+    auxiliar_setclass(L, "bytes{buffer}", -1);
+    return 1;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Reads optional i and j arguments the way string.sub does, and clamps them
+* to [1, size]
+\*-------------------------------------------------------------------------*/
+static void getslice(lua_State *L, size_t size, int arg, size_t *start,
+        size_t *end) {
+    long i = (long) luaL_optnumber(L, arg, 1);
+    long j = (long) luaL_optnumber(L, arg+1, -1);
+    if (i < 0) i = (long) (size+i+1);
+    if (j < 0) j = (long) (size+j+1);
+    if (i < 1) i = 1;
+    if (j > (long) size) j = (long) size;
+    *start = (size_t) i;
+    *end = j < 0? 0: (size_t) j;
+}
@@ -0,0 +1,32 @@
+#ifndef BYTES_H
+#define BYTES_H
+/*=========================================================================*\
+* Mutable byte buffers
+* LuaSocket toolkit
+*
+* A bytes object is a fixed-size block of memory that Lua code can reuse
+* across many receive and send calls. Data goes from the transport layer
+* straight into the object, without creating a new Lua string per call.
+* Positions follow the string library conventions.
+\*=========================================================================*/
+#include "luasocket.h"
+
+typedef struct t_bytes_ {
+    size_t size;            /* number of bytes in the object */
+    char data[1];           /* contents, allocated along with the object */
+} t_bytes;
+typedef t_bytes *p_bytes;
+
+#ifndef _WIN32
+#pragma GCC visibility push(hidden)
+#endif
+
+int bytes_open(lua_State *L);
+p_bytes bytes_check(lua_State *L, int objidx);
+size_t bytes_checkrange(lua_State *L, p_bytes bytes, int arg, size_t *count);
+
+#ifndef _WIN32
+#pragma GCC visibility pop
+#endif
+
+#endif /* BYTES_H */
@@ -37,3 +37,22 @@ void *luasocket_testudata (lua_State *L, int ud, const char *tname) {
 }
 
 #endif
+
+#if LUA_VERSION_NUM < 504
+
+/*
+** Before 5.4, the stack of a suspended coroutine holds only the values
+** it yielded
+*/
+int luasocket_resume(lua_State *co, lua_State *from, int narg, int *nres) {
+#if LUA_VERSION_NUM == 501
+  int status = lua_resume(co, narg);
+  (void) from;
+#else
+  int status = lua_resume(co, from, narg);
+#endif
+  *nres = lua_gettop(co);
+  return status;
+}
+
+#endif
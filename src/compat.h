@@ -16,6 +16,26 @@ void *luasocket_testudata ( lua_State *L, int arg, const char *tname);
 
 #define luaL_setfuncs luasocket_setfuncs
 #define luaL_testudata luasocket_testudata
+#define lua_rawlen lua_objlen
+#define luaL_prepbuffsize(B, sz) luaL_prepbuffer(B)
+
+#endif
+
+/* lua_resume takes the calling thread since 5.2, and also returns the
+* number of values yielded since 5.4 */
+#if LUA_VERSION_NUM >= 504
+#define luasocket_resume(co, from, narg, nres) lua_resume(co, from, narg, nres)
+#else
+
+#ifndef _WIN32
+#pragma GCC visibility push(hidden)
+#endif
+
+int luasocket_resume(lua_State *co, lua_State *from, int narg, int *nres);
+
+#ifndef _WIN32
+#pragma GCC visibility pop
+#endif
 
 #endif
 
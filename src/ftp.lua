@@ -34,23 +34,32 @@ _M.PASSWORD = "anonymous@anonymous.org"
 -----------------------------------------------------------------------------
 local metat = { __index = {} }
 
-function _M.open(server, port, create)
-    local tp = socket.try(tp.connect(server, port or PORT, _M.TIMEOUT, create))
-    local f = base.setmetatable({ tp = tp }, metat)
+function _M.open(server, port, create, deadline)
+    local tp = socket.try(tp.connect(server, port or PORT, _M.TIMEOUT, create,
+        deadline))
+    local f = base.setmetatable({ tp = tp, deadline = deadline }, metat)
     -- make sure everything gets closed in an exception
     f.try = socket.newtry(function() f:close() end)
     return f
 end
 
+-- data connections share the deadline of the control connection
+local function setdeadline(f, c)
+    if f.deadline then f.try(c:setdeadline(f.deadline)) end
+end
+
 function metat.__index:portconnect()
     self.try(self.server:settimeout(_M.TIMEOUT))
+    setdeadline(self, self.server)
     self.data = self.try(self.server:accept())
     self.try(self.data:settimeout(_M.TIMEOUT))
+    setdeadline(self, self.data)
 end
 
 function metat.__index:pasvconnect()
     self.data = self.try(socket.tcp())
     self.try(self.data:settimeout(_M.TIMEOUT))
+    setdeadline(self, self.data)
     self.try(self.data:connect(self.pasvt.address, self.pasvt.port))
 end
 
@@ -236,7 +245,7 @@ end
 local function tput(putt)
     putt = override(putt)
     socket.try(putt.host, "missing hostname")
-    local f = _M.open(putt.host, putt.port, putt.create)
+    local f = _M.open(putt.host, putt.port, putt.create, putt.deadline)
     f:greet()
     f:login(putt.user, putt.password)
     if putt.type then f:type(putt.type) end
@@ -281,7 +290,7 @@ end)
 local function tget(gett)
     gett = override(gett)
     socket.try(gett.host, "missing hostname")
-    local f = _M.open(gett.host, gett.port, gett.create)
+    local f = _M.open(gett.host, gett.port, gett.create, gett.deadline)
     f:greet()
     f:login(gett.user, gett.password)
     if gett.type then f:type(gett.type) end
@@ -303,7 +312,7 @@ _M.command = socket.protect(function(cmdt)
     cmdt = override(cmdt)
     socket.try(cmdt.host, "missing hostname")
     socket.try(cmdt.command, "missing command")
-    local f = _M.open(cmdt.host, cmdt.port, cmdt.create)
+    local f = _M.open(cmdt.host, cmdt.port, cmdt.create, cmdt.deadline)
     f:greet()
     f:login(cmdt.user, cmdt.password)
     if type(cmdt.command) == "table" then
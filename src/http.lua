@@ -109,6 +109,8 @@ socket.sinkt["http-chunked"] = function(sock)
         __call = function(self, chunk, err)
             if not chunk then return sock:send("0\r\n\r\n") end
             local size = string.format("%X\r\n", string.len(chunk))
+            -- avoid copying the chunk when the socket can gather writes
+            if sock.sendv then return sock:sendv(size, chunk, "\r\n") end
             return sock:send(size ..  chunk .. "\r\n")
         end
     })
@@ -119,7 +121,7 @@ end
 -----------------------------------------------------------------------------
 local metat = { __index = {} }
 
-function _M.open(host, port, create)
+function _M.open(host, port, create, deadline)
     -- create socket with user connect function, or with default
     local c = socket.try(create())
     local h = base.setmetatable({ c = c }, metat)
@@ -127,6 +129,11 @@ function _M.open(host, port, create)
     h.try = socket.newtry(function() h:close() end)
     -- set timeout before connecting
     h.try(c:settimeout(_M.TIMEOUT))
+    -- the deadline bounds the whole request, not each call
+    if deadline then
+        h.try(c.setdeadline, "deadline not supported")
+        h.try(c:setdeadline(deadline))
+    end
     h.try(c:connect(host, port))
     -- here everything worked
     return h
@@ -345,7 +352,8 @@ local trequest, tredirect
         proxy = reqt.proxy,
         maxredirects = reqt.maxredirects,
         nredirects = (reqt.nredirects or 0) + 1,
-        create = reqt.create
+        create = reqt.create,
+        deadline = reqt.deadline
     }
     -- pass location header back as a hint we redirected
     headers = headers or {}
@@ -357,7 +365,7 @@ end
     -- we loop until we get what we want, or
     -- until we are sure there is no way to get it
     local nreqt = adjustrequest(reqt)
-    local h = _M.open(nreqt.host, nreqt.port, nreqt.create)
+    local h = _M.open(nreqt.host, nreqt.port, nreqt.create, nreqt.deadline)
     -- send request line and headers
     h:sendrequestline(nreqt.method, nreqt.uri)
     h:sendheaders(nreqt.headers)
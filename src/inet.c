@@ -18,6 +18,10 @@ static int inet_global_tohostname(lua_State *L);
 static int inet_global_getnameinfo(lua_State *L);
 static void inet_pushresolved(lua_State *L, struct hostent *hp);
 static int inet_global_gethostname(lua_State *L);
+static struct addrinfo *inet_nextaddress(struct addrinfo **first,
+    struct addrinfo **other, int family, int *turn);
+static const char *inet_tryrace(p_socket ps, int *family,
+    struct addrinfo *resolved, p_timeout tm, double delay);
 
 /* DNS functions */
 static luaL_Reg func[] = {
@@ -238,26 +242,20 @@ static int inet_global_gethostname(lua_State *L)
 \*-------------------------------------------------------------------------*/
 int inet_meth_getpeername(lua_State *L, p_socket ps, int family)
 {
-    int err;
+    const char *err;
     struct sockaddr_storage peer;
     socklen_t peer_len = sizeof(peer);
-    char name[INET6_ADDRSTRLEN];
-    char port[6]; /* 65535 = 5 bytes + 0 to terminate it */
     if (getpeername(*ps, (SA *) &peer, &peer_len) < 0) {
         lua_pushnil(L);
         lua_pushstring(L, socket_strerror(errno));
         return 2;
     }
-	err = getnameinfo((struct sockaddr *) &peer, peer_len,
-        name, INET6_ADDRSTRLEN,
-        port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
+    err = inet_pushaddress(L, (SA *) &peer, peer_len);
     if (err) {
         lua_pushnil(L);
-        lua_pushstring(L, LUA_GAI_STRERROR(err));
+        lua_pushstring(L, err);
         return 2;
     }
-    lua_pushstring(L, name);
-    lua_pushinteger(L, (int) strtol(port, (char **) NULL, 10));
     switch (family) {
         case AF_INET: lua_pushliteral(L, "inet"); break;
         case AF_INET6: lua_pushliteral(L, "inet6"); break;
@@ -272,25 +270,20 @@ int inet_meth_getpeername(lua_State *L, p_socket ps, int family)
 \*-------------------------------------------------------------------------*/
 int inet_meth_getsockname(lua_State *L, p_socket ps, int family)
 {
-    int err;
+    const char *err;
     struct sockaddr_storage peer;
     socklen_t peer_len = sizeof(peer);
-    char name[INET6_ADDRSTRLEN];
-    char port[6]; /* 65535 = 5 bytes + 0 to terminate it */
     if (getsockname(*ps, (SA *) &peer, &peer_len) < 0) {
         lua_pushnil(L);
         lua_pushstring(L, socket_strerror(errno));
         return 2;
     }
-	err=getnameinfo((struct sockaddr *)&peer, peer_len,
-		name, INET6_ADDRSTRLEN, port, 6, NI_NUMERICHOST | NI_NUMERICSERV);
+    err = inet_pushaddress(L, (SA *) &peer, peer_len);
     if (err) {
         lua_pushnil(L);
-        lua_pushstring(L, LUA_GAI_STRERROR(err));
+        lua_pushstring(L, err);
         return 2;
     }
-    lua_pushstring(L, name);
-    lua_pushinteger(L, (int) strtol(port, (char **) NULL, 10));
     switch (family) {
         case AF_INET: lua_pushliteral(L, "inet"); break;
         case AF_INET6: lua_pushliteral(L, "inet6"); break;
@@ -300,9 +293,133 @@ int inet_meth_getsockname(lua_State *L, p_socket ps, int family)
     return 3;
 }
 
+/*-------------------------------------------------------------------------*\
+* Pushes the numeric host and port of an address
+* Returns NULL on success, or an error message and pushes nothing
+\*-------------------------------------------------------------------------*/
+const char *inet_pushaddress(lua_State *L, SA *addr, socklen_t len)
+{
+    char name[INET6_ADDRSTRLEN];
+    char port[6]; /* 65535 = 5 bytes + 0 to terminate it */
+    int err = getnameinfo(addr, len, name, sizeof(name), port, sizeof(port),
+        NI_NUMERICHOST | NI_NUMERICSERV);
+    if (err) return LUA_GAI_STRERROR(err);
+    lua_pushstring(L, name);
+    lua_pushinteger(L, (int) strtol(port, (char **) NULL, 10));
+    return NULL;
+}
+
 /*=========================================================================*\
 * Internal functions
 \*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Hands out the resolved addresses alternating between families, starting
+* with the family the resolver prefers (RFC 8305, section 4)
+\*-------------------------------------------------------------------------*/
+static struct addrinfo *inet_nextaddress(struct addrinfo **first,
+    struct addrinfo **other, int family, int *turn)
+{
+    struct addrinfo *ai;
+    while (*first && (*first)->ai_family != family) *first = (*first)->ai_next;
+    while (*other && (*other)->ai_family == family) *other = (*other)->ai_next;
+    if (!*first && !*other) return NULL;
+    if (!*other || (*first && !*turn)) {
+        ai = *first;
+        *first = ai->ai_next;
+    } else {
+        ai = *other;
+        *other = ai->ai_next;
+    }
+    *turn = !*turn;
+    return ai;
+}
+
+/*-------------------------------------------------------------------------*\
+* Races connection attempts to the resolved addresses (RFC 8305). A new
+* attempt starts once the latest one has been in progress for delay
+* seconds, or right away when an attempt fails. The first attempt to
+* connect wins and the others are closed. All of them share the timeout,
+* so an address that drops packets cannot use it up on its own
+\*-------------------------------------------------------------------------*/
+static const char *inet_tryrace(p_socket ps, int *family,
+    struct addrinfo *resolved, p_timeout tm, double delay)
+{
+    t_socket socks[SOCKET_MAXCONNECTS];
+    int families[SOCKET_MAXCONNECTS];
+    struct addrinfo *first = resolved, *other = resolved, *next;
+    const char *err = NULL;
+    int n = 0, turn = 0, won = -1, which, ret, i;
+    double last = 0.0;
+    t_timeout zero, wait;
+    timeout_init(&zero, 0, -1);
+    next = inet_nextaddress(&first, &other, resolved->ai_family, &turn);
+    for ( ;; ) {
+        double t = timeout_getretry(tm);
+        /* start the next attempt once the latest had its head start */
+        if (next && n < SOCKET_MAXCONNECTS &&
+                (n == 0 || timeout_monotime() - last >= delay)) {
+            struct addrinfo *ai = next;
+            t_socket sock = SOCKET_INVALID;
+            next = inet_nextaddress(&first, &other, resolved->ai_family,
+                &turn);
+            err = inet_trycreate(&sock, ai->ai_family, ai->ai_socktype,
+                ai->ai_protocol);
+            if (err) continue;
+            last = timeout_monotime();
+            ret = socket_connect(&sock, ai->ai_addr,
+                (socklen_t) ai->ai_addrlen, &zero);
+            if (ret == IO_DONE || ret == IO_TIMEOUT) {
+                socks[n] = sock;
+                families[n++] = ai->ai_family;
+                if (ret == IO_DONE) {
+                    won = n-1;
+                    break;
+                }
+            } else {
+                err = socket_strerror(ret);
+                socket_destroy(&sock);
+                /* failing at once also gives the next attempt its turn */
+                last = timeout_monotime() - delay;
+            }
+            continue;
+        }
+        /* every address failed */
+        if (n == 0) break;
+        if (t == 0.0) {
+            err = socket_strerror(IO_TIMEOUT);
+            break;
+        }
+        /* wait for an attempt to complete, or for the next one to start */
+        if (next && n < SOCKET_MAXCONNECTS) {
+            double due = delay - (timeout_monotime() - last);
+            if (due < 0.0) due = 0.0;
+            if (t < 0.0 || due < t) t = due;
+        }
+        timeout_init(&wait, t, -1);
+        timeout_markstart(&wait);
+        ret = socket_waitconnect(socks, n, &wait, &which);
+        if (ret == IO_TIMEOUT) continue;
+        if (ret == IO_DONE) {
+            won = which;
+            break;
+        }
+        err = socket_strerror(ret);
+        if (which < 0) break;
+        socket_destroy(&socks[which]);
+        socks[which] = socks[--n];
+        families[which] = families[n];
+        /* the failure gives the next attempt its turn right away */
+        last = timeout_monotime() - delay;
+    }
+    for (i = 0; i < n; i++) {
+        if (i == won) {
+            *ps = socks[i];
+            *family = families[i];
+        } else socket_destroy(&socks[i]);
+    }
+    return won >= 0? NULL: err;
+}
+
 /*-------------------------------------------------------------------------*\
 * Passes all resolver information to Lua as a table
 \*-------------------------------------------------------------------------*/
@@ -383,10 +500,13 @@ const char *inet_trydisconnect(p_socket ps, int family, p_timeout tm)
 }
 
 /*-------------------------------------------------------------------------*\
-* Tries to connect to remote address (address, port)
+* Tries to connect to remote address (address, port). Unless delay is
+* negative, several addresses are raced against each other, starting an
+* attempt every delay seconds
 \*-------------------------------------------------------------------------*/
 const char *inet_tryconnect(p_socket ps, int *family, const char *address,
-        const char *serv, p_timeout tm, struct addrinfo *connecthints)
+        const char *serv, p_timeout tm, struct addrinfo *connecthints,
+        double delay)
 {
     struct addrinfo *iterator = NULL, *resolved = NULL;
     const char *err = NULL;
@@ -398,6 +518,14 @@ const char *inet_tryconnect(p_socket ps, int *family, const char *address,
         if (resolved) freeaddrinfo(resolved);
         return err;
     }
+    /* each attempt in a race needs a socket of its own, and the zero
+     * timeout of a non-blocking connect leaves no time for a race */
+    if (delay >= 0.0 && resolved->ai_next && *ps == SOCKET_INVALID &&
+            !timeout_iszero(tm)) {
+        err = inet_tryrace(ps, family, resolved, tm, delay);
+        freeaddrinfo(resolved);
+        return err;
+    }
     for (iterator = resolved; iterator; iterator = iterator->ai_next) {
         timeout_markstart(tm);
         /* create new socket if necessary. if there was no
@@ -411,8 +539,6 @@ const char *inet_tryconnect(p_socket ps, int *family, const char *address,
                 iterator->ai_socktype, iterator->ai_protocol);
             if (err) continue;
             current_family = iterator->ai_family;
-            /* set non-blocking before connect */
-            socket_setnonblocking(ps);
         }
         /* try connecting to remote address */
         err = socket_strerror(socket_connect(ps, (SA *) iterator->ai_addr,
@@ -476,8 +602,6 @@ const char *inet_trybind(p_socket ps, int *family, const char *address,
         /* keep trying unless bind succeeded */
         if (err == NULL) {
             *family = current_family;
-            /* set to non-blocking after bind */
-            socket_setnonblocking(ps);
             break;
         }
     }
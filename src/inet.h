@@ -33,10 +33,11 @@ int inet_optsocktype(lua_State* L, int narg, const char* def);
 
 int inet_meth_getpeername(lua_State *L, p_socket ps, int family);
 int inet_meth_getsockname(lua_State *L, p_socket ps, int family);
+const char *inet_pushaddress(lua_State *L, SA *addr, socklen_t len);
 
 const char *inet_trycreate(p_socket ps, int family, int type, int protocol);
 const char *inet_trydisconnect(p_socket ps, int family, p_timeout tm);
-const char *inet_tryconnect(p_socket ps, int *family, const char *address, const char *serv, p_timeout tm, struct addrinfo *connecthints);
+const char *inet_tryconnect(p_socket ps, int *family, const char *address, const char *serv, p_timeout tm, struct addrinfo *connecthints, double delay);
 const char *inet_tryaccept(p_socket server, int family, p_socket client, p_timeout tm);
 const char *inet_trybind(p_socket ps, int *family, const char *address, const char *serv, struct addrinfo *bindhints);
 
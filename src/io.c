@@ -8,8 +8,10 @@
 /*-------------------------------------------------------------------------*\
 * Initializes C structure
 \*-------------------------------------------------------------------------*/
-void io_init(p_io io, p_send send, p_recv recv, p_error error, void *ctx) {
+void io_init(p_io io, p_send send, p_sendv sendv, p_recv recv,
+        p_error error, void *ctx) {
     io->send = send;
+    io->sendv = sendv;
     io->recv = recv;
     io->error = error;
     io->ctx = ctx;
@@ -23,6 +25,7 @@ const char *io_strerror(int err) {
         case IO_DONE: return NULL;
         case IO_CLOSED: return "closed";
         case IO_TIMEOUT: return "timeout";
+        case IO_LIMIT: return "limit exceeded";
         default: return "unknown error";
     }
 }
@@ -20,7 +20,8 @@ enum {
     IO_DONE = 0,        /* operation completed successfully */
     IO_TIMEOUT = -1,    /* operation timed out */
     IO_CLOSED = -2,     /* the connection has been closed */
-	IO_UNKNOWN = -3
+	IO_UNKNOWN = -3,
+    IO_LIMIT = -4       /* the data exceeded the length limit */
 };
 
 /* interface to error message function */
@@ -38,6 +39,24 @@ typedef int (*p_send) (
     p_timeout tm        /* timeout control */
 );
 
+/* a piece of data for vectored output */
+typedef struct t_iovec_ {
+    const char *data;   /* pointer to the piece */
+    size_t count;       /* number of bytes in the piece */
+} t_iovec;
+
+/* maximum number of pieces handed to a vectored send function at once */
+#define IO_IOVMAX 64
+
+/* interface to vectored send function */
+typedef int (*p_sendv) (
+    void *ctx,          /* context needed by send */
+    const t_iovec *iov, /* pieces to send, in order */
+    int iovcnt,         /* number of pieces, at most IO_IOVMAX */
+    size_t *sent,       /* number of bytes sent uppon return */
+    p_timeout tm        /* timeout control */
+);
+
 /* interface to recv function */
 typedef int (*p_recv) (
     void *ctx,          /* context needed by recv */
@@ -51,6 +70,7 @@ typedef int (*p_recv) (
 typedef struct t_io_ {
     void *ctx;          /* context needed by send/recv */
     p_send send;        /* send function pointer */
+    p_sendv sendv;      /* vectored send function pointer, may be NULL */
     p_recv recv;        /* receive function pointer */
     p_error error;      /* strerror function */
 } t_io;
@@ -60,7 +80,8 @@ typedef t_io *p_io;
 #pragma GCC visibility push(hidden)
 #endif
 
-void io_init(p_io io, p_send send, p_recv recv, p_error error, void *ctx);
+void io_init(p_io io, p_send send, p_sendv sendv, p_recv recv,
+        p_error error, void *ctx);
 const char *io_strerror(int err);
 
 #ifndef _WIN32
@@ -17,15 +17,24 @@
 #include "except.h"
 #include "timeout.h"
 #include "buffer.h"
+#include "bytes.h"
 #include "inet.h"
 #include "tcp.h"
 #include "udp.h"
 #include "select.h"
+#include "poller.h"
+#include "notifier.h"
+#include "ring.h"
+#include "timers.h"
+#include "scheduler.h"
 
 /*-------------------------------------------------------------------------*\
 * Internal function prototypes
 \*-------------------------------------------------------------------------*/
 static int global_skip(lua_State *L);
+#ifdef LUASOCKET_DEBUG
+static int global_setupcalls(lua_State *L);
+#endif
 static int global_unload(lua_State *L);
 static int base_open(lua_State *L);
 
@@ -37,16 +46,25 @@ static const luaL_Reg mod[] = {
     {"except", except_open},
     {"timeout", timeout_open},
     {"buffer", buffer_open},
+    {"bytes", bytes_open},
     {"inet", inet_open},
     {"tcp", tcp_open},
     {"udp", udp_open},
     {"select", select_open},
+    {"poller", poller_open},
+    {"notifier", notifier_open},
+    {"ring", ring_open},
+    {"timers", timers_open},
+    {"scheduler", scheduler_open},
     {NULL, NULL}
 };
 
 static luaL_Reg func[] = {
     {"skip",      global_skip},
     {"__unload",  global_unload},
+#ifdef LUASOCKET_DEBUG
+    {"_setupcalls", global_setupcalls},
+#endif
     {NULL,        NULL}
 };
 
@@ -59,6 +77,19 @@ static int global_skip(lua_State *L) {
     return ret >= 0 ? ret : 0;
 }
 
+#ifdef LUASOCKET_DEBUG
+/*-------------------------------------------------------------------------*\
+* Returns the number of system calls made to set sockets up, and how many
+* of them switched modes
+\*-------------------------------------------------------------------------*/
+static int global_setupcalls(lua_State *L) {
+    unsigned long switches;
+    lua_pushnumber(L, (lua_Number) socket_setupcalls(&switches));
+    lua_pushnumber(L, (lua_Number) switches);
+    return 2;
+}
+#endif
+
 /*-------------------------------------------------------------------------*\
 * Unloads the library
 \*-------------------------------------------------------------------------*/
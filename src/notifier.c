@@ -0,0 +1,234 @@
+/*=========================================================================*\
+* Wakeup notifiers
+* LuaSocket toolkit
+\*=========================================================================*/
+#include "luasocket.h"
+
+#include "auxiliar.h"
+#include "notifier.h"
+
+#ifndef _WIN32
+#include "socket.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/eventfd.h>
+#define NOTIFIER_EVENTFD
+#define NOTIFIER_CLASS "notifier{eventfd}"
+#else
+#define NOTIFIER_CLASS "notifier{pipe}"
+#endif
+
+/* notifier control structure */
+typedef struct t_notifier_ {
+    int fd;                 /* end that becomes readable, or -1 if closed */
+    int wfd;                /* end signals are written to, fd for an eventfd */
+    int owned;              /* whether closing the object closes them */
+} t_notifier;
+typedef t_notifier *p_notifier;
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static int global_create(lua_State *L);
+static int meth_signal(lua_State *L);
+static int meth_drain(lua_State *L);
+static int meth_getfd(lua_State *L);
+static int meth_dirty(lua_State *L);
+static int meth_close(lua_State *L);
+static p_notifier checkopen(lua_State *L);
+static int pusherror(lua_State *L, const char *err);
+
+/* notifier object methods */
+static luaL_Reg notifier_methods[] = {
+    {"__gc",        meth_close},
+    {"__tostring",  auxiliar_tostring},
+    {"close",       meth_close},
+    {"dirty",       meth_dirty},
+    {"drain",       meth_drain},
+    {"getfd",       meth_getfd},
+    {"signal",      meth_signal},
+    {NULL,          NULL}
+};
+
+/* functions in library namespace */
+static luaL_Reg func[] = {
+    {"notifier", global_create},
+    {NULL,       NULL}
+};
+
+/*-------------------------------------------------------------------------*\
+* Initializes module
+\*-------------------------------------------------------------------------*/
+int notifier_open(lua_State *L) {
+    auxiliar_newclass(L, NOTIFIER_CLASS, notifier_methods);
+    luaL_setfuncs(L, func, 0);
+    return 0;
+}
+
+/*=========================================================================*\
+* Lua methods
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Wakes up whoever waits for the notifier to become readable. Signals sent
+* before the next drain coalesce, so this never blocks
+\*-------------------------------------------------------------------------*/
+static int meth_signal(lua_State *L) {
+    p_notifier n = checkopen(L);
+    int ret;
+#ifdef NOTIFIER_EVENTFD
+    uint64_t one = 1;
+    do ret = (int) write(n->wfd, &one, sizeof(one));
+    while (ret < 0 && errno == EINTR);
+#else
+    char one = 1;
+    do ret = (int) write(n->wfd, &one, 1);
+    while (ret < 0 && errno == EINTR);
+#endif
+    /* a counter or pipe that is full is readable already */
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return pusherror(L, socket_strerror(errno));
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Consumes all pending signals, so that the notifier is no longer readable
+* Lua Returns
+*   the number of signals consumed, possibly 0
+\*-------------------------------------------------------------------------*/
+static int meth_drain(lua_State *L) {
+    p_notifier n = checkopen(L);
+    double count = 0;
+    int ret;
+#ifdef NOTIFIER_EVENTFD
+    uint64_t value;
+    do ret = (int) read(n->fd, &value, sizeof(value));
+    while (ret < 0 && errno == EINTR);
+    if (ret == (int) sizeof(value)) count = (double) value;
+#else
+    char buf[256];
+    for ( ;; ) {
+        ret = (int) read(n->fd, buf, sizeof(buf));
+        if (ret > 0) count += ret;
+        else if (ret < 0 && errno == EINTR) continue;
+        if (ret < (int) sizeof(buf)) break;
+    }
+#endif
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return pusherror(L, socket_strerror(errno));
+    lua_pushnumber(L, count);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the descriptor to wait on, or -1 if the notifier is closed
+\*-------------------------------------------------------------------------*/
+static int meth_getfd(lua_State *L) {
+    p_notifier n = (p_notifier) auxiliar_checkclass(L, NOTIFIER_CLASS, 1);
+    lua_pushnumber(L, n->fd);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Notifiers hold no buffered data of their own
+\*-------------------------------------------------------------------------*/
+static int meth_dirty(lua_State *L) {
+    auxiliar_checkclass(L, NOTIFIER_CLASS, 1);
+    lua_pushboolean(L, 0);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Closes the descriptors, unless the notifier wraps someone else's
+\*-------------------------------------------------------------------------*/
+static int meth_close(lua_State *L) {
+    p_notifier n = (p_notifier) auxiliar_checkclass(L, NOTIFIER_CLASS, 1);
+    if (n->fd >= 0 && n->owned) {
+        if (n->wfd != n->fd) close(n->wfd);
+        close(n->fd);
+    }
+    n->fd = n->wfd = -1;
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*=========================================================================*\
+* Library functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Creates a notifier object
+* Lua Input: [fd]
+*   fd: descriptor of a notifier created elsewhere, possibly by another
+*       Lua state. The new object signals and drains it, but does not
+*       close it. Only eventfd notifiers can be shared this way
+\*-------------------------------------------------------------------------*/
+static int global_create(lua_State *L) {
+    int shared = !lua_isnoneornil(L, 1), fd = -1;
+    p_notifier n;
+    if (shared) {
+        double numfd = luaL_checknumber(L, 1);
+        luaL_argcheck(L, numfd >= 0.0 && numfd <= INT_MAX, 1,
+            "invalid descriptor");
+        fd = (int) numfd;
+    }
+    n = (p_notifier) lua_newuserdata(L, sizeof(t_notifier));
+    n->fd = n->wfd = -1;
+    n->owned = !shared;
+    auxiliar_setclass(L, NOTIFIER_CLASS, -1);
+    if (shared) {
+#ifdef NOTIFIER_EVENTFD
+        if (fcntl(fd, F_GETFD) < 0)
+            return pusherror(L, socket_strerror(errno));
+        n->fd = n->wfd = fd;
+#else
+        (void) fd;
+        return pusherror(L, "notifiers cannot be shared here");
+#endif
+    } else {
+#ifdef NOTIFIER_EVENTFD
+        n->fd = n->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (n->fd < 0) return pusherror(L, socket_strerror(errno));
+#else
+        int fds[2], i;
+        if (pipe(fds) < 0) return pusherror(L, socket_strerror(errno));
+        for (i = 0; i < 2; i++) {
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+        n->fd = fds[0];
+        n->wfd = fds[1];
+#endif
+    }
+    return 1;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+static p_notifier checkopen(lua_State *L) {
+    p_notifier n = (p_notifier) auxiliar_checkclass(L, NOTIFIER_CLASS, 1);
+    if (n->fd < 0) luaL_argerror(L, 1, "notifier is closed");
+    return n;
+}
+
+static int pusherror(lua_State *L, const char *err) {
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+}
+
+#else
+/*-------------------------------------------------------------------------*\
+* Notifiers are not available on Windows
+\*-------------------------------------------------------------------------*/
+int notifier_open(lua_State *L) {
+    (void) L;
+    return 0;
+}
+#endif
@@ -0,0 +1,29 @@
+#ifndef NOTIFIER_H
+#define NOTIFIER_H
+/*=========================================================================*\
+* Wakeup notifiers
+* LuaSocket toolkit
+*
+* A notifier is a descriptor that becomes readable when it is signalled,
+* so that a loop blocked in select, a poller or a scheduler can be woken
+* up by a producer. Signals are counted but coalesce: a single drain
+* consumes all the signals sent since the previous one.
+*
+* On Linux a notifier is an eventfd, a counter kept by the kernel that
+* costs a single descriptor. Signalling it takes one write, and another
+* Lua state, C thread or signal handler can do so knowing nothing but the
+* descriptor. Other Unix systems use a pipe.
+\*=========================================================================*/
+#include "luasocket.h"
+
+#ifndef _WIN32
+#pragma GCC visibility push(hidden)
+#endif
+
+int notifier_open(lua_State *L);
+
+#ifndef _WIN32
+#pragma GCC visibility pop
+#endif
+
+#endif /* NOTIFIER_H */
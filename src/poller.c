@@ -0,0 +1,475 @@
+/*=========================================================================*\
+* Persistent poller objects
+* LuaSocket toolkit
+\*=========================================================================*/
+#include "luasocket.h"
+
+#include "auxiliar.h"
+#include "timeout.h"
+#include "poller.h"
+
+#ifndef _WIN32
+#include "socket.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef POLLER_EPOLL
+#define POLLER_CLASS "poller{epoll}"
+#else
+#define POLLER_CLASS "poller{poll}"
+#endif
+
+/* default maximum number of objects returned by a wait */
+#define POLLER_MAXEVENTS 256
+
+/* largest number of results a wait makes room for. descriptors beyond it
+* stay ready and are returned by the next wait */
+#define POLLER_MAXRESULTS (POLLER_MAXEVENTS*16)
+
+/* poller control structure */
+typedef struct t_poller_ {
+    int ref;                /* registry reference to the registered objects */
+    t_pollset set;          /* registered descriptors */
+} t_poller;
+typedef t_poller *p_poller;
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static int global_create(lua_State *L);
+static int meth_add(lua_State *L);
+static int meth_modify(lua_State *L);
+static int meth_remove(lua_State *L);
+static int meth_wait(lua_State *L);
+static int meth_close(lua_State *L);
+static p_poller checkpoller(lua_State *L);
+static int checkevents(lua_State *L, int arg);
+static int getfd(lua_State *L, int idx);
+static int registered(lua_State *L, p_poller p, int idx);
+static int pusherror(lua_State *L, const char *err);
+
+/* poller object methods */
+static luaL_Reg poller_methods[] = {
+    {"__gc",        meth_close},
+    {"__tostring",  auxiliar_tostring},
+    {"add",         meth_add},
+    {"close",       meth_close},
+    {"modify",      meth_modify},
+    {"remove",      meth_remove},
+    {"wait",        meth_wait},
+    {NULL,          NULL}
+};
+
+/* functions in library namespace */
+static luaL_Reg func[] = {
+    {"poller", global_create},
+    {NULL,     NULL}
+};
+
+/*-------------------------------------------------------------------------*\
+* Initializes module
+\*-------------------------------------------------------------------------*/
+int poller_open(lua_State *L) {
+    auxiliar_newclass(L, POLLER_CLASS, poller_methods);
+    luaL_setfuncs(L, func, 0);
+    return 0;
+}
+
+/*=========================================================================*\
+* Lua methods
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Registers an object for the given events: "r", "w" or "rw"
+\*-------------------------------------------------------------------------*/
+static int meth_add(lua_State *L) {
+    p_poller p = checkpoller(L);
+    int events = checkevents(L, 3), fd, err;
+    lua_settop(L, 3);
+    if (registered(L, p, 2) >= 0) return pusherror(L, "already registered");
+    fd = getfd(L, 2);
+    if (fd < 0) return pusherror(L, "closed");
+    if ((err = pollset_add(&p->set, fd, events)) != 0)
+        return pusherror(L, socket_strerror(err));
+    /* map from descriptor to object, and back */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, p->ref);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, fd);
+    lua_pushvalue(L, 2);
+    lua_pushinteger(L, fd);
+    lua_rawset(L, -3);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Changes the events a registered object waits for
+\*-------------------------------------------------------------------------*/
+static int meth_modify(lua_State *L) {
+    p_poller p = checkpoller(L);
+    int events = checkevents(L, 3), err;
+    int fd = registered(L, p, 2);
+    if (fd < 0) return pusherror(L, "not registered");
+    if ((err = pollset_modify(&p->set, fd, events)) != 0)
+        return pusherror(L, socket_strerror(err));
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Forgets about a registered object, which may have been closed already
+\*-------------------------------------------------------------------------*/
+static int meth_remove(lua_State *L) {
+    p_poller p = checkpoller(L);
+    int fd = registered(L, p, 2);
+    lua_settop(L, 2);
+    if (fd < 0) return pusherror(L, "not registered");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, p->ref);
+    /* a closed object's descriptor may have been registered again since */
+    lua_rawgeti(L, -1, fd);
+    if (lua_rawequal(L, -1, 2)) {
+        pollset_remove(&p->set, fd);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, fd);
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, 2);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Waits for registered objects to become ready
+* Lua Input: poller [, timeout [, maxevents]]
+*   timeout: in seconds, nil or negative to wait forever
+*   maxevents: largest number of objects returned
+* Lua Returns
+*   array of readable objects, array of writable objects, and
+*   "timeout" or an error message if none is ready
+\*-------------------------------------------------------------------------*/
+static int meth_wait(lua_State *L) {
+    p_poller p = checkpoller(L);
+    double t = luaL_optnumber(L, 2, -1);
+    double max = luaL_optnumber(L, 3, POLLER_MAXEVENTS);
+    t_timeout tm;
+    int n, i, nr = 0, nw = 0;
+    luaL_argcheck(L, max >= 1 && max <= INT_MAX, 3,
+        "invalid maximum number of events");
+    lua_settop(L, 3);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, p->ref);
+    lua_newtable(L);
+    lua_newtable(L);
+    timeout_init(&tm, t, -1);
+    timeout_markstart(&tm);
+    n = pollset_wait(&p->set, (int) max, &tm);
+    if (n < 0) {
+        lua_pushstring(L, socket_strerror(-n));
+        return 3;
+    }
+    for (i = 0; i < n; i++) {
+        int events, fd = pollset_result(&p->set, i, &events);
+        lua_rawgeti(L, 4, fd);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            continue;
+        }
+        if (events & POLLER_READ) {
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, 5, ++nr);
+        }
+        if (events & POLLER_WRITE) {
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, 6, ++nw);
+        }
+        lua_pop(L, 1);
+    }
+    if (nr + nw > 0) return 2;
+    lua_pushstring(L, "timeout");
+    return 3;
+}
+
+/*-------------------------------------------------------------------------*\
+* Releases the kernel resources and forgets all registered objects
+\*-------------------------------------------------------------------------*/
+static int meth_close(lua_State *L) {
+    p_poller p = (p_poller) auxiliar_checkclass(L, POLLER_CLASS, 1);
+    if (p->ref != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, p->ref);
+        p->ref = LUA_NOREF;
+        pollset_destroy(&p->set);
+    }
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*=========================================================================*\
+* Library functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Creates a poller object
+\*-------------------------------------------------------------------------*/
+static int global_create(lua_State *L) {
+    p_poller p = (p_poller) lua_newuserdata(L, sizeof(t_poller));
+    int err;
+    memset(p, 0, sizeof(t_poller));
+    p->ref = LUA_NOREF;
+    if ((err = pollset_init(&p->set)) != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, socket_strerror(err));
+        return 2;
+    }
+    auxiliar_setclass(L, POLLER_CLASS, -1);
+    lua_newtable(L);
+    p->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+static p_poller checkpoller(lua_State *L) {
+    p_poller p = (p_poller) auxiliar_checkclass(L, POLLER_CLASS, 1);
+    if (p->ref == LUA_NOREF) luaL_argerror(L, 1, "poller is closed");
+    return p;
+}
+
+static int checkevents(lua_State *L, int arg) {
+    const char *s = luaL_optstring(L, arg, "r");
+    int events = 0;
+    for ( ; *s; s++) {
+        if (*s == 'r') events |= POLLER_READ;
+        else if (*s == 'w') events |= POLLER_WRITE;
+        else luaL_argerror(L, arg, "invalid events");
+    }
+    luaL_argcheck(L, events != 0, arg, "invalid events");
+    return events;
+}
+
+/* calls the getfd method of the object at idx */
+static int getfd(lua_State *L, int idx) {
+    int fd = -1;
+    lua_getfield(L, idx, "getfd");
+    luaL_argcheck(L, !lua_isnil(L, -1), idx, "getfd method expected");
+    lua_pushvalue(L, idx);
+    lua_call(L, 1, 1);
+    if (lua_isnumber(L, -1)) {
+        double numfd = lua_tonumber(L, -1);
+        fd = (numfd >= 0.0 && numfd <= INT_MAX)? (int) numfd: -1;
+    }
+    lua_pop(L, 1);
+    return fd;
+}
+
+/* returns the descriptor the object at idx was registered with, or -1 */
+static int registered(lua_State *L, p_poller p, int idx) {
+    int fd = -1;
+    luaL_checkany(L, idx);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, p->ref);
+    lua_pushvalue(L, idx);
+    lua_rawget(L, -2);
+    if (lua_isnumber(L, -1)) fd = (int) lua_tointeger(L, -1);
+    lua_pop(L, 2);
+    return fd;
+}
+
+static int pusherror(lua_State *L, const char *err) {
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+}
+
+/*=========================================================================*\
+* Poll backends
+\*=========================================================================*/
+/* converts what is left of a timeout to milliseconds, rounding up */
+static int getmillis(p_timeout tm) {
+    double t = timeout_getretry(tm);
+    if (t < 0.0) return -1;
+    if (t > INT_MAX/1000) return INT_MAX;
+    return (int) (t*1000.0 + 0.999);
+}
+
+#ifdef POLLER_EPOLL
+/*-------------------------------------------------------------------------*\
+* epoll backend: the kernel keeps the registrations
+\*-------------------------------------------------------------------------*/
+int pollset_init(p_pollset ps) {
+    memset(ps, 0, sizeof(t_pollset));
+    ps->epfd = epoll_create1(EPOLL_CLOEXEC);
+    return ps->epfd < 0? errno: 0;
+}
+
+void pollset_destroy(p_pollset ps) {
+    if (ps->epfd >= 0) close(ps->epfd);
+    ps->epfd = -1;
+    free(ps->events);
+    ps->events = NULL;
+    ps->size = 0;
+}
+
+static int pollset_ctl(p_pollset ps, int op, int fd, int events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    if (events & POLLER_READ) ev.events |= EPOLLIN;
+    if (events & POLLER_WRITE) ev.events |= EPOLLOUT;
+    ev.data.fd = fd;
+    return epoll_ctl(ps->epfd, op, fd, &ev) < 0? errno: 0;
+}
+
+int pollset_add(p_pollset ps, int fd, int events) {
+    return pollset_ctl(ps, EPOLL_CTL_ADD, fd, events);
+}
+
+int pollset_modify(p_pollset ps, int fd, int events) {
+    return pollset_ctl(ps, EPOLL_CTL_MOD, fd, events);
+}
+
+int pollset_remove(p_pollset ps, int fd) {
+    return pollset_ctl(ps, EPOLL_CTL_DEL, fd, 0);
+}
+
+/* returns the number of ready descriptors, 0 on timeout, -errno on error */
+int pollset_wait(p_pollset ps, int max, p_timeout tm) {
+    int n;
+    if (max > POLLER_MAXRESULTS) max = POLLER_MAXRESULTS;
+    if (max > ps->size) {
+        struct epoll_event *events = (struct epoll_event *)
+            realloc(ps->events, max * sizeof(struct epoll_event));
+        if (!events) return -ENOMEM;
+        ps->events = events;
+        ps->size = max;
+    }
+    do n = epoll_wait(ps->epfd, ps->events, max, getmillis(tm));
+    while (n < 0 && errno == EINTR);
+    return n < 0? -errno: n;
+}
+
+/* returns the i-th ready descriptor, and the events it is ready for.
+* errors and hang ups make a descriptor readable */
+int pollset_result(p_pollset ps, int i, int *events) {
+    unsigned int ev = ps->events[i].events;
+    *events = 0;
+    if (ev & (EPOLLIN|EPOLLHUP|EPOLLERR)) *events |= POLLER_READ;
+    if (ev & (EPOLLOUT|EPOLLERR)) *events |= POLLER_WRITE;
+    return ps->events[i].data.fd;
+}
+#else
+/*-------------------------------------------------------------------------*\
+* poll backend: registrations are kept in an array handed to each poll
+\*-------------------------------------------------------------------------*/
+int pollset_init(p_pollset ps) {
+    memset(ps, 0, sizeof(t_pollset));
+    return 0;
+}
+
+void pollset_destroy(p_pollset ps) {
+    free(ps->fds);
+    free(ps->slots);
+    free(ps->ready);
+    ps->fds = NULL;
+    ps->slots = NULL;
+    ps->ready = NULL;
+    ps->size = ps->nfds = ps->nslots = 0;
+}
+
+static short pollevents(int events) {
+    short ev = 0;
+    if (events & POLLER_READ) ev |= POLLIN;
+    if (events & POLLER_WRITE) ev |= POLLOUT;
+    return ev;
+}
+
+int pollset_add(p_pollset ps, int fd, int events) {
+    int slot;
+    if (fd >= ps->nslots) {
+        int i, n = ps->nslots? ps->nslots: 64;
+        int *slots;
+        while (n <= fd) n *= 2;
+        slots = (int *) realloc(ps->slots, n * sizeof(int));
+        if (!slots) return ENOMEM;
+        for (i = ps->nslots; i < n; i++) slots[i] = -1;
+        ps->slots = slots;
+        ps->nslots = n;
+    }
+    /* a descriptor that was closed while registered is simply reused */
+    slot = ps->slots[fd];
+    if (slot < 0) {
+        if (ps->nfds >= ps->size) {
+            int n = ps->size? ps->size*2: 64;
+            struct pollfd *fds = (struct pollfd *)
+                realloc(ps->fds, n * sizeof(struct pollfd));
+            t_pollready *ready;
+            if (!fds) return ENOMEM;
+            ps->fds = fds;
+            ready = (t_pollready *) realloc(ps->ready, n * sizeof(t_pollready));
+            if (!ready) return ENOMEM;
+            ps->ready = ready;
+            ps->size = n;
+        }
+        slot = ps->slots[fd] = ps->nfds++;
+    }
+    ps->fds[slot].fd = fd;
+    ps->fds[slot].events = pollevents(events);
+    ps->fds[slot].revents = 0;
+    return 0;
+}
+
+int pollset_modify(p_pollset ps, int fd, int events) {
+    if (fd >= ps->nslots || ps->slots[fd] < 0) return ENOENT;
+    ps->fds[ps->slots[fd]].events = pollevents(events);
+    return 0;
+}
+
+int pollset_remove(p_pollset ps, int fd) {
+    int slot, last;
+    if (fd >= ps->nslots || ps->slots[fd] < 0) return ENOENT;
+    /* the last entry takes the place of the one removed */
+    slot = ps->slots[fd];
+    last = --ps->nfds;
+    ps->fds[slot] = ps->fds[last];
+    ps->slots[ps->fds[slot].fd] = slot;
+    ps->slots[fd] = -1;
+    return 0;
+}
+
+/* returns the number of ready descriptors, 0 on timeout, -errno on error */
+int pollset_wait(p_pollset ps, int max, p_timeout tm) {
+    int n, i, ready = 0;
+    if (max > POLLER_MAXRESULTS) max = POLLER_MAXRESULTS;
+    do n = poll(ps->fds, (nfds_t) ps->nfds, getmillis(tm));
+    while (n < 0 && errno == EINTR);
+    if (n < 0) return -errno;
+    for (i = 0; i < ps->nfds && ready < n && ready < max; i++) {
+        short ev = ps->fds[i].revents;
+        int events = 0;
+        if (!ev) continue;
+        if (ev & (POLLIN|POLLHUP|POLLERR|POLLNVAL)) events |= POLLER_READ;
+        if (ev & (POLLOUT|POLLERR)) events |= POLLER_WRITE;
+        ps->ready[ready].fd = ps->fds[i].fd;
+        ps->ready[ready].events = events;
+        ready++;
+    }
+    return ready;
+}
+
+/* returns the i-th ready descriptor, and the events it is ready for */
+int pollset_result(p_pollset ps, int i, int *events) {
+    *events = ps->ready[i].events;
+    return ps->ready[i].fd;
+}
+#endif
+
+#else
+/*-------------------------------------------------------------------------*\
+* Pollers are not available on Windows
+\*-------------------------------------------------------------------------*/
+int poller_open(lua_State *L) {
+    (void) L;
+    return 0;
+}
+#endif
@@ -0,0 +1,70 @@
+#ifndef POLLER_H
+#define POLLER_H
+/*=========================================================================*\
+* Persistent poller objects
+* LuaSocket toolkit
+*
+* A poller keeps a set of registered objects, each with the events it is
+* interested in. Unlike select, registrations persist between calls: on
+* Linux they live in the kernel, in an epoll instance, so that the cost of
+* a wait grows with the number of ready objects, not registered ones. Other
+* Unix systems use poll. Registered objects must export getfd(), like
+* those passed to select.
+*
+* The set of watched descriptors underneath is also available to other
+* modules in C, as a pollset.
+\*=========================================================================*/
+#include "luasocket.h"
+#include "timeout.h"
+
+#ifndef _WIN32
+#ifdef __linux__
+#define POLLER_EPOLL
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+/* events a descriptor can be watched for */
+#define POLLER_READ 1
+#define POLLER_WRITE 2
+
+/* ready descriptor, as reported by the poll backend */
+typedef struct t_pollready_ {
+    int fd;
+    int events;
+} t_pollready;
+
+/* set of watched descriptors */
+typedef struct t_pollset_ {
+    int size;               /* number of results allocated below */
+#ifdef POLLER_EPOLL
+    int epfd;               /* epoll instance */
+    struct epoll_event *events; /* room for the results of a wait */
+#else
+    struct pollfd *fds;     /* watched descriptors */
+    int nfds;               /* number of entries used in fds */
+    int *slots;             /* index in fds of each descriptor, or -1 */
+    int nslots;             /* number of entries allocated in slots */
+    t_pollready *ready;     /* room for the results of a wait */
+#endif
+} t_pollset;
+typedef t_pollset *p_pollset;
+
+#pragma GCC visibility push(hidden)
+
+int pollset_init(p_pollset ps);
+void pollset_destroy(p_pollset ps);
+int pollset_add(p_pollset ps, int fd, int events);
+int pollset_modify(p_pollset ps, int fd, int events);
+int pollset_remove(p_pollset ps, int fd);
+int pollset_wait(p_pollset ps, int max, p_timeout tm);
+int pollset_result(p_pollset ps, int i, int *events);
+int poller_open(lua_State *L);
+
+#pragma GCC visibility pop
+#else
+int poller_open(lua_State *L);
+#endif
+
+#endif /* POLLER_H */
@@ -0,0 +1,910 @@
+/*=========================================================================*\
+* io_uring submission rings
+* LuaSocket toolkit
+\*=========================================================================*/
+#include "luasocket.h"
+
+#include "auxiliar.h"
+#include "timeout.h"
+#include "ring.h"
+
+#ifdef RING_URING
+#include "buffer.h"
+#include "tcp.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RING_CLASS "ring{uring}"
+
+/* default number of submission entries, and of receive buffers */
+#define RING_ENTRIES 256
+/* default size of each receive buffer */
+#define RING_BUFSIZE 4096
+/* group of the receive buffers registered by a ring */
+#define RING_BGID 0
+/* tags of completions that do not belong to a queued operation */
+#define RING_NOOP ((__u64) -1)
+#define RING_DRIVEROP ((__u64) -2)
+#define RING_DRIVERTIMEOUT ((__u64) -3)
+
+/* kinds of queued operations */
+#define OP_FREE 0
+#define OP_RECEIVE 1
+#define OP_SEND 2
+#define OP_ACCEPT 3
+
+/* an operation queued on a ring */
+typedef struct t_ringop_ {
+    int kind;               /* one of the kinds above */
+    int fd;                 /* descriptor the operation is on */
+    int persist;            /* whether a receive stays queued */
+    double start;           /* index before the first byte of a send */
+    int next;               /* next free operation */
+} t_ringop;
+
+/* ring object control structure */
+typedef struct t_ring_ {
+    t_uring u;              /* the io_uring instance */
+    int ref;                /* registry reference to the objects in use */
+    t_ringop *ops;          /* operations, by slot */
+    int nops;               /* number of slots, which bounds completions */
+    int free;               /* first free slot, or -1 */
+    int inflight;           /* number of operations queued */
+    int multishot;          /* whether persistent receives use multishot */
+    struct io_uring_buf_ring *br; /* ring of receive buffers */
+    size_t brsize;          /* size of the mapping of br */
+    char *bufs;             /* storage of the receive buffers */
+    unsigned nbufs;         /* number of receive buffers, a power of 2 */
+    unsigned bufsize;       /* size of each receive buffer */
+    unsigned short brtail;  /* tail of br, as last published */
+} t_ring;
+typedef t_ring *p_ring;
+
+/* the address of this variable is the registry key of the driver ring */
+static char ring_driverkey;
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static int global_create(lua_State *L);
+static int meth_receive(lua_State *L);
+static int meth_send(lua_State *L);
+static int meth_accept(lua_State *L);
+static int meth_cancel(lua_State *L);
+static int meth_wait(lua_State *L);
+static int meth_close(lua_State *L);
+static p_ring checkring(lua_State *L);
+static int getfd(lua_State *L, int idx);
+static int pusherror(lua_State *L, const char *err);
+static const char *ringerror(int err);
+static struct io_uring_sqe *queue(lua_State *L, p_ring p, int kind,
+    int obj, int data, int *slot);
+static void release(lua_State *L, p_ring p, int slot, int objs);
+static int rearm(p_ring p, int slot);
+static void prepreceive(p_ring p, struct io_uring_sqe *sqe, int slot);
+static void setresults(lua_State *L, int idx);
+static void clearresults(lua_State *L, int idx, int n);
+static void putbuffer(p_ring p, unsigned bid);
+static int registerbuffers(p_ring p, unsigned nbufs, unsigned bufsize);
+static void destroy(lua_State *L, p_ring p);
+static int uring_init(p_uring u, unsigned entries);
+static int uring_fail(p_uring u);
+static void uring_destroy(p_uring u);
+static struct io_uring_sqe *uring_getsqe(p_uring u);
+static int uring_enter(p_uring u, unsigned wait, p_timeout tm);
+static struct io_uring_cqe *uring_peek(p_uring u);
+static void uring_advance(p_uring u);
+static p_uring driver_open(lua_State *L, int *err);
+static int driver_gc(lua_State *L);
+static int driver_run(p_ringio rio, int opcode, const void *addr,
+    size_t len, p_timeout tm);
+static int driver_send(p_ringio rio, const char *data, size_t count,
+    size_t *sent, p_timeout tm);
+static int driver_sendv(p_ringio rio, const t_iovec *iov, int iovcnt,
+    size_t *sent, p_timeout tm);
+static int driver_recv(p_ringio rio, char *data, size_t count,
+    size_t *got, p_timeout tm);
+static const char *driver_error(p_ringio rio, int err);
+
+/* ring object methods */
+static luaL_Reg ring_methods[] = {
+    {"__gc",        meth_close},
+    {"__tostring",  auxiliar_tostring},
+    {"accept",      meth_accept},
+    {"cancel",      meth_cancel},
+    {"close",       meth_close},
+    {"receive",     meth_receive},
+    {"send",        meth_send},
+    {"wait",        meth_wait},
+    {NULL,          NULL}
+};
+
+/* functions in library namespace */
+static luaL_Reg func[] = {
+    {"ring", global_create},
+    {NULL,   NULL}
+};
+
+/*-------------------------------------------------------------------------*\
+* Initializes module
+\*-------------------------------------------------------------------------*/
+int ring_open(lua_State *L) {
+    auxiliar_newclass(L, RING_CLASS, ring_methods);
+    luaL_setfuncs(L, func, 0);
+    return 0;
+}
+
+/*=========================================================================*\
+* Lua methods
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Queues a receive of whatever the object has available, into one of the
+* buffers of the ring. A persistent receive completes each time data
+* arrives, and stays queued until it fails.
+\*-------------------------------------------------------------------------*/
+static int meth_receive(lua_State *L) {
+    p_ring p = checkring(L);
+    int persist = lua_toboolean(L, 3);
+    int slot, fd = getfd(L, 2);
+    struct io_uring_sqe *sqe;
+    if (fd < 0) return pusherror(L, "closed");
+    if (!(sqe = queue(L, p, OP_RECEIVE, 2, 0, &slot)))
+        return pusherror(L, "ring is full");
+    p->ops[slot].fd = fd;
+    p->ops[slot].persist = persist;
+    prepreceive(p, sqe, slot);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Queues a send of data, or of the part of it between i and j
+\*-------------------------------------------------------------------------*/
+static int meth_send(lua_State *L) {
+    p_ring p = checkring(L);
+    size_t size;
+    const char *data = luaL_checklstring(L, 3, &size);
+    double len = (double) size;
+    double i = luaL_optnumber(L, 4, 1);
+    double j = luaL_optnumber(L, 5, -1);
+    int slot, fd = getfd(L, 2);
+    struct io_uring_sqe *sqe;
+    if (i < 0) i = len + i + 1;
+    if (i < 1) i = 1;
+    if (j < 0) j = len + j + 1;
+    if (j > len) j = len;
+    if (j < i - 1) j = i - 1;
+    luaL_argcheck(L, j - i + 1 <= UINT_MAX, 3, "data too large");
+    if (fd < 0) return pusherror(L, "closed");
+    if (!(sqe = queue(L, p, OP_SEND, 2, 3, &slot)))
+        return pusherror(L, "ring is full");
+    p->ops[slot].start = i - 1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (__u64) (uintptr_t) (data + (size_t) i - 1);
+    sqe->len = (__u32) (j - i + 1);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (__u64) slot;
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Queues the acceptance of a client by a server object
+\*-------------------------------------------------------------------------*/
+static int meth_accept(lua_State *L) {
+    p_ring p = checkring(L);
+    p_tcp server = (p_tcp) auxiliar_checkclass(L, "tcp{server}", 2);
+    int slot, fd = (int) server->sock;
+    struct io_uring_sqe *sqe;
+    if (server->sock == SOCKET_INVALID) return pusherror(L, "closed");
+    if (!(sqe = queue(L, p, OP_ACCEPT, 2, 0, &slot)))
+        return pusherror(L, "ring is full");
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (__u64) slot;
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Cancels the operations queued on an object. They complete with the
+* error "cancelled" on a later wait.
+\*-------------------------------------------------------------------------*/
+static int meth_cancel(lua_State *L) {
+    p_ring p = checkring(L);
+    int fd = getfd(L, 2);
+    struct io_uring_sqe *sqe;
+    if (fd < 0) return pusherror(L, "closed");
+    sqe = uring_getsqe(&p->u);
+    if (!sqe && uring_enter(&p->u, 0, NULL) == 0) sqe = uring_getsqe(&p->u);
+    if (!sqe) return pusherror(L, "ring is full");
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = RING_NOOP;
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Submits the queued operations and waits for some of them to complete
+* Lua Input: ring [, timeout [, objs, results, errs]]
+*   timeout: in seconds, nil or negative to wait forever
+*   objs, results, errs: tables to reuse for the results
+* Lua Returns
+*   arrays with the object, the result and the error of each operation
+*   that completed, and "timeout" or an error message if none did
+\*-------------------------------------------------------------------------*/
+static int meth_wait(lua_State *L) {
+    p_ring p = checkring(L);
+    double t = luaL_optnumber(L, 2, -1);
+    struct io_uring_cqe *cqe;
+    t_timeout tm;
+    int err, n = 0;
+    lua_settop(L, 5);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, p->ref);
+    setresults(L, 3);
+    setresults(L, 4);
+    setresults(L, 5);
+    timeout_init(&tm, t, -1);
+    timeout_markstart(&tm);
+    err = uring_enter(&p->u, 1, &tm);
+    while ((cqe = uring_peek(&p->u)) != NULL) {
+        __u64 slot = cqe->user_data;
+        int res = cqe->res, kind, done = 1;
+        unsigned flags = cqe->flags;
+        uring_advance(&p->u);
+        if (slot >= (__u64) p->nops || p->ops[slot].kind == OP_FREE)
+            continue;
+        kind = p->ops[slot].kind;
+        if (kind == OP_RECEIVE && p->ops[slot].persist) {
+            /* kernels without multishot receives reject them: from then
+            * on, persistent receives are queued again after each one */
+            if (res == -EINVAL && p->multishot) {
+                p->multishot = 0;
+                if (rearm(p, (int) slot)) continue;
+            }
+            if (res > 0) done = !(flags & IORING_CQE_F_MORE) &&
+                !rearm(p, (int) slot);
+        }
+        lua_rawgeti(L, 6, 2*(int) slot + 1);
+        if (res < 0 || (res == 0 && kind == OP_RECEIVE)) {
+            lua_pushboolean(L, 0);
+            lua_pushstring(L, res == 0? "closed": ringerror(-res));
+        } else {
+            if (kind == OP_RECEIVE) lua_pushlstring(L, p->bufs +
+                (size_t) (flags >> IORING_CQE_BUFFER_SHIFT)*p->bufsize,
+                (size_t) res);
+            else if (kind == OP_SEND)
+                lua_pushnumber(L, p->ops[slot].start + res);
+            else tcp_pushclient(L, (p_tcp) lua_touserdata(L, -1),
+                (t_socket) res);
+            lua_pushboolean(L, 0);
+        }
+        n++;
+        lua_rawseti(L, 9, n);
+        lua_rawseti(L, 8, n);
+        lua_rawseti(L, 7, n);
+        if (flags & IORING_CQE_F_BUFFER)
+            putbuffer(p, flags >> IORING_CQE_BUFFER_SHIFT);
+        if (done) release(L, p, (int) slot, 6);
+    }
+    clearresults(L, 7, n);
+    clearresults(L, 8, n);
+    clearresults(L, 9, n);
+    if (n > 0) return 3;
+    lua_pushstring(L, err == 0 || err == ETIME? "timeout": ringerror(err));
+    return 4;
+}
+
+/*-------------------------------------------------------------------------*\
+* Cancels all operations and releases the kernel resources
+\*-------------------------------------------------------------------------*/
+static int meth_close(lua_State *L) {
+    p_ring p = (p_ring) auxiliar_checkclass(L, RING_CLASS, 1);
+    destroy(L, p);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*=========================================================================*\
+* Library functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Creates a ring object
+* Lua Input: [entries [, buffers [, size]]]
+*   entries: number of operations queued between submissions
+*   buffers: number of receive buffers, rounded up to a power of 2
+*   size: size of each receive buffer
+\*-------------------------------------------------------------------------*/
+static int global_create(lua_State *L) {
+    double entries = luaL_optnumber(L, 1, RING_ENTRIES);
+    double nbufs = luaL_optnumber(L, 2, entries);
+    double bufsize = luaL_optnumber(L, 3, RING_BUFSIZE);
+    unsigned n = 1;
+    p_ring p;
+    int err;
+    luaL_argcheck(L, entries >= 1 && entries <= 32768, 1,
+        "invalid number of entries");
+    luaL_argcheck(L, nbufs >= 1 && nbufs <= 32768, 2,
+        "invalid number of buffers");
+    luaL_argcheck(L, bufsize >= 1 && bufsize <= BUF_MAXSIZE, 3,
+        "invalid buffer size");
+    while (n < nbufs) n <<= 1;
+    p = (p_ring) lua_newuserdata(L, sizeof(t_ring));
+    memset(p, 0, sizeof(t_ring));
+    p->u.fd = -1;
+    p->ref = LUA_NOREF;
+    auxiliar_setclass(L, RING_CLASS, -1);
+    if ((err = uring_init(&p->u, (unsigned) entries)) != 0 ||
+            (err = registerbuffers(p, n, (unsigned) bufsize)) != 0) {
+        destroy(L, p);
+        return pusherror(L, ringerror(err));
+    }
+    p->nops = (int) p->u.cqentries;
+    p->ops = (t_ringop *) calloc((size_t) p->nops, sizeof(t_ringop));
+    if (!p->ops) {
+        destroy(L, p);
+        return pusherror(L, ringerror(ENOMEM));
+    }
+    p->free = -1;
+#ifdef IORING_RECV_MULTISHOT
+    p->multishot = 1;
+#endif
+    for (n = (unsigned) p->nops; n > 0; n--) {
+        p->ops[n-1].next = p->free;
+        p->free = (int) n-1;
+    }
+    lua_newtable(L);
+    p->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+static p_ring checkring(lua_State *L) {
+    p_ring p = (p_ring) auxiliar_checkclass(L, RING_CLASS, 1);
+    if (p->ref == LUA_NOREF) luaL_argerror(L, 1, "ring is closed");
+    return p;
+}
+
+/* calls the getfd method of the object at idx */
+static int getfd(lua_State *L, int idx) {
+    int fd = -1;
+    luaL_checkany(L, idx);
+    lua_getfield(L, idx, "getfd");
+    luaL_argcheck(L, !lua_isnil(L, -1), idx, "getfd method expected");
+    lua_pushvalue(L, idx);
+    lua_call(L, 1, 1);
+    if (lua_isnumber(L, -1)) {
+        double numfd = lua_tonumber(L, -1);
+        fd = (numfd >= 0.0 && numfd <= INT_MAX)? (int) numfd: -1;
+    }
+    lua_pop(L, 1);
+    return fd;
+}
+
+static int pusherror(lua_State *L, const char *err) {
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+}
+
+/* translates the errors specific to rings */
+static const char *ringerror(int err) {
+    switch (err) {
+        case ENOSYS: return "io_uring not available";
+        case ECANCELED: return "cancelled";
+        case ENOBUFS: return "out of buffers";
+        case EPIPE: return "closed";
+        default: return socket_strerror(err);
+    }
+}
+
+/* takes a free slot and an entry of the submission queue for an
+* operation, anchoring the values at obj and data while it is queued */
+static struct io_uring_sqe *queue(lua_State *L, p_ring p, int kind,
+        int obj, int data, int *slot) {
+    struct io_uring_sqe *sqe;
+    if (p->free < 0) return NULL;
+    sqe = uring_getsqe(&p->u);
+    /* make room by submitting what is queued */
+    if (!sqe && uring_enter(&p->u, 0, NULL) == 0)
+        sqe = uring_getsqe(&p->u);
+    if (!sqe) return NULL;
+    *slot = p->free;
+    p->free = p->ops[*slot].next;
+    p->ops[*slot].kind = kind;
+    p->inflight++;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, p->ref);
+    lua_pushvalue(L, obj);
+    lua_rawseti(L, -2, 2*(*slot) + 1);
+    if (data) {
+        lua_pushvalue(L, data);
+        lua_rawseti(L, -2, 2*(*slot) + 2);
+    }
+    lua_pop(L, 1);
+    return sqe;
+}
+
+/* gives back the slot of a completed operation. objs is the index of the
+* table of objects in use */
+static void release(lua_State *L, p_ring p, int slot, int objs) {
+    lua_pushnil(L);
+    lua_rawseti(L, objs, 2*slot + 1);
+    lua_pushnil(L);
+    lua_rawseti(L, objs, 2*slot + 2);
+    p->ops[slot].kind = OP_FREE;
+    p->ops[slot].next = p->free;
+    p->free = slot;
+    p->inflight--;
+}
+
+/* queues a persistent receive again. returns 0 if there is no room */
+static int rearm(p_ring p, int slot) {
+    struct io_uring_sqe *sqe = uring_getsqe(&p->u);
+    if (!sqe && uring_enter(&p->u, 0, NULL) == 0)
+        sqe = uring_getsqe(&p->u);
+    if (!sqe) return 0;
+    prepreceive(p, sqe, slot);
+    return 1;
+}
+
+/* fills in a receive into a buffer of the ring */
+static void prepreceive(p_ring p, struct io_uring_sqe *sqe, int slot) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = p->ops[slot].fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RING_BGID;
+    sqe->user_data = (__u64) slot;
+#ifdef IORING_RECV_MULTISHOT
+    if (p->ops[slot].persist && p->multishot)
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+#endif
+}
+
+/* pushes the table for results given at idx, or a new one */
+static void setresults(lua_State *L, int idx) {
+    if (lua_istable(L, idx)) lua_pushvalue(L, idx);
+    else lua_newtable(L);
+}
+
+/* removes stale entries from a reused results table at idx */
+static void clearresults(lua_State *L, int idx, int n) {
+    int i, len = (int) lua_rawlen(L, idx);
+    for (i = n + 1; i <= len; i++) {
+        lua_pushnil(L);
+        lua_rawseti(L, idx, i);
+    }
+}
+
+/* hands a receive buffer back to the kernel */
+static void putbuffer(p_ring p, unsigned bid) {
+    struct io_uring_buf *b = &p->br->bufs[p->brtail & (p->nbufs - 1)];
+    b->addr = (__u64) (uintptr_t) (p->bufs + (size_t) bid*p->bufsize);
+    b->len = p->bufsize;
+    b->bid = (__u16) bid;
+    p->brtail++;
+    __atomic_store_n(&p->br->tail, p->brtail, __ATOMIC_RELEASE);
+}
+
+/* allocates the receive buffers and registers them with the kernel */
+static int registerbuffers(p_ring p, unsigned nbufs, unsigned bufsize) {
+    struct io_uring_buf_reg reg;
+    unsigned i;
+    p->brsize = nbufs*sizeof(struct io_uring_buf);
+    p->br = (struct io_uring_buf_ring *) mmap(NULL, p->brsize,
+        PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (p->br == MAP_FAILED) {
+        p->br = NULL;
+        return errno;
+    }
+    p->bufs = (char *) malloc((size_t) nbufs*bufsize);
+    if (!p->bufs) return ENOMEM;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (__u64) (uintptr_t) p->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = RING_BGID;
+    if (syscall(__NR_io_uring_register, p->u.fd, IORING_REGISTER_PBUF_RING,
+            &reg, 1) < 0) return errno == EINVAL? ENOSYS: errno;
+    p->nbufs = nbufs;
+    p->bufsize = bufsize;
+    for (i = 0; i < nbufs; i++) putbuffer(p, i);
+    return 0;
+}
+
+/* cancels what is in flight, so that the kernel is done with the
+* buffers, and frees everything */
+static void destroy(lua_State *L, p_ring p) {
+    if (p->u.fd >= 0 && p->inflight > 0) {
+        struct io_uring_sqe *sqe = uring_getsqe(&p->u);
+        if (!sqe && uring_enter(&p->u, 0, NULL) == 0)
+            sqe = uring_getsqe(&p->u);
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+            sqe->user_data = RING_NOOP;
+        }
+        while (sqe && p->inflight > 0 && uring_enter(&p->u, 1, NULL) == 0) {
+            struct io_uring_cqe *cqe;
+            while ((cqe = uring_peek(&p->u)) != NULL) {
+                if (cqe->user_data < (__u64) p->nops &&
+                        !(cqe->flags & IORING_CQE_F_MORE)) {
+                    /* accepted clients are not wanted anymore */
+                    if (p->ops[cqe->user_data].kind == OP_ACCEPT &&
+                            cqe->res >= 0) close(cqe->res);
+                    p->inflight--;
+                }
+                uring_advance(&p->u);
+            }
+        }
+    }
+    uring_destroy(&p->u);
+    if (p->br) munmap(p->br, p->brsize);
+    p->br = NULL;
+    free(p->bufs);
+    p->bufs = NULL;
+    free(p->ops);
+    p->ops = NULL;
+    p->nops = 0;
+    p->free = -1;
+    if (p->ref != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, p->ref);
+        p->ref = LUA_NOREF;
+    }
+}
+
+/*=========================================================================*\
+* io_uring instances
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Sets up a ring and maps its queues in. Returns 0 or an errno value.
+\*-------------------------------------------------------------------------*/
+static int uring_init(p_uring u, unsigned entries) {
+    struct io_uring_params params;
+    char *sq, *cq;
+    unsigned i;
+    memset(u, 0, sizeof(t_uring));
+    memset(&params, 0, sizeof(params));
+    u->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (u->fd < 0) {
+        u->fd = -1;
+        return errno == EPERM? ENOSYS: errno;
+    }
+    /* timeouts on waits came with Linux 5.11 */
+    if (!(params.features & IORING_FEAT_EXT_ARG) ||
+            !(params.features & IORING_FEAT_NODROP)) {
+        uring_destroy(u);
+        return ENOSYS;
+    }
+    u->sqmapsize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    u->cqmapsize = params.cq_off.cqes +
+        params.cq_entries*sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cqmapsize > u->sqmapsize) u->sqmapsize = u->cqmapsize;
+        u->cqmapsize = 0;
+    }
+    u->sqmap = mmap(NULL, u->sqmapsize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sqmap == MAP_FAILED) {
+        u->sqmap = NULL;
+        return uring_fail(u);
+    }
+    if (u->cqmapsize > 0) {
+        u->cqmap = mmap(NULL, u->cqmapsize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cqmap == MAP_FAILED) {
+            u->cqmap = NULL;
+            return uring_fail(u);
+        }
+    }
+    u->sqessize = params.sq_entries*sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *) mmap(NULL, u->sqessize,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+        IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        return uring_fail(u);
+    }
+    sq = (char *) u->sqmap;
+    cq = u->cqmap? (char *) u->cqmap: sq;
+    u->sqhead = (unsigned *) (sq + params.sq_off.head);
+    u->sqtail = (unsigned *) (sq + params.sq_off.tail);
+    u->sqmask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    u->sqarray = (unsigned *) (sq + params.sq_off.array);
+    u->sqentries = params.sq_entries;
+    u->sqlocal = *u->sqtail;
+    u->cqhead = (unsigned *) (cq + params.cq_off.head);
+    u->cqtail = (unsigned *) (cq + params.cq_off.tail);
+    u->cqmask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    u->cqentries = params.cq_entries;
+    /* entries are always used in order */
+    for (i = 0; i < u->sqentries; i++) u->sqarray[i] = i;
+    return 0;
+}
+
+/* undoes a setup that failed, preserving the reason */
+static int uring_fail(p_uring u) {
+    int err = errno;
+    uring_destroy(u);
+    return err;
+}
+
+/*-------------------------------------------------------------------------*\
+* Unmaps the queues and closes the ring
+\*-------------------------------------------------------------------------*/
+static void uring_destroy(p_uring u) {
+    if (u->sqes) munmap(u->sqes, u->sqessize);
+    if (u->cqmap) munmap(u->cqmap, u->cqmapsize);
+    if (u->sqmap) munmap(u->sqmap, u->sqmapsize);
+    u->sqes = NULL;
+    u->cqmap = u->sqmap = NULL;
+    if (u->fd >= 0) close(u->fd);
+    u->fd = -1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns a cleared submission entry, or NULL if the queue is full
+\*-------------------------------------------------------------------------*/
+static struct io_uring_sqe *uring_getsqe(p_uring u) {
+    struct io_uring_sqe *sqe;
+    if (u->fd < 0) return NULL;
+    if (u->sqlocal - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE) >=
+            u->sqentries) return NULL;
+    sqe = &u->sqes[u->sqlocal & u->sqmask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    u->sqlocal++;
+    return sqe;
+}
+
+/*-------------------------------------------------------------------------*\
+* Submits the queued entries and, if wait is set, waits for that many
+* completions, or until the timeout expires. Returns 0, ETIME or an errno
+* value.
+\*-------------------------------------------------------------------------*/
+static int uring_enter(p_uring u, unsigned wait, p_timeout tm) {
+    for ( ;; ) {
+        struct io_uring_getevents_arg arg;
+        struct __kernel_timespec ts;
+        unsigned flags = 0, submit;
+        void *argp = NULL;
+        size_t argsize = 0;
+        double t = tm? timeout_getretry(tm): -1;
+        __atomic_store_n(u->sqtail, u->sqlocal, __ATOMIC_RELEASE);
+        submit = u->sqlocal - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE);
+        if (wait) {
+            flags |= IORING_ENTER_GETEVENTS;
+            if (t >= 0.0) {
+                ts.tv_sec = (long long) t;
+                ts.tv_nsec = (long long) ((t - (double) ts.tv_sec)*1.0e9);
+                memset(&arg, 0, sizeof(arg));
+                arg.ts = (__u64) (uintptr_t) &ts;
+                flags |= IORING_ENTER_EXT_ARG;
+                argp = &arg;
+                argsize = sizeof(arg);
+            }
+        } else if (submit == 0) return 0;
+        if (syscall(__NR_io_uring_enter, u->fd, submit, wait, flags,
+                argp, argsize) >= 0) return 0;
+        /* if a signal arrived, waits for what is left of the timeout */
+        if (errno == EINTR) continue;
+        /* completions are pending: the caller reaps them */
+        if (errno == EBUSY || errno == EAGAIN) return 0;
+        return errno;
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the oldest completion not yet reaped, or NULL
+\*-------------------------------------------------------------------------*/
+static struct io_uring_cqe *uring_peek(p_uring u) {
+    unsigned head = *u->cqhead;
+    if (head == __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) return NULL;
+    return &u->cqes[head & u->cqmask];
+}
+
+static void uring_advance(p_uring u) {
+    __atomic_store_n(u->cqhead, *u->cqhead + 1, __ATOMIC_RELEASE);
+}
+
+/*=========================================================================*\
+* I/O driver
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Switches the I/O of a socket to the ring of the Lua state. Returns NULL,
+* or an error message if io_uring is not available.
+\*-------------------------------------------------------------------------*/
+const char *ring_setdriver(lua_State *L, p_io io, p_ringio rio,
+        p_socket ps) {
+    int err;
+    p_uring u = driver_open(L, &err);
+    if (!u) return ringerror(err);
+    rio->ps = ps;
+    rio->ring = u;
+    io_init(io, (p_send) driver_send, (p_sendv) driver_sendv,
+        (p_recv) driver_recv, (p_error) driver_error, rio);
+    return NULL;
+}
+
+/* returns the ring of the Lua state, creating it if needed */
+static p_uring driver_open(lua_State *L, int *err) {
+    p_uring u;
+    lua_pushlightuserdata(L, &ring_driverkey);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    u = (p_uring) lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (!u) {
+        u = (p_uring) lua_newuserdata(L, sizeof(t_uring));
+        /* a driver has at most an operation and its timeout in flight */
+        if ((*err = uring_init(u, 4)) != 0) {
+            lua_pop(L, 1);
+            return NULL;
+        }
+        lua_newtable(L);
+        lua_pushstring(L, "__gc");
+        lua_pushcfunction(L, driver_gc);
+        lua_rawset(L, -3);
+        lua_setmetatable(L, -2);
+        lua_pushlightuserdata(L, &ring_driverkey);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+        lua_pop(L, 1);
+    }
+    return u;
+}
+
+static int driver_gc(lua_State *L) {
+    uring_destroy((p_uring) lua_touserdata(L, 1));
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Runs an operation on the socket through the ring, and waits for it to
+* complete or for the timeout to expire. Returns what the operation
+* returned, a negative errno value on failure.
+\*-------------------------------------------------------------------------*/
+static int driver_run(p_ringio rio, int opcode, const void *addr,
+        size_t len, p_timeout tm) {
+    p_uring u = rio->ring;
+    struct __kernel_timespec ts;
+    double t = timeout_getretry(tm);
+    struct io_uring_sqe *sqe = uring_getsqe(u);
+    if (!sqe) return -EBUSY;
+    sqe->opcode = (__u8) opcode;
+    sqe->fd = (int) *rio->ps;
+    sqe->addr = (__u64) (uintptr_t) addr;
+    sqe->len = len > UINT_MAX? UINT_MAX: (__u32) len;
+    if (opcode != IORING_OP_RECV) sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = RING_DRIVEROP;
+    /* the timeout cancels the operation if it expires first */
+    if (t >= 0.0) {
+        sqe->flags |= IOSQE_IO_LINK;
+        ts.tv_sec = (long long) t;
+        ts.tv_nsec = (long long) ((t - (double) ts.tv_sec)*1.0e9);
+        sqe = uring_getsqe(u);
+        sqe->opcode = IORING_OP_LINK_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (__u64) (uintptr_t) &ts;
+        sqe->len = 1;
+        sqe->user_data = RING_DRIVERTIMEOUT;
+    }
+    for ( ;; ) {
+        struct io_uring_cqe *cqe;
+        int err = uring_enter(u, 1, NULL);
+        if (err != 0) {
+            /* take back whatever the kernel did not consume */
+            u->sqlocal = __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE);
+            __atomic_store_n(u->sqtail, u->sqlocal, __ATOMIC_RELEASE);
+            return -err;
+        }
+        /* completions of timeouts from earlier operations are ignored */
+        while ((cqe = uring_peek(u)) != NULL) {
+            int res = cqe->res;
+            __u64 tag = cqe->user_data;
+            uring_advance(u);
+            if (tag == RING_DRIVEROP) return res;
+        }
+    }
+}
+
+static int driver_send(p_ringio rio, const char *data, size_t count,
+        size_t *sent, p_timeout tm) {
+    *sent = 0;
+    if (*rio->ps == SOCKET_INVALID) return IO_CLOSED;
+    /* nothing to wait for: a plain send is enough */
+    if (timeout_getretry(tm) == 0.0)
+        return socket_send(rio->ps, data, count, sent, tm);
+    for ( ;; ) {
+        int res = driver_run(rio, IORING_OP_SEND, data, count, tm);
+        if (res >= 0) {
+            *sent = (size_t) res;
+            return IO_DONE;
+        }
+        if (res == -EPIPE) return IO_CLOSED;
+        if (res == -ECANCELED) return IO_TIMEOUT;
+        if (res == -EINTR) continue;
+        if (res != -EAGAIN) return -res;
+        if ((res = socket_waitfd(rio->ps, POLLOUT, tm)) != IO_DONE)
+            return res;
+    }
+}
+
+static int driver_sendv(p_ringio rio, const t_iovec *iov, int iovcnt,
+        size_t *sent, p_timeout tm) {
+    struct iovec vec[IO_IOVMAX];
+    struct msghdr msg;
+    int i;
+    *sent = 0;
+    if (*rio->ps == SOCKET_INVALID) return IO_CLOSED;
+    if (timeout_getretry(tm) == 0.0)
+        return socket_sendv(rio->ps, iov, iovcnt, sent, tm);
+    if (iovcnt > IO_IOVMAX) iovcnt = IO_IOVMAX;
+    for (i = 0; i < iovcnt; i++) {
+        vec[i].iov_base = (void *) iov[i].data;
+        vec[i].iov_len = iov[i].count;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = iovcnt;
+    for ( ;; ) {
+        int res = driver_run(rio, IORING_OP_SENDMSG, &msg, 1, tm);
+        if (res >= 0) {
+            *sent = (size_t) res;
+            return IO_DONE;
+        }
+        if (res == -EPIPE) return IO_CLOSED;
+        if (res == -ECANCELED) return IO_TIMEOUT;
+        if (res == -EINTR) continue;
+        if (res != -EAGAIN) return -res;
+        if ((res = socket_waitfd(rio->ps, POLLOUT, tm)) != IO_DONE)
+            return res;
+    }
+}
+
+static int driver_recv(p_ringio rio, char *data, size_t count,
+        size_t *got, p_timeout tm) {
+    *got = 0;
+    if (*rio->ps == SOCKET_INVALID) return IO_CLOSED;
+    if (timeout_getretry(tm) == 0.0)
+        return socket_recv(rio->ps, data, count, got, tm);
+    for ( ;; ) {
+        int res = driver_run(rio, IORING_OP_RECV, data, count, tm);
+        if (res > 0) {
+            *got = (size_t) res;
+            return IO_DONE;
+        }
+        if (res == 0) return IO_CLOSED;
+        if (res == -ECANCELED) return IO_TIMEOUT;
+        if (res == -EINTR) continue;
+        if (res != -EAGAIN) return -res;
+        if ((res = socket_waitfd(rio->ps, POLLIN, tm)) != IO_DONE)
+            return res;
+    }
+}
+
+static const char *driver_error(p_ringio rio, int err) {
+    return socket_ioerror(rio->ps, err);
+}
+
+#else
+/*-------------------------------------------------------------------------*\
+* Rings are only available on Linux
+\*-------------------------------------------------------------------------*/
+int ring_open(lua_State *L) {
+    (void) L;
+    return 0;
+}
+#endif
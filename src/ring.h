@@ -0,0 +1,77 @@
+#ifndef RING_H
+#define RING_H
+/*=========================================================================*\
+* io_uring submission rings
+* LuaSocket toolkit
+*
+* A ring queues receives, sends and accepts on many objects and hands them
+* all to the kernel with a single io_uring_enter, which also collects the
+* operations that completed in the meantime. Receives do not name a
+* destination: the kernel picks one from a ring of buffers registered in
+* advance, so that idle connections do not pin memory.
+*
+* The module also implements the t_io interface on io_uring, so that tcp
+* objects can route their own I/O through a ring kept by the Lua state.
+* Waiting for an operation then costs a single system call, instead of a
+* try, a poll and a retry.
+*
+* io_uring is specific to Linux, and may be missing or disabled even there.
+* Both uses fail with an error message in that case, and callers are
+* expected to stay on the poll path.
+\*=========================================================================*/
+#include "luasocket.h"
+#include "io.h"
+#include "timeout.h"
+#include "socket.h"
+
+/* buffer rings and cancellation by descriptor came with Linux 5.19, as did
+* IORING_RECVSEND_POLL_FIRST, which the header defines as a macro */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECVSEND_POLL_FIRST
+#define RING_URING
+#endif
+#endif
+#endif
+
+#ifdef RING_URING
+/* an io_uring instance, with its queues mapped in */
+typedef struct t_uring_ {
+    int fd;                 /* the ring itself, or -1 */
+    unsigned *sqhead, *sqtail, sqmask, *sqarray;
+    unsigned sqentries;     /* size of the submission queue */
+    unsigned sqlocal;       /* tail of the queue, not yet published */
+    struct io_uring_sqe *sqes;
+    unsigned *cqhead, *cqtail, cqmask;
+    unsigned cqentries;     /* size of the completion queue */
+    struct io_uring_cqe *cqes;
+    void *sqmap, *cqmap;    /* mapped queues, which may be the same */
+    size_t sqmapsize, cqmapsize;
+    size_t sqessize;
+} t_uring;
+typedef t_uring *p_uring;
+
+/* context of the io_uring driver of a socket */
+typedef struct t_ringio_ {
+    p_socket ps;            /* the socket */
+    p_uring ring;           /* the ring of the Lua state */
+} t_ringio;
+typedef t_ringio *p_ringio;
+#endif
+
+#ifndef _WIN32
+#pragma GCC visibility push(hidden)
+#endif
+
+int ring_open(lua_State *L);
+#ifdef RING_URING
+const char *ring_setdriver(lua_State *L, p_io io, p_ringio rio,
+    p_socket ps);
+#endif
+
+#ifndef _WIN32
+#pragma GCC visibility pop
+#endif
+
+#endif /* RING_H */
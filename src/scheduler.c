@@ -0,0 +1,765 @@
+/*=========================================================================*\
+* Coroutine schedulers
+* LuaSocket toolkit
+\*=========================================================================*/
+#include "luasocket.h"
+
+#include "auxiliar.h"
+#include "timeout.h"
+#include "scheduler.h"
+
+#ifndef _WIN32
+#include "socket.h"
+#include "buffer.h"
+#include "tcp.h"
+#include "udp.h"
+#include "poller.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef POLLER_EPOLL
+#define SCHEDULER_CLASS "scheduler{epoll}"
+#else
+#define SCHEDULER_CLASS "scheduler{poll}"
+#endif
+
+/* largest number of descriptors reported by each wait */
+#define SCHEDULER_MAXEVENTS 256
+
+/* task states */
+#define TASK_FREE 0
+#define TASK_READY 1
+#define TASK_PARKED 2
+#define TASK_RUNNING 3
+
+/* a coroutine run by the scheduler */
+typedef struct t_task_ {
+    lua_State *co;          /* the coroutine itself */
+    int state;              /* one of the task states above */
+    int nargs;              /* values on its stack to resume it with, or
+                               -1 if it must fail instead */
+    int fd;                 /* descriptor it is parked on, or -1 */
+    int heap;               /* position in the deadline heap, or -1 */
+    double deadline;        /* when to stop waiting, if in the heap */
+    int next;               /* next task in the ready queue or free list */
+} t_task;
+typedef t_task *p_task;
+
+/* tasks parked on a descriptor */
+typedef struct t_watch_ {
+    int reader;             /* task waiting to read, or -1 */
+    int writer;             /* task waiting to write, or -1 */
+    int registered;         /* events the pollset watches for */
+    int changed;            /* whether it is in the list of changes */
+} t_watch;
+typedef t_watch *p_watch;
+
+/* scheduler control structure */
+typedef struct t_scheduler_ {
+    int tasksref;           /* registry reference to the coroutines */
+    int objectsref;         /* registry reference to the watched objects */
+    t_pollset set;          /* watched descriptors */
+    t_task *tasks;          /* task storage */
+    int size;               /* number of tasks allocated */
+    int used;               /* number of tasks ever handed out */
+    int free;               /* first released task, or -1 */
+    int alive;              /* tasks that have not finished */
+    int current;            /* task being resumed, or -1 */
+    int head, tail, nready; /* queue of tasks ready to run */
+    int *heap;              /* parked tasks with a timeout, by deadline */
+    int nheap;              /* number of tasks in the heap */
+    t_watch *watches;       /* parked tasks, by descriptor */
+    int nwatches;           /* number of watches allocated */
+    int *changes;           /* descriptors whose watch changed */
+    int nchanges;           /* number of entries used in changes */
+    int changesize;         /* number of entries allocated in changes */
+} t_scheduler;
+typedef t_scheduler *p_scheduler;
+
+/* first value yielded by a task that parks itself */
+static char scheduler_park;
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static int global_create(lua_State *L);
+static int meth_spawn(lua_State *L);
+static int meth_wait(lua_State *L);
+static int meth_sleep(lua_State *L);
+static int meth_step(lua_State *L);
+static int meth_run(lua_State *L);
+static int meth_gc(lua_State *L);
+static p_scheduler checkscheduler(lua_State *L);
+static p_scheduler checktask(lua_State *L);
+static int checkevents(lua_State *L, int arg);
+static int getfd(lua_State *L, int idx, int *dirty);
+static int pusherror(lua_State *L, const char *err);
+static int parkyield(lua_State *L, int obj, int fd, int events, double t);
+static int task_alloc(p_scheduler s);
+static void task_release(lua_State *L, p_scheduler s, int idx);
+static void task_enqueue(p_scheduler s, int idx);
+static int task_dequeue(p_scheduler s);
+static void heap_push(p_scheduler s, int idx);
+static void heap_remove(p_scheduler s, int idx);
+static const char *attach(p_scheduler s, int idx, lua_State *co, int obj,
+    int fd, int events);
+static void detach(p_scheduler s, int idx);
+static void changed(p_scheduler s, int fd);
+static void park(p_scheduler s, int idx, lua_State *co);
+static void wake(p_scheduler s, int idx, const char *err);
+static void commit(lua_State *L, p_scheduler s);
+static void resume(lua_State *L, p_scheduler s, int idx);
+static void step(lua_State *L, p_scheduler s, double t);
+#ifdef SCHEDULER_YIELD
+static int yieldtry(lua_State *L, p_yieldop op);
+static int yieldresume(lua_State *L, int status, lua_KContext ctx);
+#endif
+
+/* scheduler methods */
+static luaL_Reg scheduler_methods[] = {
+    {"__gc",        meth_gc},
+    {"__tostring",  auxiliar_tostring},
+    {"run",         meth_run},
+    {"sleep",       meth_sleep},
+    {"spawn",       meth_spawn},
+    {"step",        meth_step},
+    {"wait",        meth_wait},
+    {NULL,          NULL}
+};
+
+/* functions in library namespace */
+static luaL_Reg func[] = {
+    {"scheduler", global_create},
+    {NULL,        NULL}
+};
+
+/*-------------------------------------------------------------------------*\
+* Initializes module
+\*-------------------------------------------------------------------------*/
+int scheduler_open(lua_State *L) {
+    auxiliar_newclass(L, SCHEDULER_CLASS, scheduler_methods);
+    luaL_setfuncs(L, func, 0);
+    return 0;
+}
+
+/*=========================================================================*\
+* Lua methods
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Creates a task that will call f with the remaining arguments on the
+* next step. Returns its coroutine.
+\*-------------------------------------------------------------------------*/
+static int meth_spawn(lua_State *L) {
+    p_scheduler s = checkscheduler(L);
+    int nargs = lua_gettop(L) - 2, idx;
+    lua_State *co;
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    idx = task_alloc(s);
+    if (idx < 0) return pusherror(L, "out of memory");
+    co = lua_newthread(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, s->tasksref);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, idx+1);
+    lua_pop(L, 1);
+    lua_insert(L, 2);
+    lua_xmove(L, co, nargs + 1);
+    s->tasks[idx].co = co;
+    s->tasks[idx].nargs = nargs;
+    task_enqueue(s, idx);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Parks the calling task until an object is ready, for at most t seconds
+* Lua Input: scheduler, object, events [, t]
+*   events: "r" to wait until readable, "w" until writable
+* Lua Returns
+*   1 when ready, nil and "timeout" or an error message otherwise
+\*-------------------------------------------------------------------------*/
+static int meth_wait(lua_State *L) {
+    int events = checkevents(L, 3), dirty, fd;
+    double t = luaL_optnumber(L, 4, -1);
+    checktask(L);
+    luaL_checkany(L, 2);
+    fd = getfd(L, 2, &dirty);
+    if (fd < 0) return pusherror(L, "closed");
+    /* buffered data is ready without asking the kernel */
+    if (dirty && events == POLLER_READ) {
+        lua_pushnumber(L, 1);
+        return 1;
+    }
+    return parkyield(L, 2, fd, events, t);
+}
+
+/*-------------------------------------------------------------------------*\
+* Parks the calling task for t seconds. Without t, lets other ready tasks
+* run first.
+\*-------------------------------------------------------------------------*/
+static int meth_sleep(lua_State *L) {
+    double t = luaL_optnumber(L, 2, -1);
+    checktask(L);
+    lua_settop(L, 2);
+    lua_pushnil(L);
+    if (t < 0.0) return lua_yield(L, 0);
+    return parkyield(L, 3, -1, 0, t);
+}
+
+/*-------------------------------------------------------------------------*\
+* Waits at most t seconds for parked tasks to become ready, and runs
+* them together with those that were ready already
+* Lua Input: scheduler [, t]
+*   t: in seconds, nil or negative to wait until a task is ready
+* Lua Returns
+*   the number of tasks that have not finished
+\*-------------------------------------------------------------------------*/
+static int meth_step(lua_State *L) {
+    p_scheduler s = checkscheduler(L);
+    double t = luaL_optnumber(L, 2, -1);
+    lua_settop(L, 1);
+    step(L, s, t);
+    lua_pushnumber(L, s->alive);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Steps until all tasks have finished
+\*-------------------------------------------------------------------------*/
+static int meth_run(lua_State *L) {
+    p_scheduler s = checkscheduler(L);
+    lua_settop(L, 1);
+    while (s->alive > 0) step(L, s, -1);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Releases the scheduler, along with any tasks that did not finish
+\*-------------------------------------------------------------------------*/
+static int meth_gc(lua_State *L) {
+    p_scheduler s = (p_scheduler) auxiliar_checkclass(L, SCHEDULER_CLASS, 1);
+    if (s->tasksref != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, s->tasksref);
+        luaL_unref(L, LUA_REGISTRYINDEX, s->objectsref);
+        s->tasksref = s->objectsref = LUA_NOREF;
+        pollset_destroy(&s->set);
+        free(s->tasks);
+        free(s->heap);
+        free(s->watches);
+        free(s->changes);
+        s->tasks = NULL;
+        s->heap = s->changes = NULL;
+        s->watches = NULL;
+    }
+    return 0;
+}
+
+/*=========================================================================*\
+* Library functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Creates a scheduler object
+\*-------------------------------------------------------------------------*/
+static int global_create(lua_State *L) {
+    p_scheduler s = (p_scheduler) lua_newuserdata(L, sizeof(t_scheduler));
+    int err;
+    memset(s, 0, sizeof(t_scheduler));
+    s->tasksref = s->objectsref = LUA_NOREF;
+    if ((err = pollset_init(&s->set)) != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, socket_strerror(err));
+        return 2;
+    }
+    s->free = s->current = s->head = s->tail = -1;
+    auxiliar_setclass(L, SCHEDULER_CLASS, -1);
+    lua_newtable(L);
+    s->tasksref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_newtable(L);
+    s->objectsref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+static p_scheduler checkscheduler(lua_State *L) {
+    return (p_scheduler) auxiliar_checkclass(L, SCHEDULER_CLASS, 1);
+}
+
+/* makes sure the scheduler is running the calling coroutine */
+static p_scheduler checktask(lua_State *L) {
+    p_scheduler s = checkscheduler(L);
+    if (s->current < 0 || s->tasks[s->current].co != L)
+        luaL_error(L, "not called from a task of this scheduler");
+    return s;
+}
+
+static int checkevents(lua_State *L, int arg) {
+    const char *s = luaL_checkstring(L, arg);
+    if (s[0] == 'r' && s[1] == '\0') return POLLER_READ;
+    if (s[0] == 'w' && s[1] == '\0') return POLLER_WRITE;
+    return luaL_argerror(L, arg, "invalid events");
+}
+
+/* gets the descriptor of the object at idx, and whether it has buffered
+* data. our own objects are looked at directly, others must export getfd */
+static int getfd(lua_State *L, int idx, int *dirty) {
+    int fd = -1;
+    *dirty = 0;
+    if (lua_getmetatable(L, idx)) {
+        void *udata = lua_touserdata(L, idx);
+        int istcp, isudp;
+        lua_getfield(L, -1, "tcp{any}");
+        istcp = !lua_isnil(L, -1);
+        lua_getfield(L, -2, "udp{any}");
+        isudp = !lua_isnil(L, -1);
+        lua_pop(L, 3);
+        if (udata && istcp) {
+            p_tcp tcp = (p_tcp) udata;
+            *dirty = !buffer_isempty(&tcp->buf);
+            return tcp->sock == SOCKET_INVALID? -1: (int) tcp->sock;
+        }
+        if (udata && isudp) {
+            p_udp udp = (p_udp) udata;
+            return udp->sock == SOCKET_INVALID? -1: (int) udp->sock;
+        }
+    }
+    lua_getfield(L, idx, "getfd");
+    luaL_argcheck(L, !lua_isnil(L, -1), idx, "getfd method expected");
+    lua_pushvalue(L, idx);
+    lua_call(L, 1, 1);
+    if (lua_isnumber(L, -1)) {
+        double numfd = lua_tonumber(L, -1);
+        fd = (numfd >= 0.0 && numfd <= INT_MAX)? (int) numfd: -1;
+    }
+    lua_pop(L, 1);
+    return fd;
+}
+
+static int pusherror(lua_State *L, const char *err) {
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+}
+
+/* yields to the scheduler, asking to be resumed when the descriptor of
+* the object at obj is ready for events, or after t seconds */
+static int parkyield(lua_State *L, int obj, int fd, int events, double t) {
+    lua_pushlightuserdata(L, &scheduler_park);
+    lua_pushvalue(L, obj);
+    lua_pushnumber(L, fd);
+    lua_pushnumber(L, events);
+    lua_pushnumber(L, t);
+    return lua_yield(L, 5);
+}
+
+/*-------------------------------------------------------------------------*\
+* Task storage and ready queue
+\*-------------------------------------------------------------------------*/
+static int task_alloc(p_scheduler s) {
+    int idx = s->free;
+    p_task t;
+    if (idx >= 0) {
+        s->free = s->tasks[idx].next;
+    } else {
+        if (s->used == s->size) {
+            int size = s->size? 2*s->size: 64;
+            t_task *tasks;
+            int *heap;
+            if (s->size > INT_MAX/2 ||
+                (size_t) size > ((size_t) -1)/sizeof(t_task)) return -1;
+            tasks = (t_task *) realloc(s->tasks, size*sizeof(t_task));
+            if (!tasks) return -1;
+            s->tasks = tasks;
+            /* every task fits in the heap at once */
+            heap = (int *) realloc(s->heap, size*sizeof(int));
+            if (!heap) return -1;
+            s->heap = heap;
+            s->size = size;
+        }
+        idx = s->used++;
+    }
+    t = &s->tasks[idx];
+    t->co = NULL;
+    t->nargs = 0;
+    t->fd = t->heap = -1;
+    t->state = TASK_FREE;
+    s->alive++;
+    return idx;
+}
+
+static void task_release(lua_State *L, p_scheduler s, int idx) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, s->tasksref);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, idx+1);
+    lua_pop(L, 1);
+    s->tasks[idx].co = NULL;
+    s->tasks[idx].state = TASK_FREE;
+    s->tasks[idx].next = s->free;
+    s->free = idx;
+    s->alive--;
+}
+
+static void task_enqueue(p_scheduler s, int idx) {
+    s->tasks[idx].state = TASK_READY;
+    s->tasks[idx].next = -1;
+    if (s->tail >= 0) s->tasks[s->tail].next = idx;
+    else s->head = idx;
+    s->tail = idx;
+    s->nready++;
+}
+
+static int task_dequeue(p_scheduler s) {
+    int idx = s->head;
+    s->head = s->tasks[idx].next;
+    if (s->head < 0) s->tail = -1;
+    s->nready--;
+    return idx;
+}
+
+/*-------------------------------------------------------------------------*\
+* Binary heap of parked tasks, earliest deadline first
+\*-------------------------------------------------------------------------*/
+#define DEADLINE(s, pos) ((s)->tasks[(s)->heap[pos]].deadline)
+
+static void heap_set(p_scheduler s, int pos, int idx) {
+    s->heap[pos] = idx;
+    s->tasks[idx].heap = pos;
+}
+
+static void heap_up(p_scheduler s, int pos) {
+    int idx = s->heap[pos];
+    double d = s->tasks[idx].deadline;
+    while (pos > 0) {
+        int parent = (pos - 1)/2;
+        if (DEADLINE(s, parent) <= d) break;
+        heap_set(s, pos, s->heap[parent]);
+        pos = parent;
+    }
+    heap_set(s, pos, idx);
+}
+
+static void heap_down(p_scheduler s, int pos) {
+    int idx = s->heap[pos];
+    double d = s->tasks[idx].deadline;
+    for ( ;; ) {
+        int child = 2*pos + 1;
+        if (child >= s->nheap) break;
+        if (child + 1 < s->nheap && DEADLINE(s, child+1) < DEADLINE(s, child))
+            child++;
+        if (DEADLINE(s, child) >= d) break;
+        heap_set(s, pos, s->heap[child]);
+        pos = child;
+    }
+    heap_set(s, pos, idx);
+}
+
+static void heap_push(p_scheduler s, int idx) {
+    s->heap[s->nheap++] = idx;
+    heap_up(s, s->nheap - 1);
+}
+
+static void heap_remove(p_scheduler s, int idx) {
+    int pos = s->tasks[idx].heap, last = s->heap[--s->nheap];
+    s->tasks[idx].heap = -1;
+    if (pos < s->nheap) {
+        heap_set(s, pos, last);
+        heap_up(s, pos);
+        heap_down(s, s->tasks[last].heap);
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Watches. Changes are only handed to the pollset before the next wait,
+* so a task that parks again on the same descriptor in the same batch,
+* which is the common case, costs no system call at all.
+\*-------------------------------------------------------------------------*/
+static const char *attach(p_scheduler s, int idx, lua_State *co, int obj,
+        int fd, int events) {
+    p_watch w;
+    if (fd >= s->nwatches) {
+        int i, n = s->nwatches? s->nwatches: 64;
+        t_watch *watches;
+        while (n <= fd) n *= 2;
+        watches = (t_watch *) realloc(s->watches, n*sizeof(t_watch));
+        if (!watches) return "out of memory";
+        for (i = s->nwatches; i < n; i++) {
+            watches[i].reader = watches[i].writer = -1;
+            watches[i].registered = watches[i].changed = 0;
+        }
+        s->watches = watches;
+        s->nwatches = n;
+    }
+    w = &s->watches[fd];
+    if ((events == POLLER_READ && w->reader >= 0) ||
+        (events == POLLER_WRITE && w->writer >= 0)) return "busy";
+    /* a different object with the same descriptor means the one we knew
+    * was closed, and the kernel forgot about it */
+    if (!lua_checkstack(co, 3)) return "out of memory";
+    lua_rawgeti(co, LUA_REGISTRYINDEX, s->objectsref);
+    lua_rawgeti(co, -1, fd);
+    if (!lua_rawequal(co, -1, obj)) {
+        if (w->registered) pollset_remove(&s->set, fd);
+        w->registered = 0;
+        lua_pushvalue(co, obj);
+        lua_rawseti(co, -3, fd);
+    }
+    lua_pop(co, 2);
+    if (events == POLLER_READ) w->reader = idx;
+    else w->writer = idx;
+    s->tasks[idx].fd = fd;
+    changed(s, fd);
+    return NULL;
+}
+
+static void detach(p_scheduler s, int idx) {
+    p_task t = &s->tasks[idx];
+    if (t->fd >= 0) {
+        p_watch w = &s->watches[t->fd];
+        if (w->reader == idx) w->reader = -1;
+        if (w->writer == idx) w->writer = -1;
+        changed(s, t->fd);
+        t->fd = -1;
+    }
+    if (t->heap >= 0) heap_remove(s, idx);
+}
+
+static void changed(p_scheduler s, int fd) {
+    if (s->watches[fd].changed) return;
+    if (s->nchanges >= s->changesize) {
+        int n = s->changesize? 2*s->changesize: 64;
+        int *changes = (int *) realloc(s->changes, n*sizeof(int));
+        /* without room, the change waits for the next park */
+        if (!changes) return;
+        s->changes = changes;
+        s->changesize = n;
+    }
+    s->watches[fd].changed = 1;
+    s->changes[s->nchanges++] = fd;
+}
+
+/* hands the watches that changed to the pollset */
+static void commit(lua_State *L, p_scheduler s) {
+    int i;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, s->objectsref);
+    /* failures wake tasks, which can add more changes */
+    for (i = 0; i < s->nchanges; i++) {
+        int fd = s->changes[i], want, err = 0;
+        p_watch w = &s->watches[fd];
+        w->changed = 0;
+        want = (w->reader >= 0? POLLER_READ: 0) |
+            (w->writer >= 0? POLLER_WRITE: 0);
+        if (want == w->registered) continue;
+        if (!want) {
+            pollset_remove(&s->set, fd);
+            w->registered = 0;
+            lua_pushnil(L);
+            lua_rawseti(L, -2, fd);
+            continue;
+        }
+        if (w->registered) {
+            err = pollset_modify(&s->set, fd, want);
+            if (err == ENOENT) err = pollset_add(&s->set, fd, want);
+        } else {
+            err = pollset_add(&s->set, fd, want);
+            if (err == EEXIST) err = pollset_modify(&s->set, fd, want);
+        }
+        if (err) {
+            w->registered = 0;
+            if (w->reader >= 0) wake(s, w->reader, socket_strerror(err));
+            if (w->writer >= 0) wake(s, w->writer, socket_strerror(err));
+        } else w->registered = want;
+    }
+    s->nchanges = 0;
+    lua_pop(L, 1);
+}
+
+/*-------------------------------------------------------------------------*\
+* Task transitions
+\*-------------------------------------------------------------------------*/
+/* parks a task that yielded to the scheduler. the values it yielded are
+* on top of its stack: marker, object, descriptor, events and timeout */
+static void park(p_scheduler s, int idx, lua_State *co) {
+    int fd = (int) lua_tonumber(co, -3);
+    int events = (int) lua_tonumber(co, -2);
+    double t = lua_tonumber(co, -1);
+    const char *err = NULL;
+    s->tasks[idx].state = TASK_PARKED;
+    s->tasks[idx].nargs = 0;
+    if (fd >= 0) err = attach(s, idx, co, lua_gettop(co) - 3, fd, events);
+    lua_pop(co, 5);
+    if (err) {
+        wake(s, idx, err);
+        return;
+    }
+    if (t >= 0.0) {
+        s->tasks[idx].deadline = timeout_monotime() + t;
+        heap_push(s, idx);
+    } else if (fd < 0) task_enqueue(s, idx);
+}
+
+/* makes a parked task ready, to be resumed with 1, or nil and err. a task
+* whose stack cannot take these fails with "out of memory" instead */
+static void wake(p_scheduler s, int idx, const char *err) {
+    p_task t = &s->tasks[idx];
+    detach(s, idx);
+    if (!lua_checkstack(t->co, 2)) t->nargs = -1;
+    else if (err) {
+        lua_pushnil(t->co);
+        lua_pushstring(t->co, err);
+        t->nargs = 2;
+    } else {
+        lua_pushnumber(t->co, 1);
+        t->nargs = 1;
+    }
+    task_enqueue(s, idx);
+}
+
+/* runs a ready task until it parks, yields or finishes. errors raised by
+* the task are raised again by the scheduler, as is the failure of a task
+* that wake could not resume */
+static void resume(lua_State *L, p_scheduler s, int idx) {
+    lua_State *co = s->tasks[idx].co;
+    int status, nres = 0;
+    if (s->tasks[idx].nargs < 0) {
+        task_release(L, s, idx);
+        lua_pushliteral(L, "out of memory");
+        lua_error(L);
+    }
+    s->tasks[idx].state = TASK_RUNNING;
+    s->current = idx;
+    status = luasocket_resume(co, L, s->tasks[idx].nargs, &nres);
+    s->current = -1;
+    if (status == LUA_YIELD) {
+        if (nres == 5 && lua_touserdata(co, -5) == &scheduler_park) {
+            park(s, idx, co);
+        } else {
+            /* plain yields just let other tasks run */
+            lua_pop(co, nres);
+            s->tasks[idx].nargs = 0;
+            task_enqueue(s, idx);
+        }
+    } else if (status != 0) {
+        lua_xmove(co, L, 1);
+        task_release(L, s, idx);
+        lua_error(L);
+    } else task_release(L, s, idx);
+}
+
+/* waits for parked tasks and runs everything that is ready */
+static void step(lua_State *L, p_scheduler s, double t) {
+    t_timeout tm;
+    double now;
+    int n, i;
+    if (s->current >= 0) luaL_error(L, "scheduler is already running");
+    commit(L, s);
+    if (s->nready > 0 || s->alive == 0) t = 0.0;
+    else if (s->nheap > 0) {
+        double d = DEADLINE(s, 0) - timeout_monotime();
+        if (d < 0.0) d = 0.0;
+        if (t < 0.0 || d < t) t = d;
+    }
+    timeout_init(&tm, t, -1);
+    timeout_markstart(&tm);
+    n = pollset_wait(&s->set, SCHEDULER_MAXEVENTS, &tm);
+    if (n < 0) luaL_error(L, "wait failed (%s)", socket_strerror(-n));
+    for (i = 0; i < n; i++) {
+        int events, fd = pollset_result(&s->set, i, &events);
+        p_watch w;
+        if (fd >= s->nwatches) continue;
+        w = &s->watches[fd];
+        if ((events & POLLER_READ) && w->reader >= 0)
+            wake(s, w->reader, NULL);
+        if ((events & POLLER_WRITE) && w->writer >= 0)
+            wake(s, w->writer, NULL);
+    }
+    now = timeout_monotime();
+    while (s->nheap > 0 && DEADLINE(s, 0) <= now) {
+        int idx = s->heap[0];
+        wake(s, idx, s->tasks[idx].fd >= 0? "timeout": NULL);
+    }
+    /* tasks made ready by this batch run on the next step */
+    for (n = s->nready; n > 0; n--) resume(L, s, task_dequeue(s));
+}
+
+#ifdef SCHEDULER_YIELD
+/*=========================================================================*\
+* Yield mode
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Calls a method in yield mode. Operations that cannot complete park the
+* calling coroutine, if it can yield, for as long as the timeouts of the
+* object allow. Otherwise the method returns right away, as if the
+* timeout were zero.
+\*-------------------------------------------------------------------------*/
+int scheduler_yieldcall(lua_State *L, p_yieldop op, p_timeout tm) {
+    lua_settop(L, op->nargs);
+    timeout_markstart(tm);
+    lua_pushnumber(L, timeout_getstart(tm));
+    return yieldtry(L, op);
+}
+
+/* tries the operation once. the stack holds the arguments followed by
+* the time the method was called, which other methods on the object do
+* not get to change while the task is parked */
+static int yieldtry(lua_State *L, p_yieldop op) {
+    double start = lua_tonumber(L, op->nargs + 1);
+    const char *err;
+    t_yieldwait w;
+    t_timeout tm;
+    double t;
+    int n;
+    lua_settop(L, op->nargs);
+    n = op->run(L, &w);
+    if (n < 2 || !lua_isnil(L, -n)) return n;
+    err = lua_tostring(L, -n+1);
+    if (!err || strcmp(err, "timeout") != 0) return n;
+    tm = *w.tm;
+    tm.start = start;
+    t = timeout_getretry(&tm);
+    if (t == 0.0 || !lua_isyieldable(L)) {
+        if (op->settle) op->settle(L, n);
+        return n;
+    }
+    /* the results stay below the yielded values, in case the wait fails */
+    lua_pushnumber(L, start);
+    lua_insert(L, op->nargs + 1);
+    lua_pushnumber(L, n);
+    lua_insert(L, op->nargs + 2);
+    lua_pushlightuserdata(L, &scheduler_park);
+    lua_pushvalue(L, 1);
+    lua_pushnumber(L, w.fd);
+    lua_pushnumber(L, w.events);
+    lua_pushnumber(L, t);
+    return lua_yieldk(L, 5, (lua_KContext) op, yieldresume);
+}
+
+/* continues an operation once the task is resumed, with 1 if the object
+* is ready. after nil and an error message the results of the last try
+* are returned, with that message */
+static int yieldresume(lua_State *L, int status, lua_KContext ctx) {
+    p_yieldop op = (p_yieldop) ctx;
+    int n = (int) lua_tonumber(L, op->nargs + 2);
+    int results = op->nargs + 3, resumed = results + n;
+    (void) status;
+    if (lua_gettop(L) > resumed && lua_isnil(L, resumed)) {
+        lua_copy(L, resumed + 1, results + 1);
+        lua_settop(L, resumed - 1);
+        if (op->settle) op->settle(L, n);
+        return n;
+    }
+    return yieldtry(L, op);
+}
+#endif
+
+#else
+/*-------------------------------------------------------------------------*\
+* Schedulers are not available on Windows
+\*-------------------------------------------------------------------------*/
+int scheduler_open(lua_State *L) {
+    (void) L;
+    return 0;
+}
+#endif
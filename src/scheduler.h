@@ -0,0 +1,67 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+/*=========================================================================*\
+* Coroutine schedulers
+* LuaSocket toolkit
+*
+* A scheduler runs Lua functions as coroutines, called tasks, that do
+* non-blocking I/O. A task that has to wait for a socket parks itself on
+* the socket's descriptor and yields. The scheduler watches all parked
+* descriptors with a pollset, so a step costs one wait for the whole set,
+* and resumes every task that became ready, or whose timeout expired, in
+* a single batch.
+*
+* Tasks park by yielding a marker followed by the object, its descriptor,
+* the events wanted and a timeout. Anything that runs inside a task and
+* can yield, including C functions, can park this way.
+*
+* Sockets in yield mode use this from C. Their methods try operations
+* without waiting and, when they cannot complete, park the calling task
+* through a continuation, so that the operation goes on from where it
+* stopped when the task is resumed. Continuations need Lua 5.3 or later.
+\*=========================================================================*/
+#include "luasocket.h"
+#include "timeout.h"
+
+#if !defined(_WIN32) && LUA_VERSION_NUM >= 503
+#define SCHEDULER_YIELD
+#endif
+
+#ifdef SCHEDULER_YIELD
+/* what an operation that could not complete would wait for */
+typedef struct t_yieldwait_ {
+    int fd;                 /* descriptor of the object */
+    int events;             /* POLLER_READ or POLLER_WRITE */
+    p_timeout tm;           /* timeouts set on the object */
+} t_yieldwait;
+typedef t_yieldwait *p_yieldwait;
+
+/* an operation a method in yield mode retries. run takes the method's
+* arguments, normalized to nargs values, tries once without waiting and
+* pushes the method's results. when these are nil and "timeout", it
+* fills in w and updates the arguments so that the next try continues
+* from where this one stopped. settle, if not NULL, completes the n
+* results of a try that timed out before they are returned instead of
+* waited on, with the arguments still below them */
+typedef struct t_yieldop_ {
+    int nargs;
+    int (*run)(lua_State *L, p_yieldwait w);
+    void (*settle)(lua_State *L, int n);
+} t_yieldop;
+typedef const t_yieldop *p_yieldop;
+#endif
+
+#ifndef _WIN32
+#pragma GCC visibility push(hidden)
+#endif
+
+int scheduler_open(lua_State *L);
+#ifdef SCHEDULER_YIELD
+int scheduler_yieldcall(lua_State *L, p_yieldop op, p_timeout tm);
+#endif
+
+#ifndef _WIN32
+#pragma GCC visibility pop
+#endif
+
+#endif /* SCHEDULER_H */
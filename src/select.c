@@ -6,21 +6,61 @@
 
 #include "socket.h"
 #include "timeout.h"
+#include "tcp.h"
+#include "udp.h"
 #include "select.h"
 
+#include <limits.h>
 #include <string.h>
 
+#ifndef _WIN32
+#include <poll.h>
+typedef struct pollfd t_pollfd;
+#else
+/* same layout as struct pollfd, waited on with select */
+typedef struct t_pollfd_ {
+    t_socket fd;
+    short events;
+    short revents;
+} t_pollfd;
+#ifndef POLLIN
+#define POLLIN 0x0100
+#define POLLOUT 0x0010
+#define POLLERR 0x0001
+#define POLLHUP 0x0002
+#define POLLNVAL 0x0004
+#endif
+#endif
+
+/* descriptors being waited on, and where each came from */
+typedef struct t_waitset_ {
+    int size;               /* number of entries allocated */
+    t_pollfd *fds;          /* descriptors and events */
+    int *where;             /* index of the object in its table */
+} t_waitset;
+typedef t_waitset *p_waitset;
+
+/* stack positions used during a call */
+#define ARG_RECVT 1
+#define ARG_SENDT 2
+#define ARG_RTAB 4
+#define ARG_WTAB 5
+#define NAME_TCP 6
+#define NAME_UDP 7
+
 /*=========================================================================*\
 * Internal function prototypes.
 \*=========================================================================*/
-static t_socket getfd(lua_State *L);
-static int dirty(lua_State *L);
-static void collect_fd(lua_State *L, int tab, int itab,
-        fd_set *set, t_socket *max_fd);
-static int check_dirty(lua_State *L, int tab, int dtab, fd_set *set);
-static void return_fd(lua_State *L, fd_set *set, t_socket max_fd,
-        int itab, int tab, int start);
-static void make_assoc(lua_State *L, int tab);
+static p_waitset getwaitset(lua_State *L, int n);
+static t_socket getfd(lua_State *L, int *isdirty);
+static void *groupudata(lua_State *L, int name);
+static int collect_fd(lua_State *L, int tab, short events, p_waitset ws,
+        int n, int rtab, int *ndirty);
+static void return_fd(lua_State *L, p_waitset ws, int start, int n,
+        int tab, short revents, int rtab);
+static void result_table(lua_State *L, int arg);
+static void add_result(lua_State *L, int tab);
+static int waitfds(t_pollfd *fds, int n, p_timeout tm);
 static int global_select(lua_State *L);
 
 /* functions in library namespace */
@@ -29,12 +69,20 @@ static luaL_Reg func[] = {
     {NULL,     NULL}
 };
 
+/* the address of this variable is the registry key of the wait set */
+static char waitset_key;
+
 /*-------------------------------------------------------------------------*\
 * Initializes module
 \*-------------------------------------------------------------------------*/
 int select_open(lua_State *L) {
     lua_pushstring(L, "_SETSIZE");
+#ifdef _WIN32
     lua_pushinteger(L, FD_SETSIZE);
+#else
+    /* poll has no limit other than the number of open descriptors */
+    lua_pushinteger(L, INT_MAX);
+#endif
     lua_rawset(L, -3);
     lua_pushstring(L, "_SOCKETINVALID");
     lua_pushinteger(L, SOCKET_INVALID);
@@ -48,32 +96,40 @@ int select_open(lua_State *L) {
 \*=========================================================================*/
 /*-------------------------------------------------------------------------*\
 * Waits for a set of sockets until a condition is met or timeout.
+* Lua Input: recvt, sendt [, timeout [, rtab [, wtab]]]
+*   rtab, wtab: tables to be cleared and filled with the results
 \*-------------------------------------------------------------------------*/
 static int global_select(lua_State *L) {
-    int rtab, wtab, itab, ret, ndirty;
-    t_socket max_fd = SOCKET_INVALID;
-    fd_set rset, wset;
+    int nr, nw, ret, ndirty = 0;
+    p_waitset ws;
     t_timeout tm;
     double t = luaL_optnumber(L, 3, -1);
-    FD_ZERO(&rset); FD_ZERO(&wset);
-    lua_settop(L, 3);
-    lua_newtable(L); itab = lua_gettop(L);
-    lua_newtable(L); rtab = lua_gettop(L);
-    lua_newtable(L); wtab = lua_gettop(L);
-    collect_fd(L, 1, itab, &rset, &max_fd);
-    collect_fd(L, 2, itab, &wset, &max_fd);
-    ndirty = check_dirty(L, 1, rtab, &rset);
-    t = ndirty > 0? 0.0: t;
-    timeout_init(&tm, t, -1);
+    if (!lua_isnil(L, ARG_RECVT)) luaL_checktype(L, ARG_RECVT, LUA_TTABLE);
+    if (!lua_isnil(L, ARG_SENDT)) luaL_checktype(L, ARG_SENDT, LUA_TTABLE);
+    lua_settop(L, 5);
+    result_table(L, ARG_RTAB);
+    result_table(L, ARG_WTAB);
+    lua_pushstring(L, "tcp{any}");
+    lua_pushstring(L, "udp{any}");
+    nr = lua_isnil(L, ARG_RECVT)? 0: (int) lua_rawlen(L, ARG_RECVT);
+    nw = lua_isnil(L, ARG_SENDT)? 0: (int) lua_rawlen(L, ARG_SENDT);
+    ws = getwaitset(L, nr + nw);
+    nr = collect_fd(L, ARG_RECVT, POLLIN, ws, 0, ARG_RTAB, &ndirty);
+    nw = collect_fd(L, ARG_SENDT, POLLOUT, ws, nr, 0, NULL);
+    timeout_init(&tm, ndirty > 0? 0.0: t, -1);
     timeout_markstart(&tm);
-    ret = socket_select(max_fd+1, &rset, &wset, NULL, &tm);
+    ret = waitfds(ws->fds, nr + nw, &tm);
     if (ret > 0 || ndirty > 0) {
-        return_fd(L, &rset, max_fd+1, itab, rtab, ndirty);
-        return_fd(L, &wset, max_fd+1, itab, wtab, 0);
-        make_assoc(L, rtab);
-        make_assoc(L, wtab);
+        return_fd(L, ws, 0, nr, ARG_RECVT, POLLIN|POLLHUP|POLLERR|POLLNVAL,
+            ARG_RTAB);
+        return_fd(L, ws, nr, nw, ARG_SENDT, POLLOUT|POLLHUP|POLLERR|POLLNVAL,
+            ARG_WTAB);
+        lua_pushvalue(L, ARG_RTAB);
+        lua_pushvalue(L, ARG_WTAB);
         return 2;
     } else if (ret == 0) {
+        lua_pushvalue(L, ARG_RTAB);
+        lua_pushvalue(L, ARG_WTAB);
         lua_pushstring(L, "timeout");
         return 3;
     } else {
@@ -85,8 +141,63 @@ static int global_select(lua_State *L) {
 /*=========================================================================*\
 * Internal functions
 \*=========================================================================*/
-static t_socket getfd(lua_State *L) {
+/*-------------------------------------------------------------------------*\
+* Pushes a wait set with room for n descriptors. It is kept in the
+* registry and only grows, so that select does not allocate on each call.
+* The copy on the stack keeps it alive even if a getfd method calls select.
+\*-------------------------------------------------------------------------*/
+static p_waitset getwaitset(lua_State *L, int n) {
+    p_waitset ws;
+    lua_pushlightuserdata(L, &waitset_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    ws = (p_waitset) lua_touserdata(L, -1);
+    if (!ws || ws->size < n) {
+        int size = ws && ws->size*2 > n? ws->size*2: n;
+        size_t fdsize = size * sizeof(t_pollfd);
+        ws = (p_waitset) lua_newuserdata(L, sizeof(t_waitset) + fdsize +
+            size * sizeof(int));
+        ws->size = size;
+        ws->fds = (t_pollfd *) (ws + 1);
+        ws->where = (int *) ((char *) ws->fds + fdsize);
+        lua_replace(L, -2);
+        lua_pushlightuserdata(L, &waitset_key);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    return ws;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the userdata of the object on top of the stack if it belongs to
+* the group whose name is at the given stack position, NULL otherwise
+\*-------------------------------------------------------------------------*/
+static void *groupudata(lua_State *L, int name) {
+    void *udata = NULL;
+    if (lua_getmetatable(L, -1)) {
+        lua_pushvalue(L, name);
+        lua_rawget(L, -2);
+        if (!lua_isnil(L, -1)) udata = lua_touserdata(L, -3);
+        lua_pop(L, 2);
+    }
+    return udata;
+}
+
+/*-------------------------------------------------------------------------*\
+* Gets the descriptor of the object on top of the stack, and whether it
+* has buffered data if isdirty is not NULL. Our own objects are looked at
+* directly. Others have to export getfd() and, optionally, dirty().
+\*-------------------------------------------------------------------------*/
+static t_socket getfd(lua_State *L, int *isdirty) {
     t_socket fd = SOCKET_INVALID;
+    p_tcp tcp;
+    p_udp udp;
+    if (isdirty) *isdirty = 0;
+    if ((tcp = (p_tcp) groupudata(L, NAME_TCP)) != NULL) {
+        if (isdirty) *isdirty = !buffer_isempty(&tcp->buf);
+        return tcp->sock;
+    }
+    if ((udp = (p_udp) groupudata(L, NAME_UDP)) != NULL)
+        return udp->sock;
     lua_pushstring(L, "getfd");
     lua_gettable(L, -2);
     if (!lua_isnil(L, -1)) {
@@ -98,117 +209,133 @@ static t_socket getfd(lua_State *L) {
         }
     }
     lua_pop(L, 1);
-    return fd;
-}
-
-static int dirty(lua_State *L) {
-    int is = 0;
-    lua_pushstring(L, "dirty");
-    lua_gettable(L, -2);
-    if (!lua_isnil(L, -1)) {
-        lua_pushvalue(L, -2);
-        lua_call(L, 1, 1);
-        is = lua_toboolean(L, -1);
+    if (isdirty && fd != SOCKET_INVALID) {
+        lua_pushstring(L, "dirty");
+        lua_gettable(L, -2);
+        if (!lua_isnil(L, -1)) {
+            lua_pushvalue(L, -2);
+            lua_call(L, 1, 1);
+            *isdirty = lua_toboolean(L, -1);
+        }
+        lua_pop(L, 1);
     }
-    lua_pop(L, 1);
-    return is;
+    return fd;
 }
 
-static void collect_fd(lua_State *L, int tab, int itab,
-        fd_set *set, t_socket *max_fd) {
-    int i = 1, n = 0;
+/*-------------------------------------------------------------------------*\
+* Adds the objects in an array to the wait set, starting at entry n.
+* Objects with buffered data go straight to the results in rtab instead.
+* Returns the number of entries added.
+\*-------------------------------------------------------------------------*/
+static int collect_fd(lua_State *L, int tab, short events, p_waitset ws,
+        int n, int rtab, int *ndirty) {
+    int i, count = 0;
     /* nil is the same as an empty table */
-    if (lua_isnil(L, tab)) return;
-    /* otherwise we need it to be a table */
-    luaL_checktype(L, tab, LUA_TTABLE);
-    for ( ;; ) {
+    if (lua_isnil(L, tab)) return 0;
+    for (i = 1; ; i++) {
         t_socket fd;
-        lua_pushnumber(L, i);
-        lua_gettable(L, tab);
+        int isdirty = 0;
+        lua_rawgeti(L, tab, i);
         if (lua_isnil(L, -1)) {
             lua_pop(L, 1);
             break;
         }
-        /* getfd figures out if this is a socket */
-        fd = getfd(L);
+        fd = getfd(L, ndirty? &isdirty: NULL);
+        if (fd != SOCKET_INVALID && isdirty) {
+            add_result(L, rtab);
+            (*ndirty)++;
+            continue;
+        }
         if (fd != SOCKET_INVALID) {
-            /* make sure we don't overflow the fd_set */
 #ifdef _WIN32
-            if (n >= FD_SETSIZE)
+            /* make sure we don't overflow the fd_set */
+            if (count >= FD_SETSIZE)
                 luaL_argerror(L, tab, "too many sockets");
-#else
-            if (fd >= FD_SETSIZE)
-                luaL_argerror(L, tab, "descriptor too large for set size");
 #endif
-            FD_SET(fd, set);
-            n++;
-            /* keep track of the largest descriptor so far */
-            if (*max_fd == SOCKET_INVALID || *max_fd < fd)
-                *max_fd = fd;
-            /* make sure we can map back from descriptor to the object */
-            lua_pushnumber(L, (lua_Number) fd);
-            lua_pushvalue(L, -2);
-            lua_settable(L, itab);
+            ws->fds[n+count].fd = fd;
+            ws->fds[n+count].events = events;
+            ws->fds[n+count].revents = 0;
+            ws->where[n+count] = i;
+            count++;
         }
         lua_pop(L, 1);
-        i = i + 1;
     }
+    return count;
 }
 
-static int check_dirty(lua_State *L, int tab, int dtab, fd_set *set) {
-    int ndirty = 0, i = 1;
-    if (lua_isnil(L, tab))
-        return 0;
-    for ( ;; ) {
-        t_socket fd;
-        lua_pushnumber(L, i);
-        lua_gettable(L, tab);
-        if (lua_isnil(L, -1)) {
-            lua_pop(L, 1);
-            break;
-        }
-        fd = getfd(L);
-        if (fd != SOCKET_INVALID && dirty(L)) {
-            lua_pushnumber(L, ++ndirty);
-            lua_pushvalue(L, -2);
-            lua_settable(L, dtab);
-            FD_CLR(fd, set);
+/*-------------------------------------------------------------------------*\
+* Adds the objects whose entries got any of the given events to tab
+\*-------------------------------------------------------------------------*/
+static void return_fd(lua_State *L, p_waitset ws, int start, int n,
+        int tab, short revents, int rtab) {
+    int i;
+    for (i = start; i < start + n; i++) {
+        if (ws->fds[i].revents & revents) {
+            lua_rawgeti(L, tab, ws->where[i]);
+            add_result(L, rtab);
         }
-        lua_pop(L, 1);
-        i = i + 1;
     }
-    return ndirty;
 }
 
-static void return_fd(lua_State *L, fd_set *set, t_socket max_fd,
-        int itab, int tab, int start) {
-    t_socket fd;
-    for (fd = 0; fd < max_fd; fd++) {
-        if (FD_ISSET(fd, set)) {
-            lua_pushnumber(L, ++start);
-            lua_pushnumber(L, (lua_Number) fd);
-            lua_gettable(L, itab);
-            lua_settable(L, tab);
-        }
+/*-------------------------------------------------------------------------*\
+* Replaces the argument with a new table, or clears the one supplied
+\*-------------------------------------------------------------------------*/
+static void result_table(lua_State *L, int arg) {
+    if (lua_isnil(L, arg)) {
+        lua_newtable(L);
+        lua_replace(L, arg);
+        return;
+    }
+    luaL_checktype(L, arg, LUA_TTABLE);
+    lua_pushnil(L);
+    while (lua_next(L, arg)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, arg);
     }
 }
 
-static void make_assoc(lua_State *L, int tab) {
-    int i = 1, atab;
-    lua_newtable(L); atab = lua_gettop(L);
-    for ( ;; ) {
-        lua_pushnumber(L, i);
-        lua_gettable(L, tab);
-        if (!lua_isnil(L, -1)) {
-            lua_pushnumber(L, i);
-            lua_pushvalue(L, -2);
-            lua_settable(L, atab);
-            lua_pushnumber(L, i);
-            lua_settable(L, atab);
-        } else {
-            lua_pop(L, 1);
-            break;
-        }
-        i = i+1;
+/*-------------------------------------------------------------------------*\
+* Pops the object on top of the stack into a result table, keyed both by
+* its position and by itself
+\*-------------------------------------------------------------------------*/
+static void add_result(lua_State *L, int tab) {
+    int n = (int) lua_rawlen(L, tab) + 1;
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, tab, n);
+    lua_pushinteger(L, n);
+    lua_rawset(L, tab);
+}
+
+#ifndef _WIN32
+static int waitfds(t_pollfd *fds, int n, p_timeout tm) {
+    int ret;
+    do {
+        double t = timeout_getretry(tm);
+        /* round up, or a timeout under a millisecond would not wait */
+        int ms = t < 0.0? -1: (t > INT_MAX/1000? INT_MAX:
+            (int) (t*1000.0 + 0.999));
+        ret = poll(fds, (nfds_t) n, ms);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+#else
+static int waitfds(t_pollfd *fds, int n, p_timeout tm) {
+    int i, ret;
+    fd_set rset, wset;
+    t_socket max_fd = SOCKET_INVALID;
+    FD_ZERO(&rset); FD_ZERO(&wset);
+    for (i = 0; i < n; i++) {
+        FD_SET(fds[i].fd, fds[i].events & POLLIN? &rset: &wset);
+        if (max_fd == SOCKET_INVALID || max_fd < fds[i].fd)
+            max_fd = fds[i].fd;
     }
+    ret = socket_select(max_fd+1, &rset, &wset, NULL, tm);
+    for (i = 0; ret > 0 && i < n; i++) {
+        fd_set *set = fds[i].events & POLLIN? &rset: &wset;
+        fds[i].revents = FD_ISSET(fds[i].fd, set)? fds[i].events: 0;
+    }
+    return ret;
 }
+#endif
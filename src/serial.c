@@ -28,27 +28,54 @@ have only one object type.
 \*=========================================================================*/
 static int global_create(lua_State *L);
 static int meth_send(lua_State *L);
+static int meth_sendv(lua_State *L);
+static int meth_sendfrom(lua_State *L);
+static int meth_sendframe(lua_State *L);
+static int meth_flush(lua_State *L);
 static int meth_receive(lua_State *L);
+static int meth_peek(lua_State *L);
+static int meth_receivelines(lua_State *L);
+static int meth_receiveframe(lua_State *L);
+static int meth_receiveframes(lua_State *L);
+static int meth_receiveinto(lua_State *L);
 static int meth_close(lua_State *L);
+static int meth_gc(lua_State *L);
 static int meth_settimeout(lua_State *L);
 static int meth_getfd(lua_State *L);
 static int meth_setfd(lua_State *L);
 static int meth_dirty(lua_State *L);
 static int meth_getstats(lua_State *L);
 static int meth_setstats(lua_State *L);
+static int meth_getbuffersize(lua_State *L);
+static int meth_setbuffersize(lua_State *L);
+static int meth_getoutputbuffer(lua_State *L);
+static int meth_setoutputbuffer(lua_State *L);
 
 /* serial object methods */
 static luaL_Reg serial_methods[] = {
-    {"__gc",        meth_close},
+    {"__gc",        meth_gc},
     {"__tostring",  auxiliar_tostring},
     {"close",       meth_close},
     {"dirty",       meth_dirty},
+    {"flush",       meth_flush},
+    {"getbuffersize", meth_getbuffersize},
     {"getfd",       meth_getfd},
+    {"getoutputbuffer", meth_getoutputbuffer},
     {"getstats",    meth_getstats},
     {"setstats",    meth_setstats},
+    {"peek",        meth_peek},
     {"receive",     meth_receive},
+    {"receiveframe", meth_receiveframe},
+    {"receiveframes", meth_receiveframes},
+    {"receiveinto", meth_receiveinto},
+    {"receivelines", meth_receivelines},
     {"send",        meth_send},
+    {"sendframe",   meth_sendframe},
+    {"sendfrom",    meth_sendfrom},
+    {"sendv",       meth_sendv},
+    {"setbuffersize", meth_setbuffersize},
     {"setfd",       meth_setfd},
+    {"setoutputbuffer", meth_setoutputbuffer},
     {"settimeout",  meth_settimeout},
     {NULL,          NULL}
 };
@@ -76,11 +103,56 @@ static int meth_send(lua_State *L) {
     return buffer_meth_send(L, &un->buf);
 }
 
+static int meth_sendv(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "serial{client}", 1);
+    return buffer_meth_sendv(L, &un->buf);
+}
+
+static int meth_sendframe(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "serial{client}", 1);
+    return buffer_meth_sendframe(L, &un->buf);
+}
+
+static int meth_sendfrom(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "serial{client}", 1);
+    return buffer_meth_sendfrom(L, &un->buf);
+}
+
+static int meth_flush(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "serial{client}", 1);
+    return buffer_meth_flush(L, &un->buf);
+}
+
 static int meth_receive(lua_State *L) {
     p_unix un = (p_unix) auxiliar_checkclass(L, "serial{client}", 1);
     return buffer_meth_receive(L, &un->buf);
 }
 
+static int meth_peek(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "serial{client}", 1);
+    return buffer_meth_peek(L, &un->buf);
+}
+
+static int meth_receiveframe(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "serial{client}", 1);
+    return buffer_meth_receiveframe(L, &un->buf);
+}
+
+static int meth_receiveframes(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "serial{client}", 1);
+    return buffer_meth_receiveframes(L, &un->buf);
+}
+
+static int meth_receivelines(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "serial{client}", 1);
+    return buffer_meth_receivelines(L, &un->buf);
+}
+
+static int meth_receiveinto(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "serial{client}", 1);
+    return buffer_meth_receiveinto(L, &un->buf);
+}
+
 static int meth_getstats(lua_State *L) {
     p_unix un = (p_unix) auxiliar_checkclass(L, "serial{client}", 1);
     return buffer_meth_getstats(L, &un->buf);
@@ -91,6 +163,26 @@ static int meth_setstats(lua_State *L) {
     return buffer_meth_setstats(L, &un->buf);
 }
 
+static int meth_getbuffersize(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "serial{any}", 1);
+    return buffer_meth_getbuffersize(L, &un->buf);
+}
+
+static int meth_setbuffersize(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "serial{any}", 1);
+    return buffer_meth_setbuffersize(L, &un->buf);
+}
+
+static int meth_getoutputbuffer(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "serial{any}", 1);
+    return buffer_meth_getoutputbuffer(L, &un->buf);
+}
+
+static int meth_setoutputbuffer(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "serial{any}", 1);
+    return buffer_meth_setoutputbuffer(L, &un->buf);
+}
+
 /*-------------------------------------------------------------------------*\
 * Select support methods
 \*-------------------------------------------------------------------------*/
@@ -114,16 +206,32 @@ static int meth_dirty(lua_State *L) {
 }
 
 /*-------------------------------------------------------------------------*\
-* Closes socket used by object
+* Closes socket used by object, after sending pending output as far as the
+* timeout allows
 \*-------------------------------------------------------------------------*/
 static int meth_close(lua_State *L)
 {
     p_unix un = (p_unix) auxiliar_checkgroup(L, "serial{any}", 1);
-    socket_destroy(&un->sock);
+    if (un->buf.outlen > 0) {
+        timeout_markstart(un->buf.tm);
+        buffer_flush(&un->buf);
+    }
+    meth_gc(L);
     lua_pushnumber(L, 1);
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Closes socket used by a collected object. Pending output is discarded
+\*-------------------------------------------------------------------------*/
+static int meth_gc(lua_State *L)
+{
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "serial{any}", 1);
+    socket_destroy(&un->sock);
+    buffer_destroy(&un->buf);
+    return 0;
+}
+
 
 /*-------------------------------------------------------------------------*\
 * Just call tm methods
@@ -163,9 +271,9 @@ static int global_create(lua_State *L) {
     /* initialize remaining structure fields */
     socket_setnonblocking(&sock);
     un->sock = sock;
-    io_init(&un->io, (p_send) socket_write, (p_recv) socket_read,
-            (p_error) socket_ioerror, &un->sock);
+    io_init(&un->io, (p_send) socket_write, (p_sendv) socket_writev,
+            (p_recv) socket_read, (p_error) socket_ioerror, &un->sock);
     timeout_init(&un->tm, -1, -1);
-    buffer_init(&un->buf, &un->io, &un->tm);
+    buffer_init(L, &un->buf, &un->io, &un->tm);
     return 1;
 }
@@ -33,6 +33,9 @@
 /* convenient shorthand */
 typedef struct sockaddr SA;
 
+/* most connection attempts socket_waitconnect can wait on at once */
+#define SOCKET_MAXCONNECTS 8
+
 /*=========================================================================*\
 * Functions bellow implement a comfortable platform independent 
 * interface to sockets
@@ -52,15 +55,21 @@ int socket_bind(p_socket ps, SA *addr, socklen_t addr_len);
 int socket_listen(p_socket ps, int backlog);
 void socket_shutdown(p_socket ps, int how); 
 int socket_connect(p_socket ps, SA *addr, socklen_t addr_len, p_timeout tm); 
+int socket_waitconnect(p_socket ps, int n, p_timeout tm, int *which);
 int socket_accept(p_socket ps, p_socket pa, SA *addr, socklen_t *addr_len, p_timeout tm);
 int socket_send(p_socket ps, const char *data, size_t count, size_t *sent, p_timeout tm);
+int socket_sendv(p_socket ps, const t_iovec *iov, int iovcnt, size_t *sent, p_timeout tm);
 int socket_sendto(p_socket ps, const char *data, size_t count, size_t *sent, SA *addr, socklen_t addr_len, p_timeout tm);
 int socket_recv(p_socket ps, char *data, size_t count, size_t *got, p_timeout tm);
 int socket_recvfrom(p_socket ps, char *data, size_t count, size_t *got, SA *addr, socklen_t *addr_len, p_timeout tm);
 int socket_write(p_socket ps, const char *data, size_t count, size_t *sent, p_timeout tm);
+int socket_writev(p_socket ps, const t_iovec *iov, int iovcnt, size_t *sent, p_timeout tm);
 int socket_read(p_socket ps, char *data, size_t count, size_t *got, p_timeout tm);
 void socket_setblocking(p_socket ps);
 void socket_setnonblocking(p_socket ps);
+#ifdef LUASOCKET_DEBUG
+unsigned long socket_setupcalls(unsigned long *switches);
+#endif
 int socket_gethostbyaddr(const char *addr, socklen_t len, struct hostent **hp);
 int socket_gethostbyname(const char *addr, struct hostent **hp);
 const char *socket_hoststrerror(int err);
@@ -16,12 +16,12 @@ local _M = socket
 -----------------------------------------------------------------------------
 -- Exported auxiliar functions
 -----------------------------------------------------------------------------
-function _M.connect4(address, port, laddress, lport)
-    return socket.connect(address, port, laddress, lport, "inet")
+function _M.connect4(address, port, laddress, lport, delay)
+    return socket.connect(address, port, laddress, lport, "inet", delay)
 end
 
-function _M.connect6(address, port, laddress, lport)
-    return socket.connect(address, port, laddress, lport, "inet6")
+function _M.connect6(address, port, laddress, lport, delay)
+    return socket.connect(address, port, laddress, lport, "inet6", delay)
 end
 
 function _M.bind(host, port, backlog)
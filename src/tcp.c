@@ -9,9 +9,22 @@
 #include "inet.h"
 #include "options.h"
 #include "tcp.h"
+#include "scheduler.h"
+#include "poller.h"
 
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef SCHEDULER_YIELD
+#include <errno.h>
+#endif
+
+/* clients acceptmany takes from the backlog, unless told otherwise */
+#define TCP_ACCEPTMANY 64
+/* head start of each connection attempt over the next, as in RFC 8305 */
+#define TCP_CONNECTDELAY 0.25
+
 /*=========================================================================*\
 * Internal function prototypes
 \*=========================================================================*/
@@ -19,52 +32,117 @@ static int global_create(lua_State *L);
 static int global_create4(lua_State *L);
 static int global_create6(lua_State *L);
 static int global_connect(lua_State *L);
+#ifndef _WIN32
+static int global_connectmany(lua_State *L);
+#endif
 static int meth_connect(lua_State *L);
+static int connectpeer(lua_State *L, p_tcp tcp);
 static int meth_listen(lua_State *L);
 static int meth_getfamily(lua_State *L);
 static int meth_bind(lua_State *L);
 static int meth_send(lua_State *L);
+static int meth_sendv(lua_State *L);
+static int meth_sendfrom(lua_State *L);
+static int meth_sendframe(lua_State *L);
+static int meth_flush(lua_State *L);
 static int meth_getstats(lua_State *L);
 static int meth_setstats(lua_State *L);
+static int meth_getbuffersize(lua_State *L);
+static int meth_setbuffersize(lua_State *L);
+static int meth_getoutputbuffer(lua_State *L);
+static int meth_setoutputbuffer(lua_State *L);
 static int meth_getsockname(lua_State *L);
 static int meth_getpeername(lua_State *L);
 static int meth_shutdown(lua_State *L);
 static int meth_receive(lua_State *L);
+static int meth_peek(lua_State *L);
+static int meth_receivelines(lua_State *L);
+static int meth_receiveframe(lua_State *L);
+static int meth_receiveframes(lua_State *L);
+static int meth_receiveinto(lua_State *L);
 static int meth_accept(lua_State *L);
+static int acceptclient(lua_State *L, p_tcp server);
+static int meth_acceptmany(lua_State *L);
+static int acceptclients(lua_State *L, p_tcp server);
 static int meth_close(lua_State *L);
+static int meth_gc(lua_State *L);
 static int meth_getoption(lua_State *L);
 static int meth_setoption(lua_State *L);
 static int meth_gettimeout(lua_State *L);
 static int meth_settimeout(lua_State *L);
+static int meth_setdeadline(lua_State *L);
 static int meth_getfd(lua_State *L);
 static int meth_setfd(lua_State *L);
 static int meth_dirty(lua_State *L);
+static int meth_getyield(lua_State *L);
+static int meth_setyield(lua_State *L);
+static int meth_getdriver(lua_State *L);
+static int meth_setdriver(lua_State *L);
+#ifdef SCHEDULER_YIELD
+static p_tcp yieldwait(lua_State *L, p_yieldwait w, int events);
+static int yield_send(lua_State *L, p_yieldwait w);
+static int yield_flush(lua_State *L, p_yieldwait w);
+static int yield_receive(lua_State *L, p_yieldwait w);
+static void settle_receive(lua_State *L, int n);
+static void holdpartial(lua_State *L, int idx);
+static void joinpartial(lua_State *L, int idx);
+static int yield_accept(lua_State *L, p_yieldwait w);
+static int yield_acceptmany(lua_State *L, p_yieldwait w);
+static int yield_connect(lua_State *L, p_yieldwait w);
+
+/* operations that can park the calling task in yield mode */
+static const t_yieldop sendop = {4, yield_send, NULL};
+static const t_yieldop flushop = {1, yield_flush, NULL};
+static const t_yieldop receiveop = {6, yield_receive, settle_receive};
+static const t_yieldop acceptop = {1, yield_accept, NULL};
+static const t_yieldop acceptmanyop = {3, yield_acceptmany, NULL};
+static const t_yieldop connectop = {3, yield_connect, NULL};
+#endif
 
 /* tcp object methods */
 static luaL_Reg tcp_methods[] = {
-    {"__gc",        meth_close},
+    {"__gc",        meth_gc},
     {"__tostring",  auxiliar_tostring},
     {"accept",      meth_accept},
+    {"acceptmany",  meth_acceptmany},
     {"bind",        meth_bind},
     {"close",       meth_close},
     {"connect",     meth_connect},
     {"dirty",       meth_dirty},
+    {"flush",       meth_flush},
+    {"getbuffersize", meth_getbuffersize},
+    {"getdriver",   meth_getdriver},
     {"getfamily",   meth_getfamily},
     {"getfd",       meth_getfd},
     {"getoption",   meth_getoption},
+    {"getoutputbuffer", meth_getoutputbuffer},
     {"getpeername", meth_getpeername},
     {"getsockname", meth_getsockname},
     {"getstats",    meth_getstats},
+    {"getyield",    meth_getyield},
     {"setstats",    meth_setstats},
+    {"setyield",    meth_setyield},
     {"listen",      meth_listen},
+    {"peek",        meth_peek},
     {"receive",     meth_receive},
+    {"receiveframe", meth_receiveframe},
+    {"receiveframes", meth_receiveframes},
+    {"receiveinto", meth_receiveinto},
+    {"receivelines", meth_receivelines},
     {"send",        meth_send},
+    {"sendframe",   meth_sendframe},
+    {"sendfrom",    meth_sendfrom},
+    {"sendv",       meth_sendv},
+    {"setbuffersize", meth_setbuffersize},
+    {"setdriver",   meth_setdriver},
     {"setfd",       meth_setfd},
     {"setoption",   meth_setoption},
+    {"setoutputbuffer", meth_setoutputbuffer},
     {"setpeername", meth_connect},
     {"setsockname", meth_bind},
     {"settimeout",  meth_settimeout},
     {"gettimeout",  meth_gettimeout},
+    {"setdeadline", meth_setdeadline},
     {"shutdown",    meth_shutdown},
     {NULL,          NULL}
 };
@@ -129,6 +207,9 @@ static luaL_Reg func[] = {
     {"tcp4", global_create4},
     {"tcp6", global_create6},
     {"connect", global_connect},
+#ifndef _WIN32
+    {"connectmany", global_connectmany},
+#endif
     {NULL, NULL}
 };
 
@@ -158,14 +239,72 @@ int tcp_open(lua_State *L)
 \*-------------------------------------------------------------------------*/
 static int meth_send(lua_State *L) {
     p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+#ifdef SCHEDULER_YIELD
+    if (tcp->yield) return scheduler_yieldcall(L, &sendop, &tcp->tm);
+#endif
     return buffer_meth_send(L, &tcp->buf);
 }
 
+static int meth_sendv(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+    return buffer_meth_sendv(L, &tcp->buf);
+}
+
+static int meth_sendframe(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+    return buffer_meth_sendframe(L, &tcp->buf);
+}
+
+static int meth_sendfrom(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+    return buffer_meth_sendfrom(L, &tcp->buf);
+}
+
+static int meth_flush(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+#ifdef SCHEDULER_YIELD
+    if (tcp->yield) return scheduler_yieldcall(L, &flushop, &tcp->tm);
+#endif
+    return buffer_meth_flush(L, &tcp->buf);
+}
+
 static int meth_receive(lua_State *L) {
     p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+#ifdef SCHEDULER_YIELD
+    if (tcp->yield) {
+        /* the continuation keeps its state above the arguments */
+        lua_settop(L, 3);
+        return scheduler_yieldcall(L, &receiveop, &tcp->tm);
+    }
+#endif
     return buffer_meth_receive(L, &tcp->buf);
 }
 
+static int meth_peek(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+    return buffer_meth_peek(L, &tcp->buf);
+}
+
+static int meth_receiveframe(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+    return buffer_meth_receiveframe(L, &tcp->buf);
+}
+
+static int meth_receiveframes(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+    return buffer_meth_receiveframes(L, &tcp->buf);
+}
+
+static int meth_receivelines(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+    return buffer_meth_receivelines(L, &tcp->buf);
+}
+
+static int meth_receiveinto(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
+    return buffer_meth_receiveinto(L, &tcp->buf);
+}
+
 static int meth_getstats(lua_State *L) {
     p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
     return buffer_meth_getstats(L, &tcp->buf);
@@ -176,6 +315,26 @@ static int meth_setstats(lua_State *L) {
     return buffer_meth_setstats(L, &tcp->buf);
 }
 
+static int meth_getbuffersize(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+    return buffer_meth_getbuffersize(L, &tcp->buf);
+}
+
+static int meth_setbuffersize(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+    return buffer_meth_setbuffersize(L, &tcp->buf);
+}
+
+static int meth_getoutputbuffer(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+    return buffer_meth_getoutputbuffer(L, &tcp->buf);
+}
+
+static int meth_setoutputbuffer(lua_State *L) {
+    p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+    return buffer_meth_setoutputbuffer(L, &tcp->buf);
+}
+
 /*-------------------------------------------------------------------------*\
 * Just call option handler
 \*-------------------------------------------------------------------------*/
@@ -223,22 +382,21 @@ static int meth_dirty(lua_State *L)
 static int meth_accept(lua_State *L)
 {
     p_tcp server = (p_tcp) auxiliar_checkclass(L, "tcp{server}", 1);
-    p_timeout tm = timeout_markstart(&server->tm);
+#ifdef SCHEDULER_YIELD
+    if (server->yield) return scheduler_yieldcall(L, &acceptop, &server->tm);
+#endif
+    return acceptclient(L, server);
+}
+
+/* accepts a client, waiting as long as the I/O timeout of the server */
+static int acceptclient(lua_State *L, p_tcp server)
+{
+    p_timeout tm = timeout_markstart(server->buf.tm);
     t_socket sock;
     const char *err = inet_tryaccept(&server->sock, server->family, &sock, tm);
     /* if successful, push client socket */
     if (err == NULL) {
-        p_tcp clnt = (p_tcp) lua_newuserdata(L, sizeof(t_tcp));
-        auxiliar_setclass(L, "tcp{client}", -1);
-        /* initialize structure fields */
-        memset(clnt, 0, sizeof(t_tcp));
-        socket_setnonblocking(&sock);
-        clnt->sock = sock;
-        io_init(&clnt->io, (p_send) socket_send, (p_recv) socket_recv,
-                (p_error) socket_ioerror, &clnt->sock);
-        timeout_init(&clnt->tm, -1, -1);
-        buffer_init(&clnt->buf, &clnt->io, &clnt->tm);
-        clnt->family = server->family;
+        tcp_pushclient(L, server, sock);
         return 1;
     } else {
         lua_pushnil(L);
@@ -247,6 +405,101 @@ static int meth_accept(lua_State *L)
     }
 }
 
+/*-------------------------------------------------------------------------*\
+* Accepts all the clients waiting in the backlog, up to a maximum, waiting
+* for the first one as long as the I/O timeout of the server allows
+* Lua Input: server [, max, addresses]
+*   max: largest number of clients accepted, 64 by default
+*   addresses: whether to also return the peer address of each client
+* Lua Returns
+*   an array of client objects and, if requested, arrays with the numeric
+*   host and port of each client, or nil and an error if none was accepted
+\*-------------------------------------------------------------------------*/
+static int meth_acceptmany(lua_State *L)
+{
+    p_tcp server = (p_tcp) auxiliar_checkclass(L, "tcp{server}", 1);
+    lua_Number max = luaL_optnumber(L, 2, TCP_ACCEPTMANY);
+    luaL_argcheck(L, max >= 1 && max <= INT_MAX, 2,
+        "invalid maximum number of clients");
+#ifdef SCHEDULER_YIELD
+    if (server->yield)
+        return scheduler_yieldcall(L, &acceptmanyop, &server->tm);
+#endif
+    return acceptclients(L, server);
+}
+
+/* the peer address comes from accept itself, so no getpeername is needed.
+* once a client was accepted, the backlog is drained without waiting */
+static int acceptclients(lua_State *L, p_tcp server)
+{
+    p_timeout tm = timeout_markstart(server->buf.tm);
+    int max = (int) luaL_optnumber(L, 2, TCP_ACCEPTMANY);
+    int addresses = lua_toboolean(L, 3);
+    int n = 0, err = IO_DONE;
+    t_timeout ztm;
+    timeout_init(&ztm, 0, -1);
+    lua_settop(L, 3);
+    lua_newtable(L);
+    if (addresses) {
+        lua_newtable(L);
+        lua_newtable(L);
+    }
+    while (n < max) {
+        t_sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        t_socket sock;
+        err = socket_accept(&server->sock, &sock, (SA *) &addr, &len,
+            n > 0? &ztm: tm);
+        if (err != IO_DONE) break;
+        tcp_pushclient(L, server, sock);
+        lua_rawseti(L, 4, ++n);
+        if (addresses) {
+            if (inet_pushaddress(L, (SA *) &addr, len) != NULL) {
+                lua_pushboolean(L, 0);
+                lua_pushboolean(L, 0);
+            }
+            lua_rawseti(L, 6, n);
+            lua_rawseti(L, 5, n);
+        }
+    }
+    if (n == 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, socket_strerror(err));
+        return 2;
+    }
+    return addresses? 3: 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Pushes a client object for a socket accepted by the server object.
+* Clients inherit the settings of the server.
+\*-------------------------------------------------------------------------*/
+void tcp_pushclient(lua_State *L, p_tcp server, t_socket sock)
+{
+    p_tcp clnt = (p_tcp) lua_newuserdata(L, sizeof(t_tcp));
+    auxiliar_setclass(L, "tcp{client}", -1);
+    /* initialize structure fields */
+    memset(clnt, 0, sizeof(t_tcp));
+    clnt->sock = sock;
+    io_init(&clnt->io, (p_send) socket_send, (p_sendv) socket_sendv,
+            (p_recv) socket_recv, (p_error) socket_ioerror, &clnt->sock);
+#ifdef RING_URING
+    /* the ring of the Lua state exists, since the server uses it */
+    if (server->io.ctx == &server->rio)
+        ring_setdriver(L, &clnt->io, &clnt->rio, &clnt->sock);
+#endif
+    timeout_init(&clnt->tm, -1, -1);
+    timeout_init(&clnt->ztm, 0, -1);
+    buffer_init(L, &clnt->buf, &clnt->io, &clnt->tm);
+    /* clients inherit yield mode and the buffer settings of the server */
+    clnt->yield = server->yield;
+    if (clnt->yield) clnt->buf.tm = &clnt->ztm;
+    clnt->buf.want = server->buf.want;
+    clnt->buf.adaptive = server->buf.adaptive;
+    clnt->buf.outmax = server->buf.outmax;
+    clnt->family = server->family;
+}
+
 /*-------------------------------------------------------------------------*\
 * Binds an object to an address
 \*-------------------------------------------------------------------------*/
@@ -275,17 +528,31 @@ static int meth_bind(lua_State *L) {
 \*-------------------------------------------------------------------------*/
 static int meth_connect(lua_State *L) {
     p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+#ifdef SCHEDULER_YIELD
+    if (tcp->yield) {
+        luaL_checkstring(L, 2);
+        luaL_checkstring(L, 3);
+        return scheduler_yieldcall(L, &connectop, &tcp->tm);
+    }
+#endif
+    return connectpeer(L, tcp);
+}
+
+/* connects, waiting as long as the I/O timeout of the object */
+static int connectpeer(lua_State *L, p_tcp tcp) {
     const char *address =  luaL_checkstring(L, 2);
     const char *port = luaL_checkstring(L, 3);
+    /* connect(server:getsockname()) passes the family in its place */
+    double delay = lua_isnumber(L, 4)? lua_tonumber(L, 4): TCP_CONNECTDELAY;
     struct addrinfo connecthints;
     const char *err;
     memset(&connecthints, 0, sizeof(connecthints));
     connecthints.ai_socktype = SOCK_STREAM;
     /* make sure we try to connect only to the same family */
     connecthints.ai_family = tcp->family;
-    timeout_markstart(&tcp->tm);
+    timeout_markstart(tcp->buf.tm);
     err = inet_tryconnect(&tcp->sock, &tcp->family, address, port,
-        &tcp->tm, &connecthints);
+        tcp->buf.tm, &connecthints, delay);
     /* have to set the class even if it failed due to non-blocking connects */
     auxiliar_setclass(L, "tcp{client}", 1);
     if (err) {
@@ -298,16 +565,32 @@ static int meth_connect(lua_State *L) {
 }
 
 /*-------------------------------------------------------------------------*\
-* Closes socket used by object
+* Closes socket used by object, after sending pending output as far as the
+* timeout allows
 \*-------------------------------------------------------------------------*/
 static int meth_close(lua_State *L)
 {
     p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
-    socket_destroy(&tcp->sock);
+    if (tcp->buf.outlen > 0) {
+        timeout_markstart(tcp->buf.tm);
+        buffer_flush(&tcp->buf);
+    }
+    meth_gc(L);
     lua_pushnumber(L, 1);
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Closes socket used by a collected object. Pending output is discarded
+\*-------------------------------------------------------------------------*/
+static int meth_gc(lua_State *L)
+{
+    p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+    socket_destroy(&tcp->sock);
+    buffer_destroy(&tcp->buf);
+    return 0;
+}
+
 /*-------------------------------------------------------------------------*\
 * Returns family as string
 \*-------------------------------------------------------------------------*/
@@ -354,6 +637,11 @@ static int meth_shutdown(lua_State *L)
     static const char* methods[] = { "receive", "send", "both", NULL };
     p_tcp tcp = (p_tcp) auxiliar_checkclass(L, "tcp{client}", 1);
     int how = luaL_checkoption(L, 2, "both", methods);
+    /* pending output would otherwise be lost once sending is shut down */
+    if (how != 0) {
+        timeout_markstart(tcp->buf.tm);
+        buffer_flush(&tcp->buf);
+    }
     socket_shutdown(&tcp->sock, how);
     lua_pushnumber(L, 1);
     return 1;
@@ -389,6 +677,214 @@ static int meth_gettimeout(lua_State *L)
     return timeout_meth_gettimeout(L, &tcp->tm);
 }
 
+static int meth_setdeadline(lua_State *L)
+{
+    p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+    return timeout_meth_setdeadline(L, &tcp->tm);
+}
+
+/*-------------------------------------------------------------------------*\
+* Turns yield mode on or off. In yield mode, I/O does not wait: methods
+* that can park the calling task do so, the others act as if the timeout
+* were zero.
+\*-------------------------------------------------------------------------*/
+static int meth_setyield(lua_State *L)
+{
+    p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+#ifdef SCHEDULER_YIELD
+    tcp->yield = lua_toboolean(L, 2);
+    timeout_init(&tcp->ztm, 0, -1);
+    tcp->buf.tm = tcp->yield? &tcp->ztm: &tcp->tm;
+    lua_pushnumber(L, 1);
+    return 1;
+#else
+    lua_pushnil(L);
+    lua_pushliteral(L, "yield mode not available");
+    return 2;
+#endif
+}
+
+static int meth_getyield(lua_State *L)
+{
+    p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+    lua_pushboolean(L, tcp->yield);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Selects the driver that does the I/O of the object: "socket", which
+* waits with poll, or "uring", which goes through io_uring
+\*-------------------------------------------------------------------------*/
+static int meth_setdriver(lua_State *L)
+{
+    static const char *drivers[] = {"socket", "uring", NULL};
+    p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+    if (luaL_checkoption(L, 2, NULL, drivers) == 1) {
+#ifdef RING_URING
+        const char *err = ring_setdriver(L, &tcp->io, &tcp->rio, &tcp->sock);
+        if (err) {
+            lua_pushnil(L);
+            lua_pushstring(L, err);
+            return 2;
+        }
+#else
+        lua_pushnil(L);
+        lua_pushliteral(L, "io_uring not available");
+        return 2;
+#endif
+    } else io_init(&tcp->io, (p_send) socket_send, (p_sendv) socket_sendv,
+            (p_recv) socket_recv, (p_error) socket_ioerror, &tcp->sock);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+static int meth_getdriver(lua_State *L)
+{
+    p_tcp tcp = (p_tcp) auxiliar_checkgroup(L, "tcp{any}", 1);
+#ifdef RING_URING
+    if (tcp->io.ctx == &tcp->rio) {
+        lua_pushliteral(L, "uring");
+        return 1;
+    }
+#endif
+    (void) tcp;
+    lua_pushliteral(L, "socket");
+    return 1;
+}
+
+#ifdef SCHEDULER_YIELD
+/*=========================================================================*\
+* Operations in yield mode
+\*=========================================================================*/
+/* the object, which waits for events on its socket */
+static p_tcp yieldwait(lua_State *L, p_yieldwait w, int events) {
+    p_tcp tcp = (p_tcp) lua_touserdata(L, 1);
+    w->fd = (int) tcp->sock;
+    w->events = events;
+    w->tm = &tcp->tm;
+    return tcp;
+}
+
+/* arguments: object, data, i, j. a retry starts after the last byte sent,
+* which comes third in the results */
+static int yield_send(lua_State *L, p_yieldwait w) {
+    p_tcp tcp = yieldwait(L, w, POLLER_WRITE);
+    int n = buffer_meth_send(L, &tcp->buf);
+    if (lua_isnil(L, 5)) {
+        lua_pushnumber(L, lua_tonumber(L, 7) + 1);
+        lua_replace(L, 3);
+    }
+    return n;
+}
+
+static int yield_flush(lua_State *L, p_yieldwait w) {
+    p_tcp tcp = yieldwait(L, w, POLLER_WRITE);
+    return buffer_meth_flush(L, &tcp->buf);
+}
+
+/* arguments: object, pattern, prefix, then the partial result held so
+* far, its length and how much of it was received rather than prefixed.
+* a try that times out moves its partial result, which comes third in
+* the results, to the held one, so that the data is copied once however
+* often the task parks. receives that must first push out buffered
+* output wait until the socket is writable */
+static int yield_receive(lua_State *L, p_yieldwait w) {
+    p_tcp tcp = (p_tcp) lua_touserdata(L, 1);
+    size_t held = (size_t) lua_tonumber(L, 5);
+    size_t received = (size_t) lua_tonumber(L, 6);
+    int n = buffer_receive(L, &tcp->buf, held, received);
+    yieldwait(L, w, tcp->buf.outlen > 0? POLLER_WRITE: POLLER_READ);
+    if (!lua_isnil(L, 7)) joinpartial(L, 7);
+    else if (strcmp(lua_tostring(L, 8), "timeout") != 0) joinpartial(L, 9);
+    else {
+        size_t size = 0;
+        if (lua_isstring(L, 3)) lua_tolstring(L, 3, &size);
+        holdpartial(L, 9);
+        lua_pushnumber(L, received + (size_t) lua_tonumber(L, 5) -
+            held - size);
+        lua_replace(L, 6);
+        lua_pushnil(L);
+        lua_replace(L, 3);
+    }
+    return n;
+}
+
+/* the partial result of a receive that gives up is all that was held */
+static void settle_receive(lua_State *L, int n) {
+    int part = lua_gettop(L) - n + 3;
+    if (lua_isuserdata(L, 4)) {
+        lua_pushlstring(L, (const char *) lua_touserdata(L, 4),
+            (size_t) lua_tonumber(L, 5));
+        lua_replace(L, part);
+    }
+}
+
+/* appends the string at idx to the held partial result, a userdata that
+* doubles in size when it runs out of room */
+static void holdpartial(lua_State *L, int idx) {
+    size_t held = (size_t) lua_tonumber(L, 5), len;
+    size_t room = lua_isuserdata(L, 4)? lua_rawlen(L, 4): 0;
+    const char *data = lua_tolstring(L, idx, &len);
+    if (len == 0) return;
+    if (held + len > room) {
+        size_t size = room*2 > held + len? room*2: held + len;
+        char *grown = (char *) lua_newuserdata(L, size);
+        if (held > 0) memcpy(grown, lua_touserdata(L, 4), held);
+        lua_replace(L, 4);
+    }
+    memcpy((char *) lua_touserdata(L, 4) + held, data, len);
+    lua_pushnumber(L, held + len);
+    lua_replace(L, 5);
+}
+
+/* prepends the held partial result to the string at idx */
+static void joinpartial(lua_State *L, int idx) {
+    if (!lua_isuserdata(L, 4)) return;
+    lua_pushlstring(L, (const char *) lua_touserdata(L, 4),
+        (size_t) lua_tonumber(L, 5));
+    lua_pushvalue(L, idx);
+    lua_concat(L, 2);
+    lua_replace(L, idx);
+}
+
+static int yield_accept(lua_State *L, p_yieldwait w) {
+    return acceptclient(L, yieldwait(L, w, POLLER_READ));
+}
+
+/* arguments: object, max, addresses */
+static int yield_acceptmany(lua_State *L, p_yieldwait w) {
+    return acceptclients(L, yieldwait(L, w, POLLER_READ));
+}
+
+/* arguments: object, address, port. once the connection is in progress
+* the address is replaced by false, and retries only collect the outcome.
+* the zero timeout keeps connectpeer to the first address, so there is no
+* race, and a failure is not followed by attempts to the other addresses */
+static int yield_connect(lua_State *L, p_yieldwait w) {
+    p_tcp tcp = yieldwait(L, w, POLLER_WRITE);
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (lua_toboolean(L, 2)) {
+        int n = connectpeer(L, tcp);
+        w->fd = (int) tcp->sock;
+        if (lua_isnil(L, 4)) {
+            lua_pushboolean(L, 0);
+            lua_replace(L, 2);
+        }
+        return n;
+    }
+    if (getsockopt(tcp->sock, SOL_SOCKET, SO_ERROR, (char *) &err, &len) < 0)
+        err = errno;
+    if (err != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, socket_strerror(err));
+        return 2;
+    }
+    lua_pushnumber(L, 1);
+    return 1;
+}
+#endif
+
 /*=========================================================================*\
 * Library functions
 \*=========================================================================*/
@@ -405,10 +901,10 @@ static int tcp_create(lua_State *L, int family) {
      * replaced with an AF_INET6 or AF_INET socket upon first use. */
     tcp->sock = SOCKET_INVALID;
     tcp->family = family;
-    io_init(&tcp->io, (p_send) socket_send, (p_recv) socket_recv,
-            (p_error) socket_ioerror, &tcp->sock);
+    io_init(&tcp->io, (p_send) socket_send, (p_sendv) socket_sendv,
+            (p_recv) socket_recv, (p_error) socket_ioerror, &tcp->sock);
     timeout_init(&tcp->tm, -1, -1);
-    buffer_init(&tcp->buf, &tcp->io, &tcp->tm);
+    buffer_init(L, &tcp->buf, &tcp->io, &tcp->tm);
     if (family != AF_UNSPEC) {
         const char *err = inet_trycreate(&tcp->sock, family, SOCK_STREAM, 0);
         if (err != NULL) {
@@ -416,7 +912,6 @@ static int tcp_create(lua_State *L, int family) {
             lua_pushstring(L, err);
             return 2;
         }
-        socket_setnonblocking(&tcp->sock);
     }
     return 1;
 }
@@ -439,15 +934,16 @@ static int global_connect(lua_State *L) {
     const char *localaddr  = luaL_optstring(L, 3, NULL);
     const char *localserv  = luaL_optstring(L, 4, "0");
     int family = inet_optfamily(L, 5, "unspec");
+    double delay = luaL_optnumber(L, 6, TCP_CONNECTDELAY);
     p_tcp tcp = (p_tcp) lua_newuserdata(L, sizeof(t_tcp));
     struct addrinfo bindhints, connecthints;
     const char *err = NULL;
     /* initialize tcp structure */
     memset(tcp, 0, sizeof(t_tcp));
-    io_init(&tcp->io, (p_send) socket_send, (p_recv) socket_recv,
-            (p_error) socket_ioerror, &tcp->sock);
+    io_init(&tcp->io, (p_send) socket_send, (p_sendv) socket_sendv,
+            (p_recv) socket_recv, (p_error) socket_ioerror, &tcp->sock);
     timeout_init(&tcp->tm, -1, -1);
-    buffer_init(&tcp->buf, &tcp->io, &tcp->tm);
+    buffer_init(L, &tcp->buf, &tcp->io, &tcp->tm);
     tcp->sock = SOCKET_INVALID;
     tcp->family = AF_UNSPEC;
     /* allow user to pick local address and port */
@@ -470,7 +966,7 @@ static int global_connect(lua_State *L) {
     /* make sure we try to connect only to the same family */
     connecthints.ai_family = tcp->family;
     err = inet_tryconnect(&tcp->sock, &tcp->family, remoteaddr, remoteserv,
-         &tcp->tm, &connecthints);
+         &tcp->tm, &connecthints, delay);
     if (err) {
         socket_destroy(&tcp->sock);
         lua_pushnil(L);
@@ -480,3 +976,185 @@ static int global_connect(lua_State *L) {
     auxiliar_setclass(L, "tcp{client}", -1);
     return 1;
 }
+
+#ifndef _WIN32
+/* a connection being established by connectmany */
+typedef struct t_target_ {
+    p_tcp tcp;                  /* object the socket goes to */
+    struct addrinfo *resolved;  /* addresses of the target */
+    struct addrinfo *next;      /* next address to try */
+    const char *err;            /* why the latest attempt failed */
+    int pending;                /* whether an attempt is in progress */
+} t_target;
+typedef t_target *p_target;
+
+/* connections being established together */
+typedef struct t_batch_ {
+    t_pollset set;              /* attempts in progress */
+    p_target targets;
+    int *slots;                 /* target of each descriptor in the set */
+    int nslots;                 /* number of entries allocated in slots */
+    int pending;                /* number of attempts in progress */
+} t_batch;
+typedef t_batch *p_batch;
+
+/* watches an attempt in progress, remembering its target */
+static int watchattempt(p_batch b, int i) {
+    int fd = (int) b->targets[i].tcp->sock;
+    if (fd >= b->nslots) {
+        int n = b->nslots? b->nslots: 64, *slots;
+        while (n <= fd) n *= 2;
+        slots = (int *) realloc(b->slots, n * sizeof(int));
+        if (!slots) return ENOMEM;
+        b->slots = slots;
+        b->nslots = n;
+    }
+    b->slots[fd] = i;
+    return pollset_add(&b->set, fd, POLLER_WRITE);
+}
+
+/* starts connecting to the next address of a target, moving on to the
+* following address whenever an attempt fails right away */
+static void startattempt(p_batch b, int i) {
+    p_target target = &b->targets[i];
+    t_timeout zero;
+    timeout_init(&zero, 0, -1);
+    while (target->next) {
+        struct addrinfo *ai = target->next;
+        int err;
+        target->next = ai->ai_next;
+        target->err = inet_trycreate(&target->tcp->sock, ai->ai_family,
+            ai->ai_socktype, ai->ai_protocol);
+        if (target->err) continue;
+        target->tcp->family = ai->ai_family;
+        err = socket_connect(&target->tcp->sock, ai->ai_addr,
+            (socklen_t) ai->ai_addrlen, &zero);
+        if (err == IO_DONE) return;
+        if (err == IO_TIMEOUT && (err = watchattempt(b, i)) == 0) {
+            target->pending = 1;
+            b->pending++;
+            return;
+        }
+        target->err = socket_strerror(err);
+        socket_destroy(&target->tcp->sock);
+    }
+}
+
+/* collects the outcome of an attempt found ready. as in socket_connect,
+* a failed attempt reports its error on recv */
+static void finishattempt(p_batch b, int fd, int events) {
+    int i = b->slots[fd], err;
+    p_target target = &b->targets[i];
+    pollset_remove(&b->set, fd);
+    target->pending = 0;
+    b->pending--;
+    if (!(events & POLLER_READ) || recv(fd, (char *) &err, 0, 0) == 0)
+        return;
+    target->err = socket_strerror(errno);
+    socket_destroy(&target->tcp->sock);
+    startattempt(b, i);
+}
+
+/*-------------------------------------------------------------------------*\
+* Connects to many targets at once. Every connection attempt is started
+* before any is waited for, so it takes as long as the slowest target
+* Lua Input: targets [, timeout]
+*   targets: array of {host, port} pairs
+*   timeout: seconds to wait for all the connections, forever by default
+* Lua Returns
+*   an array with a client object for each target, or false where the
+*   connection failed, and a table with the error for each of those
+\*-------------------------------------------------------------------------*/
+static int global_connectmany(lua_State *L) {
+    double t = luaL_optnumber(L, 2, -1);
+    int n, i, err = 0;
+    t_batch b;
+    t_timeout tm;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    n = (int) lua_rawlen(L, 1);
+    /* check every target before there is anything to clean up */
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+        luaL_argcheck(L, lua_istable(L, -1), 1, "invalid target");
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+        luaL_argcheck(L, lua_isstring(L, -2) && lua_isstring(L, -1), 1,
+            "invalid target");
+        lua_pop(L, 3);
+    }
+    lua_settop(L, 2);
+    lua_createtable(L, n, 0);
+    lua_newtable(L);
+    /* sockets live in the objects from the start, so nothing can leak */
+    memset(&b, 0, sizeof(b));
+    b.targets = (p_target) lua_newuserdata(L, (n? n: 1) * sizeof(t_target));
+    for (i = 0; i < n; i++) {
+        p_tcp tcp = (p_tcp) lua_newuserdata(L, sizeof(t_tcp));
+        memset(tcp, 0, sizeof(t_tcp));
+        io_init(&tcp->io, (p_send) socket_send, (p_sendv) socket_sendv,
+                (p_recv) socket_recv, (p_error) socket_ioerror, &tcp->sock);
+        timeout_init(&tcp->tm, -1, -1);
+        buffer_init(L, &tcp->buf, &tcp->io, &tcp->tm);
+        tcp->sock = SOCKET_INVALID;
+        tcp->family = AF_UNSPEC;
+        auxiliar_setclass(L, "tcp{client}", -1);
+        lua_rawseti(L, 3, i+1);
+        memset(&b.targets[i], 0, sizeof(t_target));
+        b.targets[i].tcp = tcp;
+    }
+    /* names are resolved one at a time, before any attempt starts */
+    for (i = 0; i < n; i++) {
+        p_target target = &b.targets[i];
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_family = AF_UNSPEC;
+        lua_rawgeti(L, 1, i+1);
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+        target->err = socket_gaistrerror(getaddrinfo(lua_tostring(L, -2),
+            lua_tostring(L, -1), &hints, &target->resolved));
+        if (target->err) target->resolved = NULL;
+        target->next = target->resolved;
+        lua_pop(L, 3);
+    }
+    /* no Lua calls from here on, until all resources are released */
+    if ((err = pollset_init(&b.set)) == 0) {
+        timeout_init(&tm, t, -1);
+        timeout_markstart(&tm);
+        for (i = 0; i < n; i++) startattempt(&b, i);
+        while (b.pending > 0) {
+            int nready = pollset_wait(&b.set, b.pending, &tm);
+            if (nready <= 0) {
+                err = nready < 0? -nready: IO_TIMEOUT;
+                break;
+            }
+            for (i = 0; i < nready; i++) {
+                int events, fd = pollset_result(&b.set, i, &events);
+                finishattempt(&b, fd, events);
+            }
+        }
+    }
+    /* whatever is still in progress failed with the wait */
+    for (i = 0; i < n; i++) {
+        p_target target = &b.targets[i];
+        if (target->pending || (err && target->tcp->sock == SOCKET_INVALID
+                && !target->err)) {
+            target->err = socket_strerror(err);
+            socket_destroy(&target->tcp->sock);
+        }
+        if (target->resolved) freeaddrinfo(target->resolved);
+    }
+    pollset_destroy(&b.set);
+    free(b.slots);
+    for (i = 0; i < n; i++) {
+        if (b.targets[i].tcp->sock != SOCKET_INVALID) continue;
+        lua_pushboolean(L, 0);
+        lua_rawseti(L, 3, i+1);
+        lua_pushstring(L, b.targets[i].err);
+        lua_rawseti(L, 4, i+1);
+    }
+    lua_settop(L, 4);
+    return 2;
+}
+#endif
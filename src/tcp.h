@@ -19,12 +19,18 @@
 #include "buffer.h"
 #include "timeout.h"
 #include "socket.h"
+#include "ring.h"
 
 typedef struct t_tcp_ {
     t_socket sock;
     t_io io;
     t_buffer buf;
     t_timeout tm;
+    t_timeout ztm;          /* zero timeout used by I/O in yield mode */
+    int yield;              /* whether methods yield instead of waiting */
+#ifdef RING_URING
+    t_ringio rio;           /* context of the io_uring driver, if in use */
+#endif
     int family;
 } t_tcp;
 
@@ -35,6 +41,7 @@ typedef t_tcp *p_tcp;
 #endif
 
 int tcp_open(lua_State *L);
+void tcp_pushclient(lua_State *L, p_tcp server, t_socket sock);
 
 #ifndef _WIN32
 #pragma GCC visibility pop
@@ -30,10 +30,14 @@
 * Internal function prototypes
 \*=========================================================================*/
 static int timeout_lua_gettime(lua_State *L);
+static int timeout_lua_monotime(lua_State *L);
 static int timeout_lua_sleep(lua_State *L);
+static double timeout_left(p_timeout tm, double limit);
+static double timeout_bound(p_timeout tm, double t);
 
 static luaL_Reg func[] = {
     { "gettime", timeout_lua_gettime },
+    { "monotime", timeout_lua_monotime },
     { "sleep", timeout_lua_sleep },
     { NULL, NULL }
 };
@@ -47,6 +51,7 @@ static luaL_Reg func[] = {
 void timeout_init(p_timeout tm, double block, double total) {
     tm->block = block;
     tm->total = total;
+    tm->deadline = -1.0;
 }
 
 /*-------------------------------------------------------------------------*\
@@ -58,17 +63,17 @@ void timeout_init(p_timeout tm, double block, double total) {
 *   the number of ms left or -1 if there is no time limit
 \*-------------------------------------------------------------------------*/
 double timeout_get(p_timeout tm) {
+    double t;
     if (tm->block < 0.0 && tm->total < 0.0) {
-        return -1;
+        t = -1;
     } else if (tm->block < 0.0) {
-        double t = tm->total - timeout_gettime() + tm->start;
-        return MAX(t, 0.0);
+        t = timeout_left(tm, tm->total);
     } else if (tm->total < 0.0) {
-        return tm->block;
+        t = tm->block;
     } else {
-        double t = tm->total - timeout_gettime() + tm->start;
-        return MIN(tm->block, MAX(t, 0.0));
+        t = MIN(tm->block, timeout_left(tm, tm->total));
     }
+    return timeout_bound(tm, t);
 }
 
 /*-------------------------------------------------------------------------*\
@@ -91,18 +96,17 @@ double timeout_getstart(p_timeout tm) {
 *   the number of ms left or -1 if there is no time limit
 \*-------------------------------------------------------------------------*/
 double timeout_getretry(p_timeout tm) {
+    double t;
     if (tm->block < 0.0 && tm->total < 0.0) {
-        return -1;
+        t = -1;
     } else if (tm->block < 0.0) {
-        double t = tm->total - timeout_gettime() + tm->start;
-        return MAX(t, 0.0);
+        t = timeout_left(tm, tm->total);
     } else if (tm->total < 0.0) {
-        double t = tm->block - timeout_gettime() + tm->start;
-        return MAX(t, 0.0);
+        t = timeout_left(tm, tm->block);
     } else {
-        double t = tm->total - timeout_gettime() + tm->start;
-        return MIN(tm->block, MAX(t, 0.0));
+        t = MIN(tm->block, timeout_left(tm, tm->total));
     }
+    return timeout_bound(tm, t);
 }
 
 /*-------------------------------------------------------------------------*\
@@ -111,10 +115,32 @@ double timeout_getretry(p_timeout tm) {
 *   tm: timeout control structure
 \*-------------------------------------------------------------------------*/
 p_timeout timeout_markstart(p_timeout tm) {
-    tm->start = timeout_gettime();
+    /* zero and infinite timeouts do not depend on the start */
+    if (tm->block <= 0.0 && tm->total <= 0.0) return tm;
+    tm->start = timeout_monotime();
     return tm;
 }
 
+/*-------------------------------------------------------------------------*\
+* Returns how much of a limit is left since the start of the operation
+\*-------------------------------------------------------------------------*/
+static double timeout_left(p_timeout tm, double limit) {
+    double t;
+    if (limit <= 0.0) return 0.0;
+    t = limit - timeout_monotime() + tm->start;
+    return MIN(limit, MAX(t, 0.0));
+}
+
+/*-------------------------------------------------------------------------*\
+* Cuts the time left for a system call at the deadline, if there is one
+\*-------------------------------------------------------------------------*/
+static double timeout_bound(p_timeout tm, double t) {
+    double d;
+    if (tm->deadline < 0.0) return t;
+    d = MAX(tm->deadline - timeout_monotime(), 0.0);
+    return t < 0.0? d: MIN(t, d);
+}
+
 /*-------------------------------------------------------------------------*\
 * Gets time in s, relative to January 1, 1970 (UTC)
 * Returns
@@ -139,6 +165,36 @@ double timeout_gettime(void) {
 }
 #endif
 
+/*-------------------------------------------------------------------------*\
+* Gets time in s from an arbitrary origin, unaffected by changes to the
+* system time. Used for all timeout accounting.
+* Returns
+*   time in s.
+\*-------------------------------------------------------------------------*/
+#ifdef _WIN32
+double timeout_monotime(void) {
+    static double period = 0.0;
+    LARGE_INTEGER count;
+    if (period == 0.0) {
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        period = 1.0/(double) freq.QuadPart;
+    }
+    QueryPerformanceCounter(&count);
+    return (double) count.QuadPart*period;
+}
+#elif defined(CLOCK_MONOTONIC)
+double timeout_monotime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1.0e9;
+}
+#else
+double timeout_monotime(void) {
+    return timeout_gettime();
+}
+#endif
+
 /*-------------------------------------------------------------------------*\
 * Initializes module
 \*-------------------------------------------------------------------------*/
@@ -181,6 +237,17 @@ int timeout_meth_gettimeout(lua_State *L, p_timeout tm) {
     return 2;
 }
 
+/*-------------------------------------------------------------------------*\
+* Sets the deadline, a monotonic time that no operation waits past,
+* whatever its timeouts. Nil removes it
+\*-------------------------------------------------------------------------*/
+int timeout_meth_setdeadline(lua_State *L, p_timeout tm) {
+    double t = luaL_optnumber(L, 2, -1);
+    tm->deadline = t < 0.0? -1.0: t;
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
 /*=========================================================================*\
 * Test support functions
 \*=========================================================================*/
@@ -193,6 +260,15 @@ static int timeout_lua_gettime(lua_State *L)
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Returns the time of the monotonic clock, in seconds.
+\*-------------------------------------------------------------------------*/
+static int timeout_lua_monotime(lua_State *L)
+{
+    lua_pushnumber(L, timeout_monotime());
+    return 1;
+}
+
 /*-------------------------------------------------------------------------*\
 * Sleep for n seconds.
 \*-------------------------------------------------------------------------*/
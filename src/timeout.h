@@ -10,7 +10,8 @@
 typedef struct t_timeout_ {
     double block;          /* maximum time for blocking calls */
     double total;          /* total number of miliseconds for operation */
-    double start;          /* time of start of operation */
+    double start;          /* time of start of operation, monotonic */
+    double deadline;       /* monotonic time no operation waits past, or -1 */
 } t_timeout;
 typedef t_timeout *p_timeout;
 
@@ -25,11 +26,13 @@ double timeout_getretry(p_timeout tm);
 p_timeout timeout_markstart(p_timeout tm);
 
 double timeout_gettime(void);
+double timeout_monotime(void);
 
 int timeout_open(lua_State *L);
 
 int timeout_meth_settimeout(lua_State *L, p_timeout tm);
 int timeout_meth_gettimeout(lua_State *L, p_timeout tm);
+int timeout_meth_setdeadline(lua_State *L, p_timeout tm);
 
 #ifndef _WIN32
 #pragma GCC visibility pop
@@ -0,0 +1,422 @@
+/*=========================================================================*\
+* Timer wheels
+* LuaSocket toolkit
+\*=========================================================================*/
+#include "luasocket.h"
+
+#include "auxiliar.h"
+#include "timeout.h"
+#include "timers.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TIMERS_CLASS "timer{wheel}"
+
+/* wheel geometry: TIMERS_LEVELS levels of TIMERS_SLOTS slots each */
+#define TIMERS_BITS 8
+#define TIMERS_SLOTS (1 << TIMERS_BITS)
+#define TIMERS_MASK (TIMERS_SLOTS - 1)
+#define TIMERS_LEVELS 4
+/* farthest a timer can be scheduled, in ticks; later ones are clamped */
+#define TIMERS_MAXDELTA 0xffffffffUL
+/* list of timers that are due but whose callbacks have not run yet */
+#define TIMERS_DUE (TIMERS_LEVELS*TIMERS_SLOTS)
+/* slot of a node that is not in use */
+#define TIMERS_FREE (-1)
+/* default duration of a tick, in seconds */
+#define TIMERS_RESOLUTION 0.01
+/* timer ids carry a generation count above the node index, so that the
+* id of a timer that already fired cannot cancel a newer one */
+#define TIMERS_GENSCALE 4294967296.0
+#define TIMERS_MAXGEN 0x1fffffUL
+
+/* a scheduled timer */
+typedef struct t_timer_ {
+    unsigned long expires;  /* tick the timer fires at */
+    unsigned long gen;      /* incremented each time the node is released */
+    int slot;               /* list the node is in, or TIMERS_FREE */
+    int prev, next;         /* neighbours in that list, or -1 */
+} t_timer;
+
+/* timer wheel control structure */
+typedef struct t_timers_ {
+    double origin;          /* time of tick zero */
+    double resolution;      /* duration of a tick, in seconds */
+    double ticks;           /* number of ticks processed so far */
+    unsigned long current;  /* the same, modulo ULONG_MAX+1 */
+    int ref;                /* registry reference to the callbacks */
+    int count;              /* pending timers, including due ones */
+    int inner;              /* pending timers in the innermost level */
+    t_timer *nodes;         /* timer storage */
+    int size;               /* number of nodes allocated */
+    int used;               /* number of nodes ever handed out */
+    int free;               /* first released node, or -1 */
+    int heads[TIMERS_DUE+1]; /* first node in each list, or -1 */
+    int tails[TIMERS_DUE+1]; /* last node in each list, or -1 */
+} t_timers;
+typedef t_timers *p_timers;
+
+/*=========================================================================*\
+* Internal function prototypes
+\*=========================================================================*/
+static int global_create(lua_State *L);
+static int meth_schedule(lua_State *L);
+static int meth_cancel(lua_State *L);
+static int meth_next(lua_State *L);
+static int meth_expire(lua_State *L);
+static int meth_gc(lua_State *L);
+static p_timers checktimers(lua_State *L);
+static double checktime(lua_State *L, int arg);
+static int pusherror(lua_State *L, const char *err);
+static void pushid(lua_State *L, p_timers w, int idx);
+static int findid(p_timers w, double id);
+static int timers_alloc(p_timers w);
+static void timers_release(p_timers w, int idx);
+static void timers_link(p_timers w, int idx, int slot);
+static void timers_unlink(p_timers w, int idx);
+static void timers_place(p_timers w, int idx);
+static void timers_tick(p_timers w);
+static void timers_advance(p_timers w, double now);
+static double timers_nextdelta(p_timers w);
+
+/* timer wheel methods */
+static luaL_Reg timers_methods[] = {
+    {"__gc",        meth_gc},
+    {"__tostring",  auxiliar_tostring},
+    {"cancel",      meth_cancel},
+    {"expire",      meth_expire},
+    {"next",        meth_next},
+    {"schedule",    meth_schedule},
+    {NULL,          NULL}
+};
+
+/* functions in library namespace */
+static luaL_Reg func[] = {
+    {"timers", global_create},
+    {NULL,     NULL}
+};
+
+/*-------------------------------------------------------------------------*\
+* Initializes module
+\*-------------------------------------------------------------------------*/
+int timers_open(lua_State *L) {
+    auxiliar_newclass(L, TIMERS_CLASS, timers_methods);
+    luaL_setfuncs(L, func, 0);
+    return 0;
+}
+
+/*=========================================================================*\
+* Lua methods
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Schedules a callback to run after delay seconds, returns the timer id
+\*-------------------------------------------------------------------------*/
+static int meth_schedule(lua_State *L) {
+    p_timers w = checktimers(L);
+    double delay = luaL_checknumber(L, 2);
+    double d;
+    int idx;
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    /* first tick that is not earlier than the deadline */
+    d = ceil((timeout_monotime() + delay - w->origin)/w->resolution) - w->ticks;
+    idx = timers_alloc(w);
+    if (idx < 0) return pusherror(L, "out of memory");
+    if (!(d > 0.0)) d = 0.0;
+    if (d > (double) TIMERS_MAXDELTA) d = (double) TIMERS_MAXDELTA;
+    w->nodes[idx].expires = w->current + (unsigned long) d;
+    timers_place(w, idx);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, w->ref);
+    lua_pushvalue(L, 3);
+    lua_rawseti(L, -2, idx+1);
+    pushid(L, w, idx);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Cancels a timer that has not fired yet
+\*-------------------------------------------------------------------------*/
+static int meth_cancel(lua_State *L) {
+    p_timers w = checktimers(L);
+    int idx = findid(w, luaL_checknumber(L, 2));
+    if (idx < 0) return pusherror(L, "not scheduled");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, w->ref);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, idx+1);
+    timers_release(w, idx);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the time until the next timer is due, suitable as the timeout
+* of a wait. It is never later than the actual expiration, but it can be
+* earlier for timers that are still in the outer levels of the wheel.
+\*-------------------------------------------------------------------------*/
+static int meth_next(lua_State *L) {
+    p_timers w = checktimers(L);
+    double now = checktime(L, 2), t = 0.0;
+    if (w->count == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    if (w->heads[TIMERS_DUE] < 0) {
+        t = w->origin + (w->ticks + timers_nextdelta(w))*w->resolution - now;
+        if (t < 0.0) t = 0.0;
+    }
+    lua_pushnumber(L, t);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Advances the wheel and runs the callbacks of all timers that are due,
+* each with its timer id. Returns the number of callbacks run.
+\*-------------------------------------------------------------------------*/
+static int meth_expire(lua_State *L) {
+    p_timers w = checktimers(L);
+    double now = checktime(L, 2);
+    int fired = 0, idx;
+    timers_advance(w, now);
+    lua_settop(L, 1);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, w->ref);
+    /* due timers are released before their callbacks run, so callbacks
+    * can schedule and cancel freely. if a callback raises an error, the
+    * rest of the batch stays due for the next call */
+    while ((idx = w->heads[TIMERS_DUE]) >= 0) {
+        lua_rawgeti(L, 2, idx+1);
+        lua_pushnil(L);
+        lua_rawseti(L, 2, idx+1);
+        pushid(L, w, idx);
+        timers_release(w, idx);
+        lua_call(L, 1, 0);
+        fired++;
+    }
+    lua_pushnumber(L, fired);
+    return 1;
+}
+
+/*-------------------------------------------------------------------------*\
+* Releases the wheel
+\*-------------------------------------------------------------------------*/
+static int meth_gc(lua_State *L) {
+    p_timers w = (p_timers) auxiliar_checkclass(L, TIMERS_CLASS, 1);
+    if (w->ref != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, w->ref);
+        w->ref = LUA_NOREF;
+    }
+    free(w->nodes);
+    w->nodes = NULL;
+    w->size = w->used = 0;
+    return 0;
+}
+
+/*=========================================================================*\
+* Library functions
+\*=========================================================================*/
+/*-------------------------------------------------------------------------*\
+* Creates a timer wheel with the given resolution, in seconds
+\*-------------------------------------------------------------------------*/
+static int global_create(lua_State *L) {
+    double resolution = luaL_optnumber(L, 1, TIMERS_RESOLUTION);
+    p_timers w;
+    int i;
+    luaL_argcheck(L, resolution > 0.0, 1, "invalid resolution");
+    w = (p_timers) lua_newuserdata(L, sizeof(t_timers));
+    memset(w, 0, sizeof(t_timers));
+    w->ref = LUA_NOREF;
+    w->origin = timeout_monotime();
+    w->resolution = resolution;
+    w->free = -1;
+    for (i = 0; i <= TIMERS_DUE; i++) w->heads[i] = w->tails[i] = -1;
+    auxiliar_setclass(L, TIMERS_CLASS, -1);
+    lua_newtable(L);
+    w->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+}
+
+/*=========================================================================*\
+* Internal functions
+\*=========================================================================*/
+static p_timers checktimers(lua_State *L) {
+    return (p_timers) auxiliar_checkclass(L, TIMERS_CLASS, 1);
+}
+
+/* an optional point in time, defaulting to the current time */
+static double checktime(lua_State *L, int arg) {
+    double now = lua_isnoneornil(L, arg)? timeout_monotime():
+        luaL_checknumber(L, arg);
+    luaL_argcheck(L, now - now == 0.0, arg, "invalid time");
+    return now;
+}
+
+static int pusherror(lua_State *L, const char *err) {
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+}
+
+static void pushid(lua_State *L, p_timers w, int idx) {
+    lua_pushnumber(L, (double) w->nodes[idx].gen*TIMERS_GENSCALE + idx + 1);
+}
+
+/* returns the node of a pending timer given its id, or -1 */
+static int findid(p_timers w, double id) {
+    double gen = floor((id - 1)/TIMERS_GENSCALE);
+    double idx = id - 1 - gen*TIMERS_GENSCALE;
+    t_timer *t;
+    if (!(idx >= 0.0 && idx < w->used) || idx != floor(idx)) return -1;
+    t = &w->nodes[(int) idx];
+    if (t->slot == TIMERS_FREE || (double) t->gen != gen) return -1;
+    return (int) idx;
+}
+
+/*-------------------------------------------------------------------------*\
+* Node storage
+\*-------------------------------------------------------------------------*/
+static int timers_alloc(p_timers w) {
+    int idx = w->free;
+    if (idx >= 0) {
+        w->free = w->nodes[idx].next;
+    } else {
+        if (w->used == w->size) {
+            int size = w->size? 2*w->size: 64;
+            t_timer *nodes;
+            if (w->size > INT_MAX/2 ||
+                (size_t) size > ((size_t) -1)/sizeof(t_timer)) return -1;
+            nodes = (t_timer *) realloc(w->nodes, size*sizeof(t_timer));
+            if (!nodes) return -1;
+            w->nodes = nodes;
+            w->size = size;
+        }
+        idx = w->used++;
+        w->nodes[idx].gen = 0;
+    }
+    w->count++;
+    return idx;
+}
+
+static void timers_release(p_timers w, int idx) {
+    t_timer *t = &w->nodes[idx];
+    timers_unlink(w, idx);
+    t->slot = TIMERS_FREE;
+    t->gen = (t->gen + 1) & TIMERS_MAXGEN;
+    t->next = w->free;
+    w->free = idx;
+    w->count--;
+}
+
+/*-------------------------------------------------------------------------*\
+* Lists are kept in insertion order, so timers due at the same tick fire
+* in the order they were scheduled
+\*-------------------------------------------------------------------------*/
+static void timers_link(p_timers w, int idx, int slot) {
+    t_timer *t = &w->nodes[idx];
+    t->slot = slot;
+    t->next = -1;
+    t->prev = w->tails[slot];
+    if (t->prev >= 0) w->nodes[t->prev].next = idx;
+    else w->heads[slot] = idx;
+    w->tails[slot] = idx;
+    if (slot < TIMERS_SLOTS) w->inner++;
+}
+
+static void timers_unlink(p_timers w, int idx) {
+    t_timer *t = &w->nodes[idx];
+    if (t->prev >= 0) w->nodes[t->prev].next = t->next;
+    else w->heads[t->slot] = t->next;
+    if (t->next >= 0) w->nodes[t->next].prev = t->prev;
+    else w->tails[t->slot] = t->prev;
+    if (t->slot < TIMERS_SLOTS) w->inner--;
+}
+
+/*-------------------------------------------------------------------------*\
+* Puts a timer in the level that covers its distance from the current
+* tick, in the slot selected by the matching bits of its expiration tick
+\*-------------------------------------------------------------------------*/
+static void timers_place(p_timers w, int idx) {
+    unsigned long expires = w->nodes[idx].expires;
+    unsigned long d = expires - w->current;
+    int level = 0;
+    while (level < TIMERS_LEVELS-1 && d >> (TIMERS_BITS*(level+1)) != 0)
+        level++;
+    timers_link(w, idx, level*TIMERS_SLOTS +
+        (int) ((expires >> (TIMERS_BITS*level)) & TIMERS_MASK));
+}
+
+/*-------------------------------------------------------------------------*\
+* Processes the current tick. Each time a level wraps around, the next
+* slot of the level above is redistributed, and the timers in the slot
+* of the innermost level become due.
+\*-------------------------------------------------------------------------*/
+static void timers_tick(p_timers w) {
+    unsigned long c = w->current;
+    int slot = (int) (c & TIMERS_MASK), level, idx;
+    for (level = 1; level < TIMERS_LEVELS; level++) {
+        int cascade;
+        if (((c >> (TIMERS_BITS*(level-1))) & TIMERS_MASK) != 0) break;
+        cascade = level*TIMERS_SLOTS +
+            (int) ((c >> (TIMERS_BITS*level)) & TIMERS_MASK);
+        while ((idx = w->heads[cascade]) >= 0) {
+            timers_unlink(w, idx);
+            timers_place(w, idx);
+        }
+    }
+    while ((idx = w->heads[slot]) >= 0) {
+        timers_unlink(w, idx);
+        timers_link(w, idx, TIMERS_DUE);
+    }
+    w->current = c + 1;
+    w->ticks += 1.0;
+}
+
+/*-------------------------------------------------------------------------*\
+* Processes every tick up to the given time. Runs of ticks with nothing
+* in the innermost level are skipped up to the next cascade.
+\*-------------------------------------------------------------------------*/
+static void timers_advance(p_timers w, double now) {
+    double target = floor((now - w->origin)/w->resolution) + 1.0;
+    while (w->ticks < target) {
+        double n = target - w->ticks;
+        unsigned long skip = TIMERS_SLOTS - (w->current & TIMERS_MASK);
+        if (w->count == 0) {
+            w->current += (unsigned long) fmod(n, TIMERS_GENSCALE);
+            w->ticks = target;
+        } else if (w->inner == 0 && skip != TIMERS_SLOTS) {
+            if (n < (double) skip) skip = (unsigned long) n;
+            w->current += skip;
+            w->ticks += (double) skip;
+        } else timers_tick(w);
+    }
+}
+
+/*-------------------------------------------------------------------------*\
+* Returns the number of ticks until the earliest pending timer could
+* fire. That is exact for the innermost level. For the others, it is the
+* tick at which the first occupied slot is redistributed.
+\*-------------------------------------------------------------------------*/
+static double timers_nextdelta(p_timers w) {
+    double best = -1.0;
+    int level, i;
+    for (i = 0; i < TIMERS_SLOTS; i++) {
+        if (w->heads[(w->current + i) & TIMERS_MASK] >= 0) return (double) i;
+    }
+    for (level = 1; level < TIMERS_LEVELS; level++) {
+        int shift = TIMERS_BITS*level;
+        unsigned long base = w->current >> shift;
+        unsigned long low = w->current & ((1UL << shift) - 1);
+        /* on a boundary, the slot under the current tick is yet to be
+        * redistributed. otherwise it was, and comes around last */
+        int first = low? 1: 0;
+        for (i = first; i < first + TIMERS_SLOTS; i++) {
+            int slot = level*TIMERS_SLOTS + (int) ((base + i) & TIMERS_MASK);
+            if (w->heads[slot] >= 0) {
+                double d = ldexp((double) i, shift) - (double) low;
+                if (best < 0.0 || d < best) best = d;
+                break;
+            }
+        }
+    }
+    return best < 0.0? 0.0: best;
+}
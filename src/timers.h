@@ -0,0 +1,26 @@
+#ifndef TIMERS_H
+#define TIMERS_H
+/*=========================================================================*\
+* Timer wheels
+* LuaSocket toolkit
+*
+* A timer wheel keeps many pending deadlines, such as idle and keep-alive
+* timeouts for thousands of connections, without sorting or scanning them.
+* Timers are hashed by expiration tick into four levels of 256 slots each,
+* so scheduling and cancelling are O(1). Timers in the outer levels are
+* moved inwards as time approaches their slot, and the ones that reach the
+* innermost level are fired in batches as the wheel advances.
+\*=========================================================================*/
+#include "luasocket.h"
+
+#ifndef _WIN32
+#pragma GCC visibility push(hidden)
+#endif
+
+int timers_open(lua_State *L);
+
+#ifndef _WIN32
+#pragma GCC visibility pop
+#endif
+
+#endif /* TIMERS_H */
@@ -119,10 +119,17 @@ function metat.__index:close()
 end
 
 -- connect with server and return c object
-function _M.connect(host, port, timeout, create)
+function _M.connect(host, port, timeout, create, deadline)
     local c, e = (create or socket.tcp)()
     if not c then return nil, e end
     c:settimeout(timeout or _M.TIMEOUT)
+    if deadline then
+        if not c.setdeadline then
+            c:close()
+            return nil, "deadline not supported"
+        end
+        c:setdeadline(deadline)
+    end
     local r, e = c:connect(host, port)
     if not r then
         c:close()
@@ -5,14 +5,20 @@
 #include "luasocket.h"
 
 #include "auxiliar.h"
+#include "bytes.h"
 #include "socket.h"
 #include "inet.h"
 #include "options.h"
 #include "udp.h"
+#include "scheduler.h"
 
 #include <string.h>
 #include <stdlib.h>
 
+#ifdef SCHEDULER_YIELD
+#include "poller.h"
+#endif
+
 /* min and max macros */
 #ifndef MIN
 #define MIN(x, y) ((x) < (y) ? x : y)
@@ -29,8 +35,10 @@ static int global_create4(lua_State *L);
 static int global_create6(lua_State *L);
 static int meth_send(lua_State *L);
 static int meth_sendto(lua_State *L);
+static int meth_sendfrom(lua_State *L);
 static int meth_receive(lua_State *L);
 static int meth_receivefrom(lua_State *L);
+static int meth_receiveinto(lua_State *L);
 static int meth_getfamily(lua_State *L);
 static int meth_getsockname(lua_State *L);
 static int meth_getpeername(lua_State *L);
@@ -41,9 +49,30 @@ static int meth_close(lua_State *L);
 static int meth_setoption(lua_State *L);
 static int meth_getoption(lua_State *L);
 static int meth_settimeout(lua_State *L);
+static int meth_setdeadline(lua_State *L);
 static int meth_getfd(lua_State *L);
 static int meth_setfd(lua_State *L);
 static int meth_dirty(lua_State *L);
+static int meth_getyield(lua_State *L);
+static int meth_setyield(lua_State *L);
+static p_timeout iotimeout(p_udp udp);
+static int trysend(lua_State *L, p_udp udp);
+static int trysendto(lua_State *L, p_udp udp);
+static int tryreceive(lua_State *L, p_udp udp);
+static int tryreceivefrom(lua_State *L, p_udp udp);
+#ifdef SCHEDULER_YIELD
+static void yieldwait(lua_State *L, p_yieldwait w, int events);
+static int yield_send(lua_State *L, p_yieldwait w);
+static int yield_sendto(lua_State *L, p_yieldwait w);
+static int yield_receive(lua_State *L, p_yieldwait w);
+static int yield_receivefrom(lua_State *L, p_yieldwait w);
+
+/* operations that can park the calling task in yield mode */
+static const t_yieldop sendop = {2, yield_send, NULL};
+static const t_yieldop sendtoop = {4, yield_sendto, NULL};
+static const t_yieldop receiveop = {2, yield_receive, NULL};
+static const t_yieldop receivefromop = {2, yield_receivefrom, NULL};
+#endif
 
 /* udp object methods */
 static luaL_Reg udp_methods[] = {
@@ -55,17 +84,22 @@ static luaL_Reg udp_methods[] = {
     {"getfd",       meth_getfd},
     {"getpeername", meth_getpeername},
     {"getsockname", meth_getsockname},
+    {"getyield",    meth_getyield},
     {"receive",     meth_receive},
     {"receivefrom", meth_receivefrom},
+    {"receiveinto", meth_receiveinto},
     {"send",        meth_send},
+    {"sendfrom",    meth_sendfrom},
     {"sendto",      meth_sendto},
     {"setfd",       meth_setfd},
     {"setoption",   meth_setoption},
     {"getoption",   meth_getoption},
     {"setpeername", meth_setpeername},
     {"setsockname", meth_setsockname},
+    {"setyield",    meth_setyield},
     {"settimeout",  meth_settimeout},
     {"gettimeout",  meth_gettimeout},
+    {"setdeadline", meth_setdeadline},
     {NULL,          NULL}
 };
 
@@ -153,7 +187,14 @@ static const char *udp_strerror(int err) {
 \*-------------------------------------------------------------------------*/
 static int meth_send(lua_State *L) {
     p_udp udp = (p_udp) auxiliar_checkclass(L, "udp{connected}", 1);
-    p_timeout tm = &udp->tm;
+#ifdef SCHEDULER_YIELD
+    if (udp->yield) return scheduler_yieldcall(L, &sendop, &udp->tm);
+#endif
+    return trysend(L, udp);
+}
+
+static int trysend(lua_State *L, p_udp udp) {
+    p_timeout tm = iotimeout(udp);
     size_t count, sent = 0;
     int err;
     const char *data = luaL_checklstring(L, 2, &count);
@@ -168,16 +209,50 @@ static int meth_send(lua_State *L) {
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Send part of a bytes object through connected udp socket
+\*-------------------------------------------------------------------------*/
+static int meth_sendfrom(lua_State *L) {
+    p_udp udp = (p_udp) auxiliar_checkclass(L, "udp{connected}", 1);
+    p_bytes bytes = bytes_check(L, 2);
+    p_timeout tm = iotimeout(udp);
+    size_t sent = 0;
+    int err = IO_DONE;
+    long start = (long) luaL_optnumber(L, 3, 1);
+    long end = (long) luaL_optnumber(L, 4, -1);
+    if (start < 0) start = (long) (bytes->size+start+1);
+    if (end < 0) end = (long) (bytes->size+end+1);
+    if (start < 1) start = (long) 1;
+    if (end > (long) bytes->size) end = (long) bytes->size;
+    if (end < start) end = start - 1;
+    timeout_markstart(tm);
+    err = socket_send(&udp->sock, bytes->data+start-1, end-start+1, &sent, tm);
+    if (err != IO_DONE) {
+        lua_pushnil(L);
+        lua_pushstring(L, udp_strerror(err));
+        return 2;
+    }
+    lua_pushnumber(L, (lua_Number) sent);
+    return 1;
+}
+
 /*-------------------------------------------------------------------------*\
 * Send data through unconnected udp socket
 \*-------------------------------------------------------------------------*/
 static int meth_sendto(lua_State *L) {
     p_udp udp = (p_udp) auxiliar_checkclass(L, "udp{unconnected}", 1);
+#ifdef SCHEDULER_YIELD
+    if (udp->yield) return scheduler_yieldcall(L, &sendtoop, &udp->tm);
+#endif
+    return trysendto(L, udp);
+}
+
+static int trysendto(lua_State *L, p_udp udp) {
     size_t count, sent = 0;
     const char *data = luaL_checklstring(L, 2, &count);
     const char *ip = luaL_checkstring(L, 3);
     const char *port = luaL_checkstring(L, 4);
-    p_timeout tm = &udp->tm;
+    p_timeout tm = iotimeout(udp);
     int err;
     struct addrinfo aihint;
     struct addrinfo *ai;
@@ -202,7 +277,6 @@ static int meth_sendto(lua_State *L) {
         for (ap = ai; ap != NULL; ap = ap->ai_next) {
             errstr = inet_trycreate(&udp->sock, ap->ai_family, SOCK_DGRAM, 0);
             if (errstr == NULL) {
-                socket_setnonblocking(&udp->sock);
                 udp->family = ap->ai_family;
                 break;
             }
@@ -233,11 +307,18 @@ static int meth_sendto(lua_State *L) {
 \*-------------------------------------------------------------------------*/
 static int meth_receive(lua_State *L) {
     p_udp udp = (p_udp) auxiliar_checkgroup(L, "udp{any}", 1);
+#ifdef SCHEDULER_YIELD
+    if (udp->yield) return scheduler_yieldcall(L, &receiveop, &udp->tm);
+#endif
+    return tryreceive(L, udp);
+}
+
+static int tryreceive(lua_State *L, p_udp udp) {
     char buf[UDP_DATAGRAMSIZE];
     size_t got, wanted = (size_t) luaL_optnumber(L, 2, sizeof(buf));
     char *dgram = wanted > sizeof(buf)? (char *) malloc(wanted): buf;
     int err;
-    p_timeout tm = &udp->tm;
+    p_timeout tm = iotimeout(udp);
     timeout_markstart(tm);
     if (!dgram) {
         lua_pushnil(L);
@@ -257,11 +338,41 @@ static int meth_receive(lua_State *L) {
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Receives a datagram into a bytes object. Datagrams larger than the
+* requested count are truncated.
+\*-------------------------------------------------------------------------*/
+static int meth_receiveinto(lua_State *L) {
+    p_udp udp = (p_udp) auxiliar_checkgroup(L, "udp{any}", 1);
+    p_bytes bytes = bytes_check(L, 2);
+    size_t got, wanted;
+    size_t start = bytes_checkrange(L, bytes, 3, &wanted);
+    p_timeout tm = iotimeout(udp);
+    int err;
+    timeout_markstart(tm);
+    err = socket_recv(&udp->sock, bytes->data + start, wanted, &got, tm);
+    /* Unlike TCP, recv() of zero is not closed, but a zero-length packet. */
+    if (err != IO_DONE && err != IO_CLOSED) {
+        lua_pushnil(L);
+        lua_pushstring(L, udp_strerror(err));
+        return 2;
+    }
+    lua_pushnumber(L, (lua_Number) got);
+    return 1;
+}
+
 /*-------------------------------------------------------------------------*\
 * Receives data and sender from a UDP socket
 \*-------------------------------------------------------------------------*/
 static int meth_receivefrom(lua_State *L) {
     p_udp udp = (p_udp) auxiliar_checkclass(L, "udp{unconnected}", 1);
+#ifdef SCHEDULER_YIELD
+    if (udp->yield) return scheduler_yieldcall(L, &receivefromop, &udp->tm);
+#endif
+    return tryreceivefrom(L, udp);
+}
+
+static int tryreceivefrom(lua_State *L, p_udp udp) {
     char buf[UDP_DATAGRAMSIZE];
     size_t got, wanted = (size_t) luaL_optnumber(L, 2, sizeof(buf));
     char *dgram = wanted > sizeof(buf)? (char *) malloc(wanted): buf;
@@ -270,7 +381,7 @@ static int meth_receivefrom(lua_State *L) {
     char addrstr[INET6_ADDRSTRLEN];
     char portstr[6];
     int err;
-    p_timeout tm = &udp->tm;
+    p_timeout tm = iotimeout(udp);
     timeout_markstart(tm);
     if (!dgram) {
         lua_pushnil(L);
@@ -380,6 +491,76 @@ static int meth_gettimeout(lua_State *L) {
     return timeout_meth_gettimeout(L, &udp->tm);
 }
 
+static int meth_setdeadline(lua_State *L) {
+    p_udp udp = (p_udp) auxiliar_checkgroup(L, "udp{any}", 1);
+    return timeout_meth_setdeadline(L, &udp->tm);
+}
+
+/*-------------------------------------------------------------------------*\
+* Turns yield mode on or off
+\*-------------------------------------------------------------------------*/
+static int meth_setyield(lua_State *L) {
+    p_udp udp = (p_udp) auxiliar_checkgroup(L, "udp{any}", 1);
+#ifdef SCHEDULER_YIELD
+    udp->yield = lua_toboolean(L, 2);
+    lua_pushnumber(L, 1);
+    return 1;
+#else
+    lua_pushnil(L);
+    lua_pushliteral(L, "yield mode not available");
+    return 2;
+#endif
+}
+
+static int meth_getyield(lua_State *L) {
+    p_udp udp = (p_udp) auxiliar_checkgroup(L, "udp{any}", 1);
+    lua_pushboolean(L, udp->yield);
+    return 1;
+}
+
+/* timeout the I/O waits with, which is zero in yield mode */
+static p_timeout iotimeout(p_udp udp) {
+    return udp->yield? &udp->ztm: &udp->tm;
+}
+
+#ifdef SCHEDULER_YIELD
+/*=========================================================================*\
+* Operations in yield mode. Datagrams are all or nothing, so retries just
+* repeat the call.
+\*=========================================================================*/
+/* the object, which waits for events on its socket */
+static void yieldwait(lua_State *L, p_yieldwait w, int events) {
+    p_udp udp = (p_udp) lua_touserdata(L, 1);
+    w->fd = (int) udp->sock;
+    w->events = events;
+    w->tm = &udp->tm;
+}
+
+static int yield_send(lua_State *L, p_yieldwait w) {
+    int n = trysend(L, (p_udp) lua_touserdata(L, 1));
+    yieldwait(L, w, POLLER_WRITE);
+    return n;
+}
+
+static int yield_sendto(lua_State *L, p_yieldwait w) {
+    int n = trysendto(L, (p_udp) lua_touserdata(L, 1));
+    yieldwait(L, w, POLLER_WRITE);
+    return n;
+}
+
+static int yield_receive(lua_State *L, p_yieldwait w) {
+    int n = tryreceive(L, (p_udp) lua_touserdata(L, 1));
+    yieldwait(L, w, POLLER_READ);
+    return n;
+}
+
+static int yield_receivefrom(lua_State *L, p_yieldwait w) {
+    int n = tryreceivefrom(L, (p_udp) lua_touserdata(L, 1));
+    yieldwait(L, w, POLLER_READ);
+    return n;
+}
+#endif
+
 /*-------------------------------------------------------------------------*\
 * Turns a master udp object into a client object.
 \*-------------------------------------------------------------------------*/
@@ -396,8 +577,9 @@ static int meth_setpeername(lua_State *L) {
     /* make sure we try to connect only to the same family */
     connecthints.ai_family = udp->family;
     if (connecting) {
+        /* datagram sockets connect at once, so there is nothing to race */
         err = inet_tryconnect(&udp->sock, &udp->family, address,
-            port, tm, &connecthints);
+            port, tm, &connecthints, -1);
         if (err) {
             lua_pushnil(L);
             lua_pushstring(L, err);
@@ -462,6 +644,8 @@ static int udp_create(lua_State *L, int family) {
      * replaced with an AF_INET6 or AF_INET socket upon first use. */
     udp->sock = SOCKET_INVALID;
     timeout_init(&udp->tm, -1, -1);
+    timeout_init(&udp->ztm, 0, -1);
+    udp->yield = 0;
     udp->family = family;
     if (family != AF_UNSPEC) {
         const char *err = inet_trycreate(&udp->sock, family, SOCK_DGRAM, 0);
@@ -470,7 +654,6 @@ static int udp_create(lua_State *L, int family) {
             lua_pushstring(L, err);
             return 2;
         }
-        socket_setnonblocking(&udp->sock);
     }
     return 1;
 }
@@ -22,6 +22,8 @@
 typedef struct t_udp_ {
     t_socket sock;
     t_timeout tm;
+    t_timeout ztm;          /* zero timeout used by I/O in yield mode */
+    int yield;              /* whether methods yield instead of waiting */
     int family;
 } t_udp;
 typedef t_udp *p_udp;
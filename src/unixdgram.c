@@ -355,6 +355,7 @@ static int meth_close(lua_State *L)
 {
     p_unix un = (p_unix) auxiliar_checkgroup(L, "unixdgram{any}", 1);
     socket_destroy(&un->sock);
+    buffer_destroy(&un->buf);
     lua_pushnumber(L, 1);
     return 1;
 }
@@ -391,12 +392,11 @@ static int global_create(lua_State *L)
         /* set its type as master object */
         auxiliar_setclass(L, "unixdgram{unconnected}", -1);
         /* initialize remaining structure fields */
-        socket_setnonblocking(&sock);
         un->sock = sock;
-        io_init(&un->io, (p_send) socket_send, (p_recv) socket_recv,
-                (p_error) socket_ioerror, &un->sock);
+        io_init(&un->io, (p_send) socket_send, (p_sendv) socket_sendv,
+                (p_recv) socket_recv, (p_error) socket_ioerror, &un->sock);
         timeout_init(&un->tm, -1, -1);
-        buffer_init(&un->buf, &un->io, &un->tm);
+        buffer_init(L, &un->buf, &un->io, &un->tm);
         return 1;
     } else {
         lua_pushnil(L);
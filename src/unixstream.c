@@ -20,10 +20,20 @@ static int meth_connect(lua_State *L);
 static int meth_listen(lua_State *L);
 static int meth_bind(lua_State *L);
 static int meth_send(lua_State *L);
+static int meth_sendv(lua_State *L);
+static int meth_sendfrom(lua_State *L);
+static int meth_sendframe(lua_State *L);
+static int meth_flush(lua_State *L);
 static int meth_shutdown(lua_State *L);
 static int meth_receive(lua_State *L);
+static int meth_peek(lua_State *L);
+static int meth_receivelines(lua_State *L);
+static int meth_receiveframe(lua_State *L);
+static int meth_receiveframes(lua_State *L);
+static int meth_receiveinto(lua_State *L);
 static int meth_accept(lua_State *L);
 static int meth_close(lua_State *L);
+static int meth_gc(lua_State *L);
 static int meth_setoption(lua_State *L);
 static int meth_settimeout(lua_State *L);
 static int meth_getfd(lua_State *L);
@@ -31,6 +41,10 @@ static int meth_setfd(lua_State *L);
 static int meth_dirty(lua_State *L);
 static int meth_getstats(lua_State *L);
 static int meth_setstats(lua_State *L);
+static int meth_getbuffersize(lua_State *L);
+static int meth_setbuffersize(lua_State *L);
+static int meth_getoutputbuffer(lua_State *L);
+static int meth_setoutputbuffer(lua_State *L);
 static int meth_getsockname(lua_State *L);
 
 static const char *unixstream_tryconnect(p_unix un, const char *path, size_t len);
@@ -38,21 +52,34 @@ static const char *unixstream_trybind(p_unix un, const char *path, size_t len);
 
 /* unixstream object methods */
 static luaL_Reg unixstream_methods[] = {
-    {"__gc",        meth_close},
+    {"__gc",        meth_gc},
     {"__tostring",  auxiliar_tostring},
     {"accept",      meth_accept},
     {"bind",        meth_bind},
     {"close",       meth_close},
     {"connect",     meth_connect},
     {"dirty",       meth_dirty},
+    {"flush",       meth_flush},
+    {"getbuffersize", meth_getbuffersize},
     {"getfd",       meth_getfd},
+    {"getoutputbuffer", meth_getoutputbuffer},
     {"getstats",    meth_getstats},
     {"setstats",    meth_setstats},
     {"listen",      meth_listen},
+    {"peek",        meth_peek},
     {"receive",     meth_receive},
+    {"receiveframe", meth_receiveframe},
+    {"receiveframes", meth_receiveframes},
+    {"receiveinto", meth_receiveinto},
+    {"receivelines", meth_receivelines},
     {"send",        meth_send},
+    {"sendframe",   meth_sendframe},
+    {"sendfrom",    meth_sendfrom},
+    {"sendv",       meth_sendv},
+    {"setbuffersize", meth_setbuffersize},
     {"setfd",       meth_setfd},
     {"setoption",   meth_setoption},
+    {"setoutputbuffer", meth_setoutputbuffer},
     {"setpeername", meth_connect},
     {"setsockname", meth_bind},
     {"getsockname", meth_getsockname},
@@ -105,11 +132,56 @@ static int meth_send(lua_State *L) {
     return buffer_meth_send(L, &un->buf);
 }
 
+static int meth_sendv(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return buffer_meth_sendv(L, &un->buf);
+}
+
+static int meth_sendframe(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return buffer_meth_sendframe(L, &un->buf);
+}
+
+static int meth_sendfrom(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return buffer_meth_sendfrom(L, &un->buf);
+}
+
+static int meth_flush(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return buffer_meth_flush(L, &un->buf);
+}
+
 static int meth_receive(lua_State *L) {
     p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
     return buffer_meth_receive(L, &un->buf);
 }
 
+static int meth_peek(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return buffer_meth_peek(L, &un->buf);
+}
+
+static int meth_receiveframe(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return buffer_meth_receiveframe(L, &un->buf);
+}
+
+static int meth_receiveframes(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return buffer_meth_receiveframes(L, &un->buf);
+}
+
+static int meth_receivelines(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return buffer_meth_receivelines(L, &un->buf);
+}
+
+static int meth_receiveinto(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
+    return buffer_meth_receiveinto(L, &un->buf);
+}
+
 static int meth_getstats(lua_State *L) {
     p_unix un = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
     return buffer_meth_getstats(L, &un->buf);
@@ -120,6 +192,26 @@ static int meth_setstats(lua_State *L) {
     return buffer_meth_setstats(L, &un->buf);
 }
 
+static int meth_getbuffersize(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "unixstream{any}", 1);
+    return buffer_meth_getbuffersize(L, &un->buf);
+}
+
+static int meth_setbuffersize(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "unixstream{any}", 1);
+    return buffer_meth_setbuffersize(L, &un->buf);
+}
+
+static int meth_getoutputbuffer(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "unixstream{any}", 1);
+    return buffer_meth_getoutputbuffer(L, &un->buf);
+}
+
+static int meth_setoutputbuffer(lua_State *L) {
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "unixstream{any}", 1);
+    return buffer_meth_setoutputbuffer(L, &un->buf);
+}
+
 /*-------------------------------------------------------------------------*\
 * Just call option handler
 \*-------------------------------------------------------------------------*/
@@ -164,12 +256,15 @@ static int meth_accept(lua_State *L) {
         p_unix clnt = (p_unix) lua_newuserdata(L, sizeof(t_unix));
         auxiliar_setclass(L, "unixstream{client}", -1);
         /* initialize structure fields */
-        socket_setnonblocking(&sock);
         clnt->sock = sock;
-        io_init(&clnt->io, (p_send)socket_send, (p_recv)socket_recv,
-                (p_error) socket_ioerror, &clnt->sock);
+        io_init(&clnt->io, (p_send) socket_send, (p_sendv) socket_sendv,
+                (p_recv) socket_recv, (p_error) socket_ioerror, &clnt->sock);
         timeout_init(&clnt->tm, -1, -1);
-        buffer_init(&clnt->buf, &clnt->io, &clnt->tm);
+        buffer_init(L, &clnt->buf, &clnt->io, &clnt->tm);
+        /* clients inherit the buffer size settings of the server */
+        clnt->buf.want = server->buf.want;
+        clnt->buf.adaptive = server->buf.adaptive;
+        clnt->buf.outmax = server->buf.outmax;
         return 1;
     } else {
         lua_pushnil(L);
@@ -273,16 +368,32 @@ static int meth_connect(lua_State *L)
 }
 
 /*-------------------------------------------------------------------------*\
-* Closes socket used by object
+* Closes socket used by object, after sending pending output as far as the
+* timeout allows
 \*-------------------------------------------------------------------------*/
 static int meth_close(lua_State *L)
 {
     p_unix un = (p_unix) auxiliar_checkgroup(L, "unixstream{any}", 1);
-    socket_destroy(&un->sock);
+    if (un->buf.outlen > 0) {
+        timeout_markstart(un->buf.tm);
+        buffer_flush(&un->buf);
+    }
+    meth_gc(L);
     lua_pushnumber(L, 1);
     return 1;
 }
 
+/*-------------------------------------------------------------------------*\
+* Closes socket used by a collected object. Pending output is discarded
+\*-------------------------------------------------------------------------*/
+static int meth_gc(lua_State *L)
+{
+    p_unix un = (p_unix) auxiliar_checkgroup(L, "unixstream{any}", 1);
+    socket_destroy(&un->sock);
+    buffer_destroy(&un->buf);
+    return 0;
+}
+
 /*-------------------------------------------------------------------------*\
 * Puts the sockt in listen mode
 \*-------------------------------------------------------------------------*/
@@ -311,6 +422,11 @@ static int meth_shutdown(lua_State *L)
     static const char* methods[] = { "receive", "send", "both", NULL };
     p_unix stream = (p_unix) auxiliar_checkclass(L, "unixstream{client}", 1);
     int how = luaL_checkoption(L, 2, "both", methods);
+    /* pending output would otherwise be lost once sending is shut down */
+    if (how != 0) {
+        timeout_markstart(&stream->tm);
+        buffer_flush(&stream->buf);
+    }
     socket_shutdown(&stream->sock, how);
     lua_pushnumber(L, 1);
     return 1;
@@ -340,12 +456,11 @@ static int global_create(lua_State *L) {
         /* set its type as master object */
         auxiliar_setclass(L, "unixstream{master}", -1);
         /* initialize remaining structure fields */
-        socket_setnonblocking(&sock);
         un->sock = sock;
-        io_init(&un->io, (p_send) socket_send, (p_recv) socket_recv,
-                (p_error) socket_ioerror, &un->sock);
+        io_init(&un->io, (p_send) socket_send, (p_sendv) socket_sendv,
+                (p_recv) socket_recv, (p_error) socket_ioerror, &un->sock);
         timeout_init(&un->tm, -1, -1);
-        buffer_init(&un->buf, &un->io, &un->tm);
+        buffer_init(L, &un->buf, &un->io, &un->tm);
         return 1;
     } else {
         lua_pushnil(L);
@@ -6,6 +6,11 @@
 * The penalty of calling select to avoid busy-wait is only paid when
 * the I/O call fail in the first place.
 \*=========================================================================*/
+/* accept4 is a GNU extension */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "luasocket.h"
 
 #include "socket.h"
@@ -14,6 +19,23 @@
 #include <string.h>
 #include <signal.h>
 
+/* Linux makes sockets non-blocking and close-on-exec in the same call that
+* creates or accepts them, and never blocks in bind */
+#if defined(__linux__) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+#define SOCKET_ATOMIC
+#endif
+
+/* debug builds count the system calls made to set sockets up, and how
+* many of them switch between blocking and non-blocking mode */
+#ifdef LUASOCKET_DEBUG
+static unsigned long setupcalls = 0, switchcalls = 0;
+#define SETUPCALL(call) (setupcalls++, (call))
+#define SWITCHCALL(call) (switchcalls++, SETUPCALL(call))
+#else
+#define SETUPCALL(call) (call)
+#define SWITCHCALL(call) (call)
+#endif
+
 /*-------------------------------------------------------------------------*\
 * Wait for readable/writable/connected socket with timeout
 \*-------------------------------------------------------------------------*/
@@ -31,8 +53,9 @@ int socket_waitfd(p_socket ps, int sw, p_timeout tm) {
     pfd.revents = 0;
     if (timeout_iszero(tm)) return IO_TIMEOUT;  /* optimize timeout == 0 case */
     do {
-        int t = (int)(timeout_getretry(tm)*1e3);
-        ret = poll(&pfd, 1, t >= 0? t: -1);
+        /* round up, or what is left of a timeout would be polled as 0 */
+        double t = timeout_getretry(tm);
+        ret = poll(&pfd, 1, t >= 0? (int)(t*1e3 + 0.999): -1);
     } while (ret == -1 && errno == EINTR);
     if (ret == -1) return errno;
     if (ret == 0) return IO_TIMEOUT;
@@ -121,9 +144,18 @@ int socket_select(t_socket n, fd_set *rfds, fd_set *wfds, fd_set *efds,
 * Creates and sets up a socket
 \*-------------------------------------------------------------------------*/
 int socket_create(p_socket ps, int domain, int type, int protocol) {
-    *ps = socket(domain, type, protocol);
+#ifdef SOCKET_ATOMIC
+    *ps = SETUPCALL(socket(domain, type | SOCK_NONBLOCK | SOCK_CLOEXEC,
+        protocol));
     if (*ps != SOCKET_INVALID) return IO_DONE;
-    else return errno;
+#else
+    *ps = SETUPCALL(socket(domain, type, protocol));
+    if (*ps != SOCKET_INVALID) {
+        socket_setnonblocking(ps);
+        return IO_DONE;
+    }
+#endif
+    return errno;
 }
 
 /*-------------------------------------------------------------------------*\
@@ -131,9 +163,13 @@ int socket_create(p_socket ps, int domain, int type, int protocol) {
 \*-------------------------------------------------------------------------*/
 int socket_bind(p_socket ps, SA *addr, socklen_t len) {
     int err = IO_DONE;
+#ifdef SOCKET_ATOMIC
+    if (SETUPCALL(bind(*ps, addr, len)) < 0) err = errno;
+#else
     socket_setblocking(ps);
-    if (bind(*ps, addr, len) < 0) err = errno;
+    if (SETUPCALL(bind(*ps, addr, len)) < 0) err = errno;
     socket_setnonblocking(ps);
+#endif
     return err;
 }
 
@@ -142,7 +178,7 @@ int socket_bind(p_socket ps, SA *addr, socklen_t len) {
 \*-------------------------------------------------------------------------*/
 int socket_listen(p_socket ps, int backlog) {
     int err = IO_DONE;
-    if (listen(*ps, backlog)) err = errno;
+    if (SETUPCALL(listen(*ps, backlog))) err = errno;
     return err;
 }
 
@@ -176,13 +212,92 @@ int socket_connect(p_socket ps, SA *addr, socklen_t len, p_timeout tm) {
 }
 
 /*-------------------------------------------------------------------------*\
-* Accept with timeout
+* Waits for the first of several connection attempts in progress to
+* complete. Returns IO_TIMEOUT if none did in time. Otherwise sets which
+* to that attempt and returns its outcome, which is IO_DONE if it
+* connected. If the wait itself fails, which is left at -1
+\*-------------------------------------------------------------------------*/
+#ifndef SOCKET_SELECT
+int socket_waitconnect(p_socket ps, int n, p_timeout tm, int *which) {
+    struct pollfd pfds[SOCKET_MAXCONNECTS];
+    int i, ret, err;
+    *which = -1;
+    if (n < 1 || n > SOCKET_MAXCONNECTS) return EINVAL;
+    if (timeout_iszero(tm)) return IO_TIMEOUT;
+    for (i = 0; i < n; i++) {
+        pfds[i].fd = ps[i];
+        pfds[i].events = WAITFD_C;
+        pfds[i].revents = 0;
+    }
+    do {
+        double t = timeout_getretry(tm);
+        ret = poll(pfds, (nfds_t) n, t >= 0? (int)(t*1e3 + 0.999): -1);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) return errno;
+    if (ret == 0) return IO_TIMEOUT;
+    for (i = 0; !pfds[i].revents; i++) ;
+    *which = i;
+    /* as in socket_connect, a failed attempt reports its error on recv */
+    if (!(pfds[i].revents & (POLLIN|POLLERR|POLLHUP))) return IO_DONE;
+    if (recv(ps[i], (char *) &err, 0, 0) == 0) return IO_DONE;
+    return errno;
+}
+#else
+int socket_waitconnect(p_socket ps, int n, p_timeout tm, int *which) {
+    fd_set rfds, wfds;
+    struct timeval tv, *tp;
+    t_socket max = 0;
+    int i, ret, err;
+    double t;
+    *which = -1;
+    if (n < 1 || n > SOCKET_MAXCONNECTS) return EINVAL;
+    for (i = 0; i < n; i++) {
+        if (ps[i] >= FD_SETSIZE) return EINVAL;
+        if (ps[i] > max) max = ps[i];
+    }
+    if (timeout_iszero(tm)) return IO_TIMEOUT;
+    do {
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        for (i = 0; i < n; i++) {
+            FD_SET(ps[i], &rfds);
+            FD_SET(ps[i], &wfds);
+        }
+        t = timeout_getretry(tm);
+        tp = NULL;
+        if (t >= 0.0) {
+            tv.tv_sec = (int)t;
+            tv.tv_usec = (int)((t-tv.tv_sec)*1.0e6);
+            tp = &tv;
+        }
+        ret = select(max+1, &rfds, &wfds, NULL, tp);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) return errno;
+    if (ret == 0) return IO_TIMEOUT;
+    for (i = 0; !FD_ISSET(ps[i], &rfds) && !FD_ISSET(ps[i], &wfds); i++) ;
+    *which = i;
+    if (!FD_ISSET(ps[i], &rfds)) return IO_DONE;
+    if (recv(ps[i], (char *) &err, 0, 0) == 0) return IO_DONE;
+    return errno;
+}
+#endif
+
+/*-------------------------------------------------------------------------*\
+* Accept with timeout. Accepted sockets are non-blocking
 \*-------------------------------------------------------------------------*/
 int socket_accept(p_socket ps, p_socket pa, SA *addr, socklen_t *len, p_timeout tm) {
     if (*ps == SOCKET_INVALID) return IO_CLOSED;
     for ( ;; ) {
         int err;
-        if ((*pa = accept(*ps, addr, len)) != SOCKET_INVALID) return IO_DONE;
+#ifdef SOCKET_ATOMIC
+        *pa = SETUPCALL(accept4(*ps, addr, len, SOCK_NONBLOCK | SOCK_CLOEXEC));
+        if (*pa != SOCKET_INVALID) return IO_DONE;
+#else
+        if ((*pa = SETUPCALL(accept(*ps, addr, len))) != SOCKET_INVALID) {
+            socket_setnonblocking(pa);
+            return IO_DONE;
+        }
+#endif
         err = errno;
         if (err == EINTR) continue;
         if (err != EAGAIN && err != ECONNABORTED) return err;
@@ -226,6 +341,50 @@ int socket_send(p_socket ps, const char *data, size_t count,
     return IO_UNKNOWN;
 }
 
+/*-------------------------------------------------------------------------*\
+* Vectored send with timeout
+\*-------------------------------------------------------------------------*/
+int socket_sendv(p_socket ps, const t_iovec *iov, int iovcnt,
+        size_t *sent, p_timeout tm)
+{
+    struct iovec vec[IO_IOVMAX];
+    struct msghdr msg;
+    int i, err;
+    *sent = 0;
+    /* avoid making system calls on closed sockets */
+    if (*ps == SOCKET_INVALID) return IO_CLOSED;
+    if (iovcnt > IO_IOVMAX) iovcnt = IO_IOVMAX;
+    for (i = 0; i < iovcnt; i++) {
+        vec[i].iov_base = (void *) iov[i].data;
+        vec[i].iov_len = iov[i].count;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = iovcnt;
+    /* loop until we send something or we give up on error */
+    for ( ;; ) {
+        long put = (long) sendmsg(*ps, &msg, 0);
+        /* if we sent anything, we are done */
+        if (put >= 0) {
+            *sent = put;
+            return IO_DONE;
+        }
+        err = errno;
+        /* EPIPE means the connection was closed */
+        if (err == EPIPE) return IO_CLOSED;
+        /* EPROTOTYPE means the connection is being closed (on Yosemite!)*/
+        if (err == EPROTOTYPE) continue;
+        /* we call was interrupted, just try again */
+        if (err == EINTR) continue;
+        /* if failed fatal reason, report error */
+        if (err != EAGAIN) return err;
+        /* wait until we can send something or we timeout */
+        if ((err = socket_waitfd(ps, WAITFD_W, tm)) != IO_DONE) return err;
+    }
+    /* can't reach here */
+    return IO_UNKNOWN;
+}
+
 /*-------------------------------------------------------------------------*\
 * Sendto with timeout
 \*-------------------------------------------------------------------------*/
@@ -335,6 +494,38 @@ int socket_write(p_socket ps, const char *data, size_t count,
     return IO_UNKNOWN;
 }
 
+/*-------------------------------------------------------------------------*\
+* Vectored write with timeout
+* See note for socket_write
+\*-------------------------------------------------------------------------*/
+int socket_writev(p_socket ps, const t_iovec *iov, int iovcnt,
+        size_t *sent, p_timeout tm)
+{
+    struct iovec vec[IO_IOVMAX];
+    int i, err;
+    *sent = 0;
+    if (*ps == SOCKET_INVALID) return IO_CLOSED;
+    if (iovcnt > IO_IOVMAX) iovcnt = IO_IOVMAX;
+    for (i = 0; i < iovcnt; i++) {
+        vec[i].iov_base = (void *) iov[i].data;
+        vec[i].iov_len = iov[i].count;
+    }
+    for ( ;; ) {
+        long put = (long) writev(*ps, vec, iovcnt);
+        if (put >= 0) {
+            *sent = put;
+            return IO_DONE;
+        }
+        err = errno;
+        if (err == EPIPE) return IO_CLOSED;
+        if (err == EPROTOTYPE) continue;
+        if (err == EINTR) continue;
+        if (err != EAGAIN) return err;
+        if ((err = socket_waitfd(ps, WAITFD_W, tm)) != IO_DONE) return err;
+    }
+    return IO_UNKNOWN;
+}
+
 /*-------------------------------------------------------------------------*\
 * Read with timeout
 * See note for socket_write
@@ -362,19 +553,31 @@ int socket_read(p_socket ps, char *data, size_t count, size_t *got, p_timeout tm
 * Put socket into blocking mode
 \*-------------------------------------------------------------------------*/
 void socket_setblocking(p_socket ps) {
-    int flags = fcntl(*ps, F_GETFL, 0);
+    int flags = SWITCHCALL(fcntl(*ps, F_GETFL, 0));
     flags &= (~(O_NONBLOCK));
-    fcntl(*ps, F_SETFL, flags);
+    SWITCHCALL(fcntl(*ps, F_SETFL, flags));
 }
 
 /*-------------------------------------------------------------------------*\
 * Put socket into non-blocking mode
 \*-------------------------------------------------------------------------*/
 void socket_setnonblocking(p_socket ps) {
-    int flags = fcntl(*ps, F_GETFL, 0);
+    int flags = SWITCHCALL(fcntl(*ps, F_GETFL, 0));
     flags |= O_NONBLOCK;
-    fcntl(*ps, F_SETFL, flags);
+    SWITCHCALL(fcntl(*ps, F_SETFL, flags));
+}
+
+#ifdef LUASOCKET_DEBUG
+/*-------------------------------------------------------------------------*\
+* Returns the number of system calls made so far to create, configure,
+* bind, listen on and accept sockets, and stores in switches how many of
+* them switched between blocking and non-blocking mode
+\*-------------------------------------------------------------------------*/
+unsigned long socket_setupcalls(unsigned long *switches) {
+    *switches = switchcalls;
+    return setupcalls;
 }
+#endif
 
 /*-------------------------------------------------------------------------*\
 * DNS helpers
@@ -18,6 +18,8 @@
 #include <sys/types.h>
 /* socket function */
 #include <sys/socket.h>
+/* struct iovec */
+#include <sys/uio.h>
 /* struct timeval */
 #include <sys/time.h>
 /* gethostbyname and gethostbyaddr functions */
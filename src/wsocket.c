@@ -15,6 +15,17 @@
 /* WinSock doesn't have a strerror... */
 static const char *wstrerror(int err);
 
+/* debug builds count the system calls made to set sockets up, and how
+* many of them switch between blocking and non-blocking mode */
+#ifdef LUASOCKET_DEBUG
+static unsigned long setupcalls = 0, switchcalls = 0;
+#define SETUPCALL(call) (setupcalls++, (call))
+#define SWITCHCALL(call) (switchcalls++, SETUPCALL(call))
+#else
+#define SETUPCALL(call) (call)
+#define SWITCHCALL(call) (call)
+#endif
+
 /*-------------------------------------------------------------------------*\
 * Initializes module
 \*-------------------------------------------------------------------------*/
@@ -111,9 +122,11 @@ void socket_shutdown(p_socket ps, int how) {
 * Creates and sets up a socket
 \*-------------------------------------------------------------------------*/
 int socket_create(p_socket ps, int domain, int type, int protocol) {
-    *ps = socket(domain, type, protocol);
-    if (*ps != SOCKET_INVALID) return IO_DONE;
-    else return WSAGetLastError();
+    *ps = SETUPCALL(socket(domain, type, protocol));
+    if (*ps != SOCKET_INVALID) {
+        socket_setnonblocking(ps);
+        return IO_DONE;
+    } else return WSAGetLastError();
 }
 
 /*-------------------------------------------------------------------------*\
@@ -145,13 +158,50 @@ int socket_connect(p_socket ps, SA *addr, socklen_t len, p_timeout tm) {
 
 }
 
+/*-------------------------------------------------------------------------*\
+* Waits for the first of several connection attempts in progress to
+* complete. Returns IO_TIMEOUT if none did in time. Otherwise sets which
+* to that attempt and returns its outcome, which is IO_DONE if it
+* connected. If the wait itself fails, which is left at -1
+\*-------------------------------------------------------------------------*/
+int socket_waitconnect(p_socket ps, int n, p_timeout tm, int *which) {
+    fd_set wfds, efds;
+    struct timeval tv, *tp = NULL;
+    int i, ret, err, elen = sizeof(err);
+    double t;
+    *which = -1;
+    if (n < 1 || n > SOCKET_MAXCONNECTS) return WSAEINVAL;
+    if (timeout_iszero(tm)) return IO_TIMEOUT;
+    FD_ZERO(&wfds);
+    FD_ZERO(&efds);
+    for (i = 0; i < n; i++) {
+        FD_SET(ps[i], &wfds);
+        FD_SET(ps[i], &efds);
+    }
+    if ((t = timeout_get(tm)) >= 0.0) {
+        tv.tv_sec = (int) t;
+        tv.tv_usec = (int) ((t-tv.tv_sec)*1.0e6);
+        tp = &tv;
+    }
+    ret = select(0, NULL, &wfds, &efds, tp);
+    if (ret == -1) return WSAGetLastError();
+    if (ret == 0) return IO_TIMEOUT;
+    for (i = 0; !FD_ISSET(ps[i], &wfds) && !FD_ISSET(ps[i], &efds); i++) ;
+    *which = i;
+    if (!FD_ISSET(ps[i], &efds)) return IO_DONE;
+    /* give windows time to set the error, as in socket_connect */
+    Sleep(10);
+    getsockopt(ps[i], SOL_SOCKET, SO_ERROR, (char *)&err, &elen);
+    return err > 0? err: IO_UNKNOWN;
+}
+
 /*-------------------------------------------------------------------------*\
 * Binds or returns error message
 \*-------------------------------------------------------------------------*/
 int socket_bind(p_socket ps, SA *addr, socklen_t len) {
     int err = IO_DONE;
     socket_setblocking(ps);
-    if (bind(*ps, addr, len) < 0) err = WSAGetLastError();
+    if (SETUPCALL(bind(*ps, addr, len)) < 0) err = WSAGetLastError();
     socket_setnonblocking(ps);
     return err;
 }
@@ -162,13 +212,13 @@ int socket_bind(p_socket ps, SA *addr, socklen_t len) {
 int socket_listen(p_socket ps, int backlog) {
     int err = IO_DONE;
     socket_setblocking(ps);
-    if (listen(*ps, backlog) < 0) err = WSAGetLastError();
+    if (SETUPCALL(listen(*ps, backlog)) < 0) err = WSAGetLastError();
     socket_setnonblocking(ps);
     return err;
 }
 
 /*-------------------------------------------------------------------------*\
-* Accept with timeout
+* Accept with timeout. Accepted sockets are non-blocking
 \*-------------------------------------------------------------------------*/
 int socket_accept(p_socket ps, p_socket pa, SA *addr, socklen_t *len,
         p_timeout tm) {
@@ -176,7 +226,10 @@ int socket_accept(p_socket ps, p_socket pa, SA *addr, socklen_t *len,
     for ( ;; ) {
         int err;
         /* try to get client socket */
-        if ((*pa = accept(*ps, addr, len)) != SOCKET_INVALID) return IO_DONE;
+        if ((*pa = SETUPCALL(accept(*ps, addr, len))) != SOCKET_INVALID) {
+            socket_setnonblocking(pa);
+            return IO_DONE;
+        }
         /* find out why we failed */
         err = WSAGetLastError();
         /* if we failed because there was no connectoin, keep trying */
@@ -217,6 +270,40 @@ int socket_send(p_socket ps, const char *data, size_t count,
     }
 }
 
+/*-------------------------------------------------------------------------*\
+* Vectored send with timeout
+* See note for socket_send: the pieces should not add up to a huge buffer.
+\*-------------------------------------------------------------------------*/
+int socket_sendv(p_socket ps, const t_iovec *iov, int iovcnt,
+        size_t *sent, p_timeout tm)
+{
+    WSABUF vec[IO_IOVMAX];
+    int i, err;
+    *sent = 0;
+    /* avoid making system calls on closed sockets */
+    if (*ps == SOCKET_INVALID) return IO_CLOSED;
+    if (iovcnt > IO_IOVMAX) iovcnt = IO_IOVMAX;
+    for (i = 0; i < iovcnt; i++) {
+        vec[i].buf = (char *) iov[i].data;
+        vec[i].len = (ULONG) iov[i].count;
+    }
+    /* loop until we send something or we give up on error */
+    for ( ;; ) {
+        DWORD put = 0;
+        /* try to send something */
+        if (WSASend(*ps, vec, (DWORD) iovcnt, &put, 0, NULL, NULL) == 0) {
+            *sent = put;
+            return IO_DONE;
+        }
+        /* deal with failure */
+        err = WSAGetLastError();
+        /* we can only proceed if there was no serious error */
+        if (err != WSAEWOULDBLOCK) return err;
+        /* avoid busy wait */
+        if ((err = socket_waitfd(ps, WAITFD_W, tm)) != IO_DONE) return err;
+    }
+}
+
 /*-------------------------------------------------------------------------*\
 * Sendto with timeout
 \*-------------------------------------------------------------------------*/
@@ -303,7 +390,7 @@ int socket_recvfrom(p_socket ps, char *data, size_t count, size_t *got,
 \*-------------------------------------------------------------------------*/
 void socket_setblocking(p_socket ps) {
     u_long argp = 0;
-    ioctlsocket(*ps, FIONBIO, &argp);
+    SWITCHCALL(ioctlsocket(*ps, FIONBIO, &argp));
 }
 
 /*-------------------------------------------------------------------------*\
@@ -311,8 +398,20 @@ void socket_setblocking(p_socket ps) {
 \*-------------------------------------------------------------------------*/
 void socket_setnonblocking(p_socket ps) {
     u_long argp = 1;
-    ioctlsocket(*ps, FIONBIO, &argp);
+    SWITCHCALL(ioctlsocket(*ps, FIONBIO, &argp));
+}
+
+#ifdef LUASOCKET_DEBUG
+/*-------------------------------------------------------------------------*\
+* Returns the number of system calls made so far to create, configure,
+* bind, listen on and accept sockets, and stores in switches how many of
+* them switched between blocking and non-blocking mode
+\*-------------------------------------------------------------------------*/
+unsigned long socket_setupcalls(unsigned long *switches) {
+    *switches = switchcalls;
+    return setupcalls;
 }
+#endif
 
 /*-------------------------------------------------------------------------*\
 * DNS helpers
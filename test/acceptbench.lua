@@ -0,0 +1,62 @@
+-- Connect storm: accept with getpeername against acceptmany.
+-- Each round connects a burst of loopback clients, then times a server
+-- that waits in select and takes the whole burst, learning the address
+-- of each client. Only the server side is timed.
+-- Usage: lua acceptbench.lua [burst] [rounds]
+local socket = require"socket"
+
+local burst = tonumber(arg and arg[1]) or 200
+local rounds = tonumber(arg and arg[2]) or 50
+
+local server = assert(socket.bind("127.0.0.1", 0, 4096))
+local _, port = server:getsockname()
+server:settimeout(0)
+local set = { server }
+
+local function viaaccept(conns)
+    assert(socket.select(set, nil, 1)[1] == server, "missed burst")
+    while true do
+        local c = server:accept()
+        if not c then break end
+        local host, port = c:getpeername()
+        conns[#conns+1] = c
+    end
+end
+
+local function viaacceptmany(conns)
+    assert(socket.select(set, nil, 1)[1] == server, "missed burst")
+    while true do
+        local batch, hosts, ports = server:acceptmany(burst, true)
+        if not batch then break end
+        for i = 1, #batch do conns[#conns+1] = batch[i] end
+    end
+end
+
+local function bench(take)
+    local total = 0
+    for r = 1, rounds do
+        local clients, conns = {}, {}
+        for i = 1, burst do
+            clients[i] = assert(socket.connect("127.0.0.1", port))
+        end
+        local t = socket.monotime()
+        take(conns)
+        total = total + socket.monotime() - t
+        assert(#conns == burst, "lost clients")
+        for i = 1, burst do clients[i]:close() conns[i]:close() end
+    end
+    return burst * rounds / total
+end
+
+-- warm up, then alternate to spread the noise
+bench(viaaccept)
+local a, m = 0, 0
+for i = 1, 3 do
+    a = math.max(a, bench(viaaccept))
+    m = math.max(m, bench(viaacceptmany))
+end
+server:close()
+
+print(string.format("%d rounds of %d clients", rounds, burst))
+print(string.format("accept      %10.0f clients/s", a))
+print(string.format("acceptmany  %10.0f clients/s   %.2fx", m, m / a))
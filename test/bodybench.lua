@@ -0,0 +1,73 @@
+-- Loopback request/response transfer of by-length and until-closed
+-- bodies, as received by http.lua. Reports throughput and, on
+-- LUASOCKET_DEBUG builds, the number of receive calls per body.
+-- The sender runs in the background, in a second interpreter started
+-- with the same command (Unix shells only).
+local socket = require"socket"
+
+if arg[1] == "serve" then
+    local client = assert(socket.connect("127.0.0.1", arg[2]))
+    client:setoption("tcp-nodelay", true)
+    local cache = {}
+    while true do
+        local line = client:receive()
+        if not line then break end
+        local size, close = string.match(line, "(%d+) ?(%a*)")
+        size = tonumber(size)
+        cache[size] = cache[size] or string.rep("x", size)
+        assert(client:send(cache[size]))
+        if close == "close" then break end
+    end
+    client:close()
+    os.exit(0)
+end
+
+local total = tonumber(arg[1]) or 256*1024*1024
+local lua = arg[-1] or "lua"
+local script = arg[0] or "bodybench.lua"
+
+local function serve()
+    local server = assert(socket.bind("127.0.0.1", 0))
+    local _, port = server:getsockname()
+    os.execute(lua .. " " .. script .. " serve " .. port .. " &")
+    local data = assert(server:accept())
+    data:setoption("tcp-nodelay", true)
+    server:close()
+    return data
+end
+
+print(string.format("%d bytes per size", total))
+for _, size in ipairs { 65536, 1048576, 10485760 } do
+    local data = serve()
+    local count = math.max(1, math.floor(total/size))
+    local _, _, _, _, recvs = data:getstats()
+    local t = socket.gettime()
+    for i = 1, count do
+        assert(data:send(size .. "\n"))
+        assert(#assert(data:receive(size)) == size)
+    end
+    t = socket.gettime() - t
+    local _, _, _, _, after = data:getstats()
+    data:send("0 close\n")
+    data:close()
+    print(string.format("%-8s %8d bytes %8.1f MB/s %10s receive calls/body",
+        "length", size, count*size/t/1048576,
+        recvs and string.format("%.0f", (after-recvs)/count) or "n/a"))
+end
+for _, size in ipairs { 1048576, 10485760 } do
+    local count = math.max(1, math.floor(total/size/8))
+    local t, calls = 0, 0
+    for i = 1, count do
+        local data = serve()
+        local start = socket.gettime()
+        assert(data:send(size .. " close\n"))
+        assert(#assert(data:receive("*a")) == size)
+        t = t + socket.gettime() - start
+        local _, _, _, _, recvs = data:getstats()
+        calls = calls + (recvs or 0)
+        data:close()
+    end
+    print(string.format("%-8s %8d bytes %8.1f MB/s %10s receive calls/body",
+        "*a", size, count*size/t/1048576,
+        calls > 0 and string.format("%.0f", calls/count) or "n/a"))
+end
@@ -0,0 +1,44 @@
+-- Loopback bulk transfer with different receive buffer sizes.
+-- Reports throughput and, on LUASOCKET_DEBUG builds, the number of
+-- receive calls made to the transport.
+local socket = require"socket"
+
+local total = tonumber(arg and arg[1]) or 64*1024*1024
+local block = string.rep("x", 256*1024)
+
+local function transfer(size, mode)
+    local server = assert(socket.bind("127.0.0.1", 0))
+    local ip, port = server:getsockname()
+    local client = assert(socket.connect(ip, port))
+    local data = assert(server:accept())
+    server:close()
+    data:setbuffersize(size, mode)
+    client:settimeout(0)
+    local sent, t = 0, socket.gettime()
+    while sent < total do
+        -- send whatever fits in the kernel buffers, then drain all of it
+        local last, err, partial = client:send(block)
+        last = last or partial
+        if last > 0 then
+            assert(data:receive(last))
+            sent = sent + last
+        elseif err ~= "timeout" then error(err) end
+    end
+    t = socket.gettime() - t
+    local _, _, _, _, recvs = data:getstats()
+    client:close()
+    data:close()
+    return t, recvs
+end
+
+print(string.format("%d bytes per transfer", total))
+for _, setting in ipairs {
+    { 8192, "fixed" },
+    { 65536, "fixed" },
+    { 262144, "fixed" },
+    { 8192, "adaptive" }
+} do
+    local t, recvs = transfer(setting[1], setting[2])
+    print(string.format("%8d %-8s %8.1f MB/s %10s receive calls",
+        setting[1], setting[2], total/t/1048576, tostring(recvs or "n/a")))
+end
@@ -0,0 +1,79 @@
+-- Pool warm-up: connecting one at a time against socket.connectmany.
+-- Most backends answer on loopback, but a few never do: their listeners
+-- have a full backlog, so connection requests are dropped. Connecting in
+-- turn waits out the timeout once per unresponsive backend, connectmany
+-- waits for all of them together.
+-- Usage: lua connectbench.lua [backends] [unresponsive] [timeout]
+local socket = require"socket"
+
+local backends = tonumber(arg and arg[1]) or 200
+local unresponsive = tonumber(arg and arg[2]) or 4
+local timeout = tonumber(arg and arg[3]) or 0.2
+
+if not socket.connectmany then
+    print("needs socket.connectmany")
+    return
+end
+
+local server = assert(socket.bind("127.0.0.1", 0, 4096))
+local _, port = server:getsockname()
+server:settimeout(0)
+local targets, dead = {}, {}
+for i = 1, backends do targets[i] = { "127.0.0.1", port } end
+for i = 1, unresponsive do
+    local d = assert(socket.bind("127.0.0.1", 0, 0))
+    local _, dport = d:getsockname()
+    local filler = socket.tcp()
+    filler:settimeout(1)
+    assert(filler:connect("127.0.0.1", dport))
+    dead[#dead+1] = d
+    dead[#dead+1] = filler
+    local at = math.floor(i * backends / (unresponsive + 1))
+    table.insert(targets, at + 1, { "127.0.0.1", dport })
+end
+
+local function inturn()
+    local clients = {}
+    for i, target in ipairs(targets) do
+        local c = socket.tcp()
+        c:settimeout(timeout)
+        clients[i] = c:connect(target[1], target[2]) and c or false
+        if not clients[i] then c:close() end
+    end
+    return clients
+end
+
+local function together()
+    return (socket.connectmany(targets, timeout))
+end
+
+local function bench(connect)
+    local t = socket.monotime()
+    local clients = connect()
+    t = socket.monotime() - t
+    local n = 0
+    for i, c in ipairs(clients) do
+        if c then
+            n = n + 1
+            c:close()
+        end
+    end
+    assert(n == backends, "wrong number of connections")
+    -- drain the accept queue for the next round
+    repeat local c = server:accept() if c then c:close() end until not c
+    return t
+end
+
+bench(together)
+local a, m = math.huge, math.huge
+for i = 1, 3 do
+    a = math.min(a, bench(inturn))
+    m = math.min(m, bench(together))
+end
+for i, o in ipairs(dead) do o:close() end
+server:close()
+
+print(string.format("%d backends, %d unresponsive, %gs timeout", backends,
+    unresponsive, timeout))
+print(string.format("in turn      %8.3f s", a))
+print(string.format("connectmany  %8.3f s   %.2fx", m, a / m))
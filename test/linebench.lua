@@ -0,0 +1,50 @@
+-- Loopback line reception with short and long lines.
+-- Reports lines and megabytes per second for the "*l" receive pattern
+-- and for receivelines.
+local socket = require"socket"
+
+local total = tonumber(arg and arg[1]) or 32*1024*1024
+
+local function transfer(line, batch)
+    local server = assert(socket.bind("127.0.0.1", 0))
+    local ip, port = server:getsockname()
+    local client = assert(socket.connect(ip, port))
+    local data = assert(server:accept())
+    server:close()
+    -- large reads keep the system call overhead out of the measurement
+    data:setbuffersize(1024*1024)
+    client:settimeout(0)
+    local block = string.rep(line, math.max(1, math.floor(65536/#line)))
+    local count = select(2, string.gsub(block, "\n", ""))
+    local sent, lines, t = 0, 0, socket.gettime()
+    while sent < total do
+        assert(client:send(block))
+        if batch then
+            local got = 0
+            while got < count do got = got + #assert(data:receivelines()) end
+        else
+            for i = 1, count do assert(data:receive()) end
+        end
+        sent = sent + #block
+        lines = lines + count
+    end
+    t = socket.gettime() - t
+    client:close()
+    data:close()
+    return t, lines
+end
+
+print(string.format("%d bytes per transfer", total))
+for _, setting in ipairs {
+    { "short lines", string.rep("a", 14) .. "\r\n" },
+    { "header lines", "Content-Type: text/plain; charset=utf-8\r\n" },
+    { "long lines", string.rep("a", 4094) .. "\r\n" },
+    { "long lines, no CR", string.rep("a", 4095) .. "\n" },
+} do
+    for _, batch in ipairs { false, true } do
+        local t, lines = transfer(setting[2], batch)
+        print(string.format("%-18s %-12s %12.0f lines/s %8.1f MB/s",
+            setting[1], batch and "receivelines" or "receive",
+            lines/t, total/t/1048576))
+    end
+end
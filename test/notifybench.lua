@@ -0,0 +1,45 @@
+-- Wakeup cost: a notifier against a pair of loopback udp sockets.
+-- Each wakeup is a signal, a select that finds the object readable, and a
+-- drain. The udp pair sends a datagram and receives it instead.
+-- Usage: lua notifybench.lua [wakeups]
+local socket = require"socket"
+
+local wakeups = tonumber(arg and arg[1]) or 100000
+
+if not socket.notifier then
+    print("needs socket.notifier")
+    return
+end
+
+local function bench(wake, obj, drain)
+    local set = { obj }
+    local t = socket.monotime()
+    for i = 1, wakeups do
+        wake()
+        local r = socket.select(set, nil, 1)
+        assert(r[1] == obj, "missed wakeup")
+        drain()
+    end
+    return (socket.monotime() - t) / wakeups * 1e6
+end
+
+local n = assert(socket.notifier())
+local viaudp
+do
+    local reader = assert(socket.udp())
+    assert(reader:setsockname("127.0.0.1", 0))
+    local writer = assert(socket.udp())
+    assert(writer:setpeername(reader:getsockname()))
+    viaudp = bench(function() writer:send("x") end, reader,
+        function() reader:receive() end)
+    reader:close()
+    writer:close()
+end
+local vianotifier = bench(function() n:signal() end, n,
+    function() n:drain() end)
+n:close()
+
+print(string.format("%d wakeups", wakeups))
+print(string.format("udp pair  %8.2f us", viaudp))
+print(string.format("notifier  %8.2f us   %.2fx", vianotifier,
+    viaudp / vianotifier))
@@ -0,0 +1,73 @@
+-- Wait cost with many idle connections: socket.select against a poller.
+-- One active connection ping-pongs a byte while the others stay idle.
+-- Usage: lua pollbench.lua [rounds [connections...]]
+local socket = require"socket"
+
+local rounds = tonumber(arg and arg[1]) or 2000
+local levels = {}
+for i = 2, (arg and #arg or 0) do levels[#levels+1] = tonumber(arg[i]) end
+if #levels == 0 then levels = { 250, 1000, 10000, 50000 } end
+
+local server = assert(socket.bind("127.0.0.1", 0, 1024))
+local _, port = server:getsockname()
+local clients, conns = {}, {}
+
+-- opens connections until there are n of them, or we run out of descriptors
+local function grow(n)
+    while #conns < n do
+        local client = socket.connect("127.0.0.1", port)
+        if not client then return false end
+        local conn = server:accept()
+        if not conn then client:close() return false end
+        clients[#clients+1] = client
+        conns[#conns+1] = conn
+    end
+    return true
+end
+
+local function roundtrips(wait)
+    local client, conn = clients[1], conns[1]
+    local t = socket.gettime()
+    for i = 1, rounds do
+        client:send("x")
+        local readable = wait()
+        assert(readable[1] == conn, "wrong socket ready")
+        conn:receive(1)
+    end
+    return (socket.gettime() - t) / rounds * 1e6
+end
+
+local function viaselect()
+    if #conns + #clients + 8 > socket._SETSIZE then return nil end
+    return roundtrips(function() return socket.select(conns, nil, 1) end)
+end
+
+local function viapoller()
+    if not socket.poller then return nil end
+    local p = assert(socket.poller())
+    local t = socket.gettime()
+    for _, conn in ipairs(conns) do assert(p:add(conn, "r")) end
+    t = socket.gettime() - t
+    local us = roundtrips(function() return p:wait(1) end)
+    p:close()
+    return us, t
+end
+
+local function show(us)
+    return us and string.format("%9.1f us", us) or "      n/a   "
+end
+
+print(string.format("%d round trips per level", rounds))
+print("  idle conns      select      poller   registration")
+for _, n in ipairs(levels) do
+    if not grow(n) then
+        print(string.format("%9d  stopped at %d connections: raise ulimit -n",
+            n, #conns))
+        break
+    end
+    local s = viaselect()
+    local p, reg = viapoller()
+    print(string.format("%12d %s %s %10.1f ms", n, show(s), show(p),
+        (reg or 0) * 1000))
+end
+for i = 1, #conns do clients[i]:close() conns[i]:close() end
@@ -0,0 +1,111 @@
+-- Echo cost on loopback: a poller against an io_uring ring.
+-- Every client sends a message, then the server side echoes all of them.
+-- The poll path waits on a poller and does a receive and a send per
+-- connection. The ring keeps a persistent receive queued on every
+-- connection and submits the echoes of a whole batch with the next wait.
+-- Only the server side is timed.
+-- Usage: lua ringbench.lua [echoes [connections...]]
+local socket = require"socket"
+
+local echoes = tonumber(arg and arg[1]) or 20000
+local levels = {}
+for i = 2, (arg and #arg or 0) do levels[#levels+1] = tonumber(arg[i]) end
+if #levels == 0 then levels = { 1, 10, 100, 1000 } end
+local msg = string.rep("x", 64)
+
+if not socket.poller or not socket.ring then
+    print("needs socket.poller and socket.ring")
+    return
+end
+local probe, err = socket.ring(1)
+if not probe then
+    print("io_uring not available: " .. err)
+    return
+end
+probe:close()
+
+local server = assert(socket.bind("127.0.0.1", 0, 1024))
+local _, port = server:getsockname()
+local clients, conns = {}, {}
+
+-- opens connections until there are n of them, or we run out of descriptors
+local function grow(n)
+    while #conns < n do
+        local client = socket.connect("127.0.0.1", port)
+        if not client then return false end
+        local conn = server:accept()
+        if not conn then client:close() return false end
+        clients[#clients+1] = client
+        conns[#conns+1] = conn
+    end
+    return true
+end
+
+-- runs rounds of echoes on n connections, timing the server side
+local function run(n, serve)
+    local rounds = math.max(1, echoes // n)
+    local busy = 0
+    for r = 1, rounds do
+        for i = 1, n do assert(clients[i]:send(msg)) end
+        local t = socket.gettime()
+        serve(n)
+        busy = busy + socket.gettime() - t
+        for i = 1, n do assert(clients[i]:receive(#msg) == msg) end
+    end
+    return busy / (rounds * n) * 1e6
+end
+
+local function viapoller(n)
+    local p = assert(socket.poller())
+    for i = 1, n do assert(p:add(conns[i], "r")) end
+    local us = run(n, function(left)
+        while left > 0 do
+            local readable = p:wait(1)
+            for _, conn in ipairs(readable) do
+                conn:send(conn:receive(#msg))
+                left = left - 1
+            end
+        end
+    end)
+    p:close()
+    return us
+end
+
+local function viaring(n)
+    local ring = assert(socket.ring(math.max(n, 256)))
+    local objs, results, errs = {}, {}, {}
+    for i = 1, n do assert(ring:receive(conns[i], true)) end
+    local us = run(n, function(left)
+        local sending = 0
+        while left > 0 or sending > 0 do
+            ring:wait(1, objs, results, errs)
+            for i, obj in ipairs(objs) do
+                local result = results[i]
+                if type(result) == "string" then
+                    assert(ring:send(obj, result))
+                    sending = sending + 1
+                    left = left - 1
+                else
+                    assert(result, "echo failed")
+                    sending = sending - 1
+                end
+            end
+        end
+    end)
+    ring:close()
+    return us
+end
+
+print(string.format("about %d echoes of %d bytes per level", echoes, #msg))
+print("       conns      poller        ring   speedup")
+for _, n in ipairs(levels) do
+    if not grow(n) then
+        print(string.format("%12d  stopped at %d connections: raise ulimit -n",
+            n, #conns))
+        break
+    end
+    local p = viapoller(n)
+    local r = viaring(n)
+    print(string.format("%12d %8.2f us %8.2f us %8.2fx", n, p, r, p / r))
+end
+for i = 1, #conns do clients[i]:close() conns[i]:close() end
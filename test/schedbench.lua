@@ -0,0 +1,166 @@
+-- Echo throughput of servers written with socket.scheduler, waiting
+-- explicitly or with sockets in yield mode, against one written with the
+-- coroutine dispatcher in samples/dispatch.lua. Servers run in a child
+-- process. Clients run here, on a scheduler, each doing round trips of
+-- one line at a time.
+-- Usage: lua schedbench.lua [seconds [connections...]]
+--        lua schedbench.lua serve dispatch|scheduler|yield <port>
+local socket = require"socket"
+
+-- the server reports its port back through a connection to the driver
+local function report(ctlport, server)
+    local ctl = assert(socket.connect("127.0.0.1", ctlport))
+    ctl:send(select(2, server:getsockname()) .. "\n")
+    ctl:close()
+end
+
+local function serve(mode, ctlport)
+    -- answers a line: echoes it, or reports the server's cpu time
+    local function answer(line)
+        if line == "quit" then os.exit(0) end
+        if line == "clock" then return os.clock() .. "\n" end
+        return line .. "\n"
+    end
+    if mode == "scheduler" then
+        local sched = assert(socket.scheduler())
+        local server = assert(socket.bind("127.0.0.1", 0, 1024))
+        server:settimeout(0)
+        report(ctlport, server)
+        sched:spawn(function()
+            while true do
+                local client = server:accept()
+                if client then
+                    client:settimeout(0)
+                    sched:spawn(function()
+                        while true do
+                            local line, err = client:receive()
+                            if line then client:send(answer(line))
+                            elseif err == "timeout" then sched:wait(client, "r")
+                            else client:close() return end
+                        end
+                    end)
+                else sched:wait(server, "r") end
+            end
+        end)
+        sched:run()
+    elseif mode == "yield" then
+        local sched = assert(socket.scheduler())
+        local server = assert(socket.bind("127.0.0.1", 0, 1024))
+        assert(server:setyield(true))
+        report(ctlport, server)
+        sched:spawn(function()
+            while true do
+                local client = assert(server:accept())
+                sched:spawn(function()
+                    while true do
+                        local line = client:receive()
+                        if not line then break end
+                        client:send(answer(line))
+                    end
+                    client:close()
+                end)
+            end
+        end)
+        sched:run()
+    else
+        -- dispatch.lua is written as a Lua 5.1 module
+        local env = setmetatable({ module = function() end }, { __index = _G })
+        local chunk = assert(loadfile("../samples/dispatch.lua", "t", env))
+        if setfenv then setfenv(chunk, env) end
+        chunk()
+        local handler = env.newhandler("coroutine")
+        local server = assert(handler.tcp())
+        assert(server:bind("127.0.0.1", 0))
+        assert(server:listen(1024))
+        report(ctlport, server)
+        handler:start(function()
+            while true do
+                local client = assert(server:accept())
+                handler:start(function()
+                    while true do
+                        local line = client:receive()
+                        if not line then break end
+                        client:send(answer(line))
+                    end
+                    client:close()
+                end)
+            end
+        end)
+        while true do handler:step() end
+    end
+end
+
+-- round trips per second through a server in the given mode, and server
+-- cpu time per round trip
+local function measure(mode, conns, seconds)
+    local lua = arg[-1] or "lua"
+    local ctl = assert(socket.bind("127.0.0.1", 0))
+    ctl:settimeout(10)
+    os.execute(string.format("%s schedbench.lua serve %s %d &", lua, mode,
+        select(2, ctl:getsockname())))
+    local reporter = assert(ctl:accept())
+    local port = assert(tonumber(reporter:receive()), "server failed")
+    reporter:close()
+    ctl:close()
+    local sched = assert(socket.scheduler())
+    local count, connected, stop = 0, 0, false
+    for i = 1, conns do
+        sched:spawn(function()
+            local client = socket.tcp()
+            client:settimeout(0)
+            client:connect("127.0.0.1", port)
+            assert(sched:wait(client, "w"))
+            connected = connected + 1
+            while not stop do
+                client:send("hello\n")
+                local line, err = client:receive()
+                while not line do
+                    assert(err == "timeout", err)
+                    assert(sched:wait(client, "r"))
+                    line, err = client:receive()
+                end
+                count = count + 1
+            end
+            client:close()
+        end)
+    end
+    while connected < conns do sched:step(1) end
+    local control = assert(socket.connect("127.0.0.1", port))
+    local function clock()
+        control:send("clock\n")
+        return tonumber(control:receive())
+    end
+    count = 0
+    local t, c = socket.gettime(), clock()
+    while socket.gettime() - t < seconds do sched:step(0.1) end
+    local rate = count / (socket.gettime() - t)
+    local cost = (clock() - c) / count
+    stop = true
+    sched:run()
+    control:send("quit\n")
+    control:close()
+    return rate, cost
+end
+
+if arg and arg[1] == "serve" then return serve(arg[2], arg[3]) end
+
+local seconds = tonumber(arg and arg[1]) or 3
+local levels = {}
+for i = 2, (arg and #arg or 0) do levels[#levels+1] = tonumber(arg[i]) end
+if #levels == 0 then levels = { 10, 100, 1000 } end
+
+local modes = { "dispatch", "scheduler" }
+if socket.tcp():setyield(true) then modes[3] = "yield" end
+
+print(string.format("echo round trips over %g s, clients and server " ..
+    "sharing the machine", seconds))
+for _, n in ipairs(levels) do
+    local base
+    print(string.format("%d connections", n))
+    for _, mode in ipairs(modes) do
+        local rate, cost = measure(mode, n, seconds)
+        base = base or cost
+        print(string.format("  %-10s %9.0f round trips/s %7.2f us server " ..
+            "cpu each %6.1fx", mode, rate, cost*1e6, base/cost))
+    end
+end
@@ -371,19 +371,425 @@ function test_selectbugs()
     e = pcall(socket.select, {}, 1, 0.1)
     assert(e == false, tostring(e))
     pass("invalid input: ok")
-    local toomany = {}
-    for i = 1, socket._SETSIZE+1 do
-        toomany[#toomany+1] = socket.udp4()
+    -- past FD_SETSIZE on Unix, where select is implemented with poll
+    local many, wanted = {}, math.min(socket._SETSIZE+1, 1100)
+    for i = 1, wanted do
+        local udp = socket.udp4()
+        if not udp then break end
+        many[#many+1] = udp
     end
-    if #toomany > socket._SETSIZE then
-        local e = pcall(socket.select, toomany, nil, 0.1)
+    if #many < wanted then
+        pass("unable to create enough sockets (max was "..#many..")")
+        pass("try using ulimit")
+    elseif #many > socket._SETSIZE then
+        local e = pcall(socket.select, many, nil, 0.1)
         assert(e == false, tostring(e))
-        pass("too many sockets (" .. #toomany .. "): ok")
+        pass("too many sockets (" .. #many .. "): ok")
     else
-        pass("unable to create enough sockets (max was "..#toomany..")")
-        pass("try using ulimit")
+        r, s, e = socket.select(nil, many, 1)
+        assert(#s == #many and s[many[#many]] == #many,
+            "failed on large set")
+        pass("large set (" .. #many .. "): ok")
+    end
+    for _, c in ipairs(many) do c:close() end
+    -- result tables supplied by the caller are cleared and reused
+    local udp = socket.udp4()
+    local rt, wt = { "stale", stale = true }, {}
+    r, s, e = socket.select({ udp }, { udp }, 1, rt, wt)
+    assert(r == rt and s == wt and #r == 0 and r.stale == nil and
+        s[1] == udp and s[udp] == 1, "failed on reused tables")
+    pass("reused result tables: ok")
+    -- timeouts under a millisecond still wait
+    local t = socket.monotime()
+    r, s, e = socket.select({ udp }, nil, 0.0005)
+    t = socket.monotime() - t
+    assert(#r == 0 and e == "timeout" and t >= 0.0005,
+        string.format("returned early (%gs)", t))
+    pass("short timeout: ok")
+    udp:close()
+end
+
+------------------------------------------------------------------------
+function test_poller()
+    if not socket.poller then
+        pass("not available")
+        return
+    end
+    reconnect()
+    local p = assert(socket.poller())
+    assert(p:add(data, "r"))
+    local r, w, e = p:wait(0.1)
+    assert(#r == 0 and #w == 0 and e == "timeout", "failed on timeout")
+    pass("timeout: ok")
+    remote [[
+        data:send("ready\n")
+    ]]
+    r, w = p:wait(5)
+    assert(r[1] == data and #w == 0, "failed on readable")
+    assert(data:receive() == "ready")
+    assert(p:modify(data, "w"))
+    r, w = p:wait(5)
+    assert(#r == 0 and w[1] == data, "failed on writable")
+    pass("events: ok")
+    r, e = p:add(data)
+    assert(not r and e == "already registered", "registered twice")
+    assert(p:remove(data))
+    r, e = p:remove(data)
+    assert(not r and e == "not registered", "removed twice")
+    -- objects closed while registered can still be removed
+    local server = assert(socket.bind("127.0.0.1", 0))
+    assert(p:add(server))
+    server:close()
+    assert(p:remove(server), "failed on closed object")
+    assert(not pcall(p.add, p, data, "x"), "accepted invalid events")
+    pass("registration: ok")
+    p:close()
+    assert(not pcall(p.wait, p, 0), "waited after close")
+end
+
+------------------------------------------------------------------------
+function test_notifier()
+    if not socket.notifier then
+        pass("not available")
+        return
+    end
+    local n = assert(socket.notifier())
+    assert(n:getfd() >= 0 and not n:dirty(), "failed on creation")
+    assert(n:drain() == 0, "signalled on creation")
+    local r, w, e = socket.select({n}, nil, 0)
+    assert(#r == 0 and e == "timeout", "readable on creation")
+    -- signals coalesce until the next drain
+    for i = 1, 3 do assert(n:signal()) end
+    r = socket.select({n}, nil, 0)
+    assert(r[1] == n, "failed on select")
+    assert(n:drain() == 3, "failed on drain")
+    r, w, e = socket.select({n}, nil, 0)
+    assert(#r == 0 and e == "timeout", "readable after drain")
+    pass("select: ok")
+    if socket.poller then
+        local p = assert(socket.poller())
+        assert(p:add(n))
+        r, w, e = p:wait(0)
+        assert(#r == 0 and e == "timeout", "failed on timeout")
+        n:signal()
+        r = p:wait(5)
+        assert(r[1] == n and n:drain() == 1, "failed on poller")
+        p:close()
+        pass("poller: ok")
+    end
+    -- another state can wrap the descriptor, without owning it
+    local m = socket.notifier(n:getfd())
+    if m then
+        m:signal()
+        m:close()
+        assert(n:drain() == 1, "failed on shared descriptor")
+        assert(n:signal(), "shared descriptor was closed")
+        assert(n:drain() == 1)
+        pass("sharing: ok")
+    end
+    n:close()
+    assert(n:getfd() == -1, "open after close")
+    assert(not pcall(n.signal, n), "signalled after close")
+end
+
+------------------------------------------------------------------------
+function test_scheduler()
+    if not socket.scheduler then
+        pass("not available")
+        return
+    end
+    local sched = assert(socket.scheduler())
+    local server = assert(socket.bind("127.0.0.1", 0))
+    local port = select(2, server:getsockname())
+    server:settimeout(0)
+    local echoed = {}
+    sched:spawn(function()
+        for i = 1, 2 do
+            local peer = server:accept()
+            while not peer do
+                assert(sched:wait(server, "r"))
+                peer = server:accept()
+            end
+            peer:settimeout(0)
+            sched:spawn(function()
+                while true do
+                    local line, err = peer:receive()
+                    if line then peer:send(line .. "\n")
+                    elseif err == "timeout" then assert(sched:wait(peer, "r"))
+                    else return peer:close() end
+                end
+            end)
+        end
+    end)
+    for i = 1, 2 do
+        sched:spawn(function(id)
+            local c = socket.tcp()
+            c:settimeout(0)
+            c:connect("127.0.0.1", port)
+            assert(sched:wait(c, "w"))
+            for j = 1, 10 do
+                c:send(id .. "\n")
+                local line, err = c:receive()
+                while not line do
+                    assert(err == "timeout", err)
+                    assert(sched:wait(c, "r"))
+                    line, err = c:receive()
+                end
+                echoed[#echoed+1] = line
+            end
+            c:close()
+        end, i)
+    end
+    assert(sched:run() == 1, "failed to run")
+    assert(#echoed == 20, "lost round trips")
+    pass("wait: ok")
+    local r, e
+    sched:spawn(function()
+        local t = socket.gettime()
+        sched:sleep(0.1)
+        r = socket.gettime() - t
+        local c = socket.udp()
+        c:settimeout(0)
+        c:setsockname("127.0.0.1", 0)
+        e = select(2, sched:wait(c, "r", 0.1))
+        c:close()
+    end)
+    sched:run()
+    assert(r >= 0.09 and r < 1, "failed on sleep")
+    assert(e == "timeout", "failed on wait timeout")
+    pass("sleep and timeout: ok")
+    local count = 0
+    sched:spawn(function()
+        coroutine.yield()
+        count = count + 1
+        error("oops")
+    end)
+    assert(sched:step(0) == 1 and count == 0, "failed on yield")
+    r, e = pcall(sched.step, sched, 0)
+    assert(not r and string.find(e, "oops") and count == 1, "error lost")
+    assert(sched:step(0) == 0, "failed task still alive")
+    r, e = pcall(sched.sleep, sched, 0.1)
+    assert(not r and string.find(e, "not called from a task"),
+        "waited outside a task")
+    pass("tasks: ok")
+    server:close()
+end
+
+------------------------------------------------------------------------
+function test_yield()
+    if not socket.scheduler or not socket.tcp():setyield(true) then
+        pass("not available")
+        return
     end
-    for _, c in ipairs(toomany) do c:close() end
+    local sched = assert(socket.scheduler())
+    local server = assert(socket.bind("127.0.0.1", 0))
+    local port = select(2, server:getsockname())
+    assert(server:setyield(true) and server:getyield())
+    local got = {}
+    sched:spawn(function()
+        local peer = assert(server:accept())
+        assert(peer:getyield(), "yield mode not inherited")
+        peer:settimeout(0.5)
+        got.line = peer:receive()
+        got.block = peer:receive(10)
+        got.a, got.b, got.c = peer:receive(10)
+        peer:settimeout(5)
+        got.rest = peer:receive("*a")
+        peer:close()
+    end)
+    sched:spawn(function()
+        local c = socket.tcp()
+        assert(c:setyield(true))
+        assert(c:connect("127.0.0.1", port))
+        assert(c:send("hello\r\n12345") == 12)
+        sched:sleep(0.1)
+        assert(c:send("67890abcd"))
+        sched:sleep(0.6)
+        assert(c:send(string.rep("x", 1000000) .. "end"))
+        c:close()
+    end)
+    sched:run()
+    assert(got.line == "hello", "failed on line")
+    assert(got.block == "1234567890", "failed on partial receive")
+    assert(not got.a and got.b == "timeout" and got.c == "abcd",
+        "failed on timeout")
+    assert(#got.rest == 1000003, "failed on large receive")
+    pass("tcp: ok")
+    sched:spawn(function()
+        local peer = assert(server:accept())
+        peer:settimeout(0.2)
+        got.a, got.b, got.c = peer:receive(20, ">")
+        peer:settimeout(5)
+        got.all = {peer:receive("*a")}
+        peer:close()
+    end)
+    sched:spawn(function()
+        local c = socket.tcp()
+        assert(c:setyield(true))
+        assert(c:connect("127.0.0.1", port))
+        assert(c:send("ab"))
+        sched:sleep(0.05)
+        assert(c:send("cd"))
+        sched:sleep(0.3)
+        assert(c:send("hello"))
+        sched:sleep(0.1)
+        assert(c:send(" world"))
+        sched:sleep(0.1)
+        c:close()
+    end)
+    sched:run()
+    assert(not got.a and got.b == "timeout" and got.c == ">abcd",
+        "failed on timeout after parking")
+    assert(got.all[1] == "hello world" and not got.all[2],
+        "failed on close after parking")
+    pass("close after pause: ok")
+    local a = socket.udp()
+    assert(a:setsockname("127.0.0.1", 0))
+    assert(a:setyield(true))
+    local b = socket.udp()
+    assert(b:setyield(true))
+    local t = socket.gettime()
+    local r, e = a:receive()
+    assert(not r and e == "timeout" and socket.gettime() - t < 1,
+        "waited outside a task")
+    local ip, p = a:getsockname()
+    sched:spawn(function()
+        got.dgram, got.ip = a:receivefrom()
+    end)
+    sched:spawn(function()
+        sched:sleep(0.05)
+        assert(b:sendto("ping", ip, p))
+    end)
+    sched:run()
+    assert(got.dgram == "ping" and got.ip == "127.0.0.1", "failed on udp")
+    a:close()
+    b:close()
+    pass("udp: ok")
+    server:close()
+end
+
+------------------------------------------------------------------------
+function test_ring()
+    local ring = socket.ring and socket.ring(16, 4, 64)
+    if not ring then
+        pass("not available")
+        return
+    end
+    local server = assert(socket.bind("127.0.0.1", 0))
+    local port = select(2, server:getsockname())
+    assert(ring:accept(server))
+    local c = assert(socket.connect("127.0.0.1", port))
+    local objs, results, errs = ring:wait(5)
+    assert(objs[1] == server and errs[1] == false, "failed on accept")
+    local peer, e = results[1], nil
+    objs, results, errs, e = ring:wait(0.1)
+    assert(#objs == 0 and e == "timeout", "failed on timeout")
+    pass("accept and timeout: ok")
+    assert(ring:receive(peer))
+    assert(ring:send(peer, "xhello worldx", 2, -2))
+    assert(c:send("ping"))
+    local got, sent = {}, nil
+    for i = 1, 2 do
+        objs, results, errs = ring:wait(5)
+        for j = 1, #objs do
+            assert(objs[j] == peer and not errs[j], errs[j])
+            if type(results[j]) == "string" then got[#got+1] = results[j]
+            else sent = results[j] end
+        end
+        if got[1] and sent then break end
+    end
+    assert(got[1] == "ping" and sent == 12, "failed on batch")
+    assert(c:receive(11) == "hello world", "failed on send")
+    -- larger than a buffer, so it takes several receives
+    local blob = string.rep("x", 150)
+    assert(c:send(blob))
+    got = {}
+    while #table.concat(got) < #blob do
+        assert(ring:receive(peer))
+        objs, results, errs = ring:wait(5)
+        assert(not errs[1], errs[1])
+        got[#got+1] = results[1]
+    end
+    assert(table.concat(got) == blob and #got[1] <= 64, "failed on buffers")
+    pass("receive and send: ok")
+    -- one persistent receive completes once per message, in reused tables
+    local o, r, x = objs, results, errs
+    assert(ring:receive(peer, true))
+    for i = 1, 3 do
+        assert(c:send("msg" .. i))
+        objs, results, errs = ring:wait(5, o, r, x)
+        assert(objs == o and results == r and errs == x, "tables not reused")
+        assert(#objs == 1 and results[1] == "msg" .. i, "failed on persist")
+    end
+    pass("persistent receive: ok")
+    assert(ring:receive(peer))
+    assert(ring:cancel(peer))
+    objs, results, errs = ring:wait(5)
+    assert(objs[1] == peer and errs[1] == "cancelled", "failed on cancel")
+    assert(ring:receive(peer))
+    c:close()
+    objs, results, errs = ring:wait(5)
+    assert(results[1] == false and errs[1] == "closed", "failed on close")
+    pass("cancel and close: ok")
+    ring:close()
+    assert(not pcall(ring.wait, ring, 0), "waited after close")
+    -- the driver waits through the ring of the Lua state
+    c = socket.tcp()
+    assert(c:setdriver("uring") and c:getdriver() == "uring")
+    assert(c:connect("127.0.0.1", port))
+    peer = server:accept()
+    c:settimeout(0.2)
+    local t = socket.gettime()
+    local r
+    r, e = c:receive()
+    assert(not r and e == "timeout" and socket.gettime() - t < 1,
+        "failed on driver timeout")
+    assert(peer:send("one\ntwo\n"))
+    assert(c:receive() == "one" and c:receive() == "two", "failed on driver")
+    assert(c:send(string.rep("y", 100000)) == 100000)
+    assert(#peer:receive(100000) == 100000, "failed on driver send")
+    assert(c:setdriver("socket") and c:getdriver() == "socket")
+    c:close()
+    peer:close()
+    server:close()
+    pass("driver: ok")
+end
+
+------------------------------------------------------------------------
+function test_timers()
+    local w = socket.timers(0.01)
+    assert(w:next() == nil, "next on empty wheel")
+    local now, order = socket.monotime(), {}
+    local a = w:schedule(0.05, function(id) order[#order+1] = "a" end)
+    local b = w:schedule(2, function(id) order[#order+1] = "b" end)
+    local c = w:schedule(600, function(id) order[#order+1] = "c" end)
+    local d = w:schedule(0.05, function(id) order[#order+1] = "d" end)
+    assert(w:next(now) <= 0.06, "next too late")
+    assert(w:expire(now) == 0, "fired early")
+    assert(w:expire(now + 0.1) == 2 and order[1] == "a" and order[2] == "d",
+        "failed on batch")
+    assert(not w:cancel(a), "cancelled fired timer")
+    local nx = w:next(now + 0.1)
+    assert(nx > 1 and nx <= 1.91, "wrong next")
+    pass("schedule and expire: ok")
+    assert(w:cancel(b) == 1, "failed to cancel")
+    assert(not w:cancel(b), "cancelled twice")
+    assert(w:expire(now + 10) == 0, "fired cancelled timer")
+    assert(w:expire(now + 700) == 1 and order[3] == "c", "failed on far timer")
+    assert(w:next() == nil and #order == 3)
+    pass("cancel: ok")
+    -- callbacks can reschedule, and errors leave the rest of the batch due
+    local fired = 0
+    w:schedule(0, function() fired = fired + 1 error("oops") end)
+    w:schedule(0, function() fired = fired + 1
+        w:schedule(0, function() fired = fired + 1 end)
+    end)
+    assert(not pcall(w.expire, w, now + 800), "error lost")
+    assert(fired == 1 and w:next() == 0, "batch lost")
+    assert(w:expire(now + 800) == 1 and fired == 2, "failed on batch")
+    -- timers scheduled by callbacks fire on a later call
+    assert(w:expire(now + 800.1) == 1 and fired == 3, "failed on reschedule")
+    pass("callbacks: ok")
 end
 
 ------------------------------------------------------------------------
@@ -438,6 +844,52 @@ function accept_errors()
     pass("ok")
 end
 
+------------------------------------------------------------------------
+function acceptmany_test()
+    printf("batches: ")
+    local server = assert(socket.bind("127.0.0.1", 0, 32))
+    local _, port = server:getsockname()
+    server:settimeout(0.1)
+    local r, e = server:acceptmany()
+    assert(not r and e == "timeout", "should time out")
+    local clients = {}
+    for i = 1, 5 do clients[i] = assert(socket.connect("127.0.0.1", port)) end
+    local conns, hosts, ports = server:acceptmany(3, true)
+    assert(#conns == 3 and #hosts == 3 and #ports == 3, "wrong batch size")
+    for i = 1, 3 do
+        assert(string.find(tostring(conns[i]), "tcp{client}"), "not a client")
+        local ip, p = conns[i]:getpeername()
+        assert(hosts[i] == ip and ports[i] == p, "wrong peer address")
+    end
+    -- clients already waiting are taken without another wait
+    local t = socket.gettime()
+    local rest, more = server:acceptmany()
+    assert(#rest == 2 and more == nil, "wrong remainder")
+    assert(socket.gettime() - t < 0.05, "waited for more clients")
+    assert(rest[1]:send("ping\n") and clients[4]:receive() == "ping",
+        "unusable client")
+    assert(not pcall(server.acceptmany, server, 0), "accepted invalid max")
+    pass("ok")
+    printf("yield mode: ")
+    if server:setyield(true) and socket.scheduler then
+        local sched = assert(socket.scheduler())
+        local got
+        sched:spawn(function() got = server:acceptmany() end)
+        sched:spawn(function()
+            sched:sleep(0.05)
+            clients[6] = assert(socket.connect("127.0.0.1", port))
+        end)
+        sched:run()
+        assert(got and #got == 1, "failed in yield mode")
+        got[1]:close()
+        pass("ok")
+    else pass("not available") end
+    for i, c in ipairs(clients) do c:close() end
+    for i, c in ipairs(conns) do c:close() end
+    for i, c in ipairs(rest) do c:close() end
+    server:close()
+end
+
 ------------------------------------------------------------------------
 function connect_errors()
     printf("connection refused: ")
@@ -450,6 +902,132 @@ function connect_errors()
     pass("ok")
 end
 
+------------------------------------------------------------------------
+function happy_eyeballs_test()
+    printf("racing families: ")
+    local found = socket.dns.getaddrinfo("localhost") or {}
+    local loopback = { inet = "127.0.0.1", inet6 = "::1" }
+    local first, other = found[1] and found[1].family
+    for i, a in ipairs(found) do
+        if a.family ~= first then other = a.family end
+    end
+    if not other then
+        pass("needs localhost on inet and inet6")
+        return
+    end
+    -- once its backlog is full, a listener drops connection requests, just
+    -- like a filtered address. the preferred family gets one of those
+    local dead = assert(socket.bind(loopback[first], 0, 0))
+    local _, port = dead:getsockname()
+    local live = assert(socket.bind(loopback[other], port))
+    local filler = socket.tcp()
+    filler:settimeout(1)
+    assert(filler:connect(loopback[first], port, -1))
+    local t = socket.monotime()
+    local c = assert(socket.connect("localhost", port, nil, nil, nil, 0.05))
+    t = socket.monotime() - t
+    assert(c:getfamily() == (other == "inet" and "inet4" or "inet6"),
+        "wrong family won")
+    assert(t < 0.25, string.format("took too long (%gs)", t))
+    c:close()
+    c = socket.tcp()
+    c:settimeout(5)
+    t = socket.monotime()
+    assert(c:connect("localhost", port, 0.05))
+    t = socket.monotime() - t
+    assert(t < 0.25, string.format("method took too long (%gs)", t))
+    c:close()
+    -- the family that comes with getsockname is not taken for a delay
+    c = socket.tcp()
+    assert(c:connect(live:getsockname()), "rejected getsockname results")
+    c:close()
+    -- without a race, the dead address holds everything up
+    c = socket.tcp()
+    c:settimeout(0.2)
+    t = socket.monotime()
+    assert(c:connect("localhost", port, -1))
+    assert(socket.monotime() - t >= 0.15, "did not try in order")
+    c:close()
+    pass("ok")
+    printf("shared timeout: ")
+    live:close()
+    live = assert(socket.bind(loopback[other], port, 0))
+    local filler2 = socket.tcp()
+    filler2:settimeout(1)
+    assert(filler2:connect(loopback[other], port, -1))
+    c = socket.tcp()
+    c:settimeout(0.3)
+    t = socket.monotime()
+    local r, e = c:connect("localhost", port, 0.05)
+    t = socket.monotime() - t
+    assert(not r and e == "timeout", "should time out")
+    assert(t < 0.5, string.format("took too long to give up (%gs)", t))
+    c:close()
+    pass("ok")
+    printf("all refused: ")
+    filler:close()
+    filler2:close()
+    dead:close()
+    live:close()
+    r, e = socket.connect("localhost", port)
+    assert(not r and e, "should fail")
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function connectmany_test()
+    printf("many targets: ")
+    if not socket.connectmany then
+        pass("not available")
+        return
+    end
+    local server = assert(socket.bind("127.0.0.1", 0, 64))
+    local _, port = server:getsockname()
+    -- listeners with a full backlog drop connection requests
+    local dead, fillers, deadports = {}, {}, {}
+    for i = 1, 2 do
+        dead[i] = assert(socket.bind("127.0.0.1", 0, 0))
+        deadports[i] = select(2, dead[i]:getsockname())
+        fillers[i] = socket.tcp()
+        fillers[i]:settimeout(1)
+        assert(fillers[i]:connect("127.0.0.1", deadports[i]))
+    end
+    local refused = assert(socket.bind("127.0.0.1", 0))
+    local refport = select(2, refused:getsockname())
+    refused:close()
+    local targets = {}
+    for i = 1, 5 do targets[i] = { "127.0.0.1", port } end
+    targets[6] = { "127.0.0.1", refport }
+    targets[7] = { "127.0.0.1", deadports[1] }
+    targets[8] = { "127.0.0.1", tostring(deadports[2]) }
+    local t = socket.monotime()
+    local clients, errors = socket.connectmany(targets, 0.3)
+    t = socket.monotime() - t
+    -- the unresponsive targets are waited for together, not in turn
+    assert(t >= 0.25 and t < 0.55, string.format("wrong duration (%gs)", t))
+    assert(#clients == 8, "wrong number of results")
+    for i = 1, 5 do
+        assert(clients[i] and not errors[i], "failed to connect")
+        assert(select(2, clients[i]:getpeername()) == port, "wrong peer")
+    end
+    assert(clients[6] == false and errors[6] == "connection refused",
+        "wrong refused error")
+    assert(clients[7] == false and errors[7] == "timeout", "wrong timeout")
+    assert(clients[8] == false and errors[8] == "timeout", "wrong timeout")
+    local peer = assert(server:accept())
+    assert(clients[1]:send("ping\n"))
+    assert(peer:receive() == "ping", "unusable client")
+    peer:close()
+    for i = 1, 5 do clients[i]:close() end
+    for i = 1, 2 do fillers[i]:close() dead[i]:close() end
+    server:close()
+    clients, errors = socket.connectmany({})
+    assert(#clients == 0 and next(errors) == nil, "failed on no targets")
+    assert(not pcall(socket.connectmany, {{"127.0.0.1"}}),
+        "accepted invalid target")
+    pass("ok")
+end
+
 ------------------------------------------------------------------------
 function rebind_test()
    local c ,c1 = socket.bind("127.0.0.1", 0)
@@ -465,6 +1043,133 @@ function rebind_test()
     pass("ok")
 end
 
+------------------------------------------------------------------------
+function setupcalls_test()
+    if not socket._setupcalls then
+        pass("needs a debug build")
+        return
+    end
+    -- returns the calls and the switching calls made since the last one
+    local calls, switches = 0, 0
+    local function count(n)
+        local c, s = socket._setupcalls()
+        c, s, calls, switches = c - calls, s - switches, c, s
+        return (c - s) / n, s / n
+    end
+    local n = 20
+    count(1)
+    local server = assert(socket.bind("127.0.0.1", 0, n))
+    local _, port = server:getsockname()
+    local bind, bindswitch = count(1)
+    local clients, conns = {}, {}
+    for i = 1, n do clients[i] = assert(socket.connect("127.0.0.1", port)) end
+    local connect, connectswitch = count(n)
+    for i = 1, n do conns[i] = assert(server:accept()) end
+    local accept, acceptswitch = count(n)
+    for i = 1, n do clients[i]:close() conns[i]:close() end
+    server:close()
+    -- where sockets are created and accepted non-blocking, nothing else
+    -- is needed. elsewhere, each is switched to non-blocking mode once,
+    -- and bind at least leaves and goes back to non-blocking mode too,
+    -- whatever a switch costs on the platform
+    local atomic = acceptswitch == 0
+    pass("%d calls to bind, %g to connect and %g to accept, " ..
+        "besides %g, %g and %g to switch modes", bind, connect, accept,
+        bindswitch, connectswitch, acceptswitch)
+    assert(accept == 1, "wrong accept count")
+    assert(connect == 1, "wrong connect count")
+    assert(bind == 3, "wrong bind count")
+    if atomic then
+        assert(connectswitch == 0 and bindswitch == 0, "switched modes")
+    else
+        assert(acceptswitch > 0 and connectswitch == acceptswitch,
+            "wrong switch count")
+        assert(bindswitch >= 3*acceptswitch, "wrong bind switch count")
+    end
+end
+
+------------------------------------------------------------------------
+function monotime_test()
+    local t = socket.monotime()
+    assert(socket.monotime() >= t, "went back")
+    socket.sleep(0.1)
+    t = socket.monotime() - t
+    assert(t >= 0.09 and t < 1, "wrong interval")
+    -- timeouts are measured with it
+    local server = assert(socket.bind("127.0.0.1", 0))
+    server:settimeout(0.2)
+    t = socket.monotime()
+    local c, e = server:accept()
+    t = socket.monotime() - t
+    assert(not c and e == "timeout" and t >= 0.19 and t < 1,
+        "wrong timeout")
+    server:close()
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+-- times a call, returning its elapsed time followed by two results
+local function timed(f, ...)
+    local t = socket.monotime()
+    local r, e = f(...)
+    return socket.monotime() - t, r, e
+end
+
+function deadline_test()
+    local server = assert(socket.bind("127.0.0.1", 0))
+    local _, port = server:getsockname()
+    local c = assert(socket.connect("127.0.0.1", port))
+    local s = assert(server:accept())
+    -- the deadline spans calls, cutting the block timeout of the last
+    c:settimeout(0.2)
+    assert(c:setdeadline(socket.monotime() + 0.3) == 1)
+    local t, r, e = timed(c.receive, c)
+    assert(not r and e == "timeout" and t >= 0.19 and t < 0.29,
+        "first receive")
+    t, r, e = timed(c.receive, c)
+    assert(not r and e == "timeout" and t >= 0.05 and t < 0.19,
+        "second receive")
+    t, r, e = timed(c.receive, c)
+    assert(not r and e == "timeout" and t < 0.05, "expired deadline")
+    -- data already there is still delivered
+    s:send("ready\n")
+    assert(c:receive() == "ready", "data lost")
+    -- it bounds calls without a timeout, and nil removes it
+    c:settimeout(-1)
+    c:setdeadline(socket.monotime() + 0.1)
+    t, r, e = timed(c.receive, c)
+    assert(not r and e == "timeout" and t >= 0.09 and t < 0.5,
+        "infinite timeout")
+    c:setdeadline(nil)
+    c:settimeout(0.1)
+    t, r, e = timed(c.receive, c)
+    assert(not r and e == "timeout" and t >= 0.09, "deadline not removed")
+    c:close() s:close()
+    local u = assert(socket.udp())
+    assert(u:setsockname("127.0.0.1", 0))
+    u:setdeadline(socket.monotime() + 0.1)
+    t, r, e = timed(u.receive, u)
+    assert(not r and e == "timeout" and t >= 0.09 and t < 0.5, "udp")
+    u:close()
+    -- protocols take a deadline for the whole exchange. the server
+    -- accepts connections but never says a word
+    local ltn12, http = require"ltn12", require"socket.http"
+    local smtp, ftp = require"socket.smtp", require"socket.ftp"
+    t, r, e = timed(http.request, { url = "http://127.0.0.1:" .. port .. "/",
+        deadline = socket.monotime() + 0.2 })
+    assert(not r and e == "timeout" and t >= 0.19 and t < 1, "http")
+    t, r, e = timed(smtp.send, { server = "127.0.0.1", port = port,
+        from = "<a@b>", rcpt = "<c@d>", source = ltn12.source.empty(),
+        deadline = socket.monotime() + 0.2 })
+    assert(not r and e == "timeout" and t >= 0.19 and t < 1, "smtp")
+    t, r, e = timed(ftp.get, { host = "127.0.0.1", port = port,
+        path = "/", sink = ltn12.sink.null(),
+        deadline = socket.monotime() + 0.2 })
+    assert(not r and e == "timeout" and t >= 0.19 and t < 1, "ftp")
+    server:close()
+    pass("ok")
+end
+
 ------------------------------------------------------------------------
 function getstats_test()
     reconnect()
@@ -487,6 +1192,398 @@ function getstats_test()
     pass("ok")
 end
 
+------------------------------------------------------------------------
+function bufferpool_test()
+    reconnect()
+    local r, s, a, resident = data:getstats()
+    assert(resident == 0, "idle socket holds buffer storage")
+    remote [[
+        data:send("0123456789\n")
+    ]]
+    assert(data:receive(4) == "0123", "failed on partial receive")
+    r, s, a, resident = data:getstats()
+    assert(resident > 0, "buffer storage not attached")
+    assert(data:receive() == "456789", "failed on buffered line")
+    r, s, a, resident = data:getstats()
+    assert(resident == 0, "buffer storage not released")
+    local idle, max = socket.getbufferpool()
+    assert(idle > 0 and idle <= max, "storage not returned to pool")
+    socket.setbufferpool(0)
+    idle = socket.getbufferpool()
+    assert(idle == 0, "pool not trimmed")
+    socket.setbufferpool(max)
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function buffersize_test()
+    reconnect()
+    local size, mode = data:getbuffersize()
+    assert(size == 8192 and mode == "fixed", "wrong default buffer size")
+    data:setbuffersize(100)
+    size, mode = data:getbuffersize()
+    assert(size == 1024 and mode == "fixed", "size not rounded up")
+    -- lines are staged through the buffer; large by-length reads are not
+    remote [[
+        data:send(string.rep("a", 4096) .. "\n")
+    ]]
+    assert(data:receive() == string.rep("a", 4096), "failed on receive")
+    local r, s, a, resident, recvs = data:getstats()
+    assert(recvs >= 4, "receives larger than the buffer size")
+    data:setbuffersize(3000000, "adaptive")
+    size, mode = data:getbuffersize()
+    assert(size == 1048576 and mode == "adaptive", "size not clamped")
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function directrecv_test()
+    reconnect()
+    -- small enough to sit in the kernel buffers before we start reading
+    local size = 60000
+    remote (string.format ([[
+        data:send(string.rep("z", %d))
+    ]], size))
+    socket.sleep(0.5)
+    local _, _, _, _, before = data:getstats()
+    assert(data:receive(size) == string.rep("z", size), "failed on receive")
+    local _, _, _, resident, after = data:getstats()
+    assert(resident == 0, "large receive attached buffer storage")
+    -- staging through the 8K buffer would take at least size/8192 calls
+    if after then
+        assert(after - before < size/8192, "large receive was staged")
+    end
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function outputbuffer_test()
+    reconnect()
+    local max, pending = data:getoutputbuffer()
+    assert(max == 0 and pending == 0, "output buffered by default")
+    data:setoutputbuffer(1000)
+    max, pending = data:getoutputbuffer()
+    assert(max == 1024 and pending == 0, "size not rounded up")
+    assert(data:send("abc") == 3 and data:send("def\n") == 4, "send failed")
+    max, pending = data:getoutputbuffer()
+    assert(pending == 7, "output not held")
+    remote [[
+        data:settimeout(0.5)
+        local str, err = data:receive()
+        data:settimeout(-1)
+        data:send((str or err) .. "\n")
+    ]]
+    socket.sleep(1)
+    -- the receive below flushes the pending line after the peer gave up
+    assert(data:receive() == "timeout", "output sent before flush")
+    max, pending = data:getoutputbuffer()
+    assert(pending == 0, "output not flushed before receive")
+    remote [[
+        data:send(data:receive() .. "\n")
+    ]]
+    assert(data:receive() == "abcdef", "flushed output corrupted")
+    data:send("ghi\n")
+    assert(data:flush() == 1, "flush failed")
+    local r, s, a, resident = data:getstats()
+    assert(resident == 0, "output storage not released")
+    remote [[
+        data:settimeout(0.5)
+        local str, err = data:receive()
+        data:settimeout(-1)
+        data:send((str or err) .. "\n")
+    ]]
+    socket.sleep(1)
+    assert(data:receive() == "ghi", "output not sent by flush")
+    data:send("x")
+    data:send(string.rep("y", 2047) .. "\n")
+    max, pending = data:getoutputbuffer()
+    assert(pending == 0, "high-water mark ignored")
+    remote [[
+        data:send(#data:receive() .. "\n")
+    ]]
+    assert(data:receive() == "2048", "large send corrupted")
+    data:setoutputbuffer(0)
+    -- close sends what is still pending
+    local server = assert(socket.bind("127.0.0.1", 0))
+    local port = select(2, server:getsockname())
+    local c = assert(socket.connect("127.0.0.1", port))
+    local peer = assert(server:accept())
+    c:setoutputbuffer(1024)
+    assert(c:send("reply") == 5 and select(2, c:getoutputbuffer()) == 5)
+    assert(c:close() == 1, "close failed")
+    peer:settimeout(5)
+    assert(peer:receive("*a") == "reply", "pending output lost on close")
+    peer:close()
+    server:close()
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function sendv_test()
+    reconnect()
+    remote [[
+        data:send(data:receive() .. "\n")
+    ]]
+    assert(data:sendv("ab", "", 12, "c\n") == 6, "wrong count sent")
+    assert(data:receive() == "ab12c", "failed on argument pieces")
+    local t = {}
+    for i = 1, 200 do t[i] = string.char(65 + i % 26) end
+    t[201] = "\n"
+    remote [[
+        data:send(data:receive() .. "\n")
+    ]]
+    assert(data:sendv(t) == 201, "wrong count sent")
+    assert(data:receive() == table.concat(t, "", 1, 200),
+        "failed on array pieces")
+    local ok = pcall(data.sendv, data, {"a", {}})
+    assert(not ok, "accepted invalid piece")
+    -- pending output must go out ahead of the pieces
+    data:setoutputbuffer(1024)
+    data:send("head")
+    remote [[
+        data:send(data:receive() .. "\n")
+    ]]
+    assert(data:sendv(string.rep("x", 2000), "\n") == 2001, "wrong count")
+    assert(data:receive() == "head" .. string.rep("x", 2000),
+        "pending output out of order")
+    data:setoutputbuffer(0)
+    -- large pieces must survive partial writes
+    local big = string.rep("y", 1000000)
+    remote [[
+        data:send(#data:receive(3000000) .. "\n")
+    ]]
+    assert(data:sendv(big, big, big) == 3000000, "wrong count sent")
+    assert(data:receive() == "3000000", "failed on large pieces")
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function delimiter_test()
+    reconnect()
+    local headers = {delimiter = "\r\n\r\n"}
+    remote [[
+        data:send("A: 1\r\nB: 2\r\n\r\nbody\r\n\r\r\n\r\n")
+    ]]
+    assert(data:receive(headers) == "A: 1\r\nB: 2", "failed on header block")
+    assert(data:receive(headers) == "body\r\n\r", "failed on overlap")
+    -- a delimiter split across reads and across a timeout
+    remote [[
+        data:send("part--bou")
+        socket.sleep(1)
+        data:send("nd--rest--boundary")
+    ]]
+    data:settimeout(0.5)
+    local boundary = {delimiter = "--boundary", max = 100}
+    local str, err, part = data:receive(boundary)
+    assert(not str and err == "timeout" and part == "part",
+        "held back wrong bytes")
+    data:settimeout(-1)
+    str = data:receive(boundary, part)
+    assert(str == "part--bound--rest", "failed on split delimiter")
+    remote [[
+        data:send(string.rep("x", 20) .. "\n\n")
+    ]]
+    str, err, part = data:receive({delimiter = "\n\n", max = 10})
+    assert(not str and err == "limit exceeded" and part == string.rep("x", 10),
+        "failed on limit")
+    assert(data:receive({delimiter = "\n\n", max = 10}) == string.rep("x", 10),
+        "failed on exact limit")
+    remote [[
+        data:send("unterminated-")
+        data:close()
+        data = nil
+    ]]
+    str, err, part = data:receive({delimiter = "--"})
+    assert(not str and err == "closed" and part == "unterminated-",
+        "lost data on close")
+    local ok = pcall(data.receive, data, {delimiter = ""})
+    assert(not ok, "accepted empty delimiter")
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function available_test()
+    reconnect()
+    data:settimeout(-1)
+    -- nothing readable: an empty result right away, not a timeout
+    local t = socket.gettime()
+    local str, err = data:receive("*r")
+    assert(str == "" and not err, "failed on nothing available")
+    assert(socket.gettime() - t < 1, "waited for data")
+    remote [[
+        data:send("0123456789")
+    ]]
+    assert(socket.select({data}, nil, 5)[1] == data, "data never arrived")
+    str = data:receive({available = 4})
+    assert(str == "0123", "failed on limited read")
+    -- buffered bytes are returned without reading more
+    data:receive(1)
+    str = data:receive("*r", "pre")
+    assert(str == "pre56789", "failed on buffered data")
+    remote [[
+        data:close()
+        data = nil
+    ]]
+    assert(socket.select({data}, nil, 5)[1] == data, "close never arrived")
+    str, err = data:receive("*r")
+    assert(not str and err == "closed", "failed on closed")
+    local ok = pcall(data.receive, data, {available = 0})
+    assert(not ok, "accepted empty length")
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function peek_test()
+    reconnect()
+    remote [[
+        data:send("GET / HTTP/1.0\r\n")
+        socket.sleep(1)
+        data:send("\r\n")
+    ]]
+    assert(data:peek(4) == "GET ", "failed on peek")
+    assert(data:peek(3) == "GET", "peek consumed data")
+    -- waits for the bytes that have not arrived yet
+    assert(data:peek(18) == "GET / HTTP/1.0\r\n\r\n", "failed on split peek")
+    assert(data:receive() == "GET / HTTP/1.0", "peeked data was lost")
+    assert(data:receive() == "", "peeked data was lost")
+    remote [[
+        data:send("ab")
+    ]]
+    data:settimeout(0.5)
+    local str, err, part = data:peek(3)
+    assert(not str and err == "timeout" and part == "ab", "failed on timeout")
+    data:settimeout(-1)
+    assert(data:receive(2) == "ab", "failed after timeout")
+    local size = data:getbuffersize()
+    assert(not pcall(data.peek, data, size + 1), "peeked past the buffer")
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function frame_test()
+    reconnect()
+    remote [[
+        data:sendframe("hello")
+        data:sendframe("", "<I2")
+        data:send("\3\0abc\0\0\0\0\0\0\0\2xy")
+    ]]
+    assert(data:receiveframe() == "hello", "failed on default prefix")
+    assert(data:receiveframe("<I2") == "", "failed on empty frame")
+    assert(data:receiveframe("<I2") == "abc", "failed on little endian")
+    assert(data:receiveframe(">I8") == "xy", "failed on 8 byte prefix")
+    -- frames that arrive together come back together
+    remote [[
+        data:send("\0\0\0\3one\0\0\0\3two\0\0\0\5three")
+    ]]
+    local frames = data:receiveframes()
+    assert(#frames == 3 and frames[1] == "one" and frames[3] == "three",
+        "failed on batch")
+    -- a frame split across a timeout
+    remote [[
+        data:send("\0\0\0\10abc")
+        socket.sleep(1)
+        data:send("defghij")
+    ]]
+    data:settimeout(0.5)
+    local str, err, part = data:receiveframe()
+    assert(not str and err == "timeout" and part == "\0\0\0\10abc",
+        "failed on timeout")
+    data:settimeout(-1)
+    assert(data:receiveframe(nil, nil, part) == "abcdefghij",
+        "failed to resume")
+    assert(data:sendframe("ping") == 8, "wrong byte count")
+    remote [[
+        data:sendframe(data:receiveframe() .. "!")
+        data:sendframe(string.rep("x", 100))
+    ]]
+    assert(data:receiveframe() == "ping!", "failed on echo")
+    str, err, part = data:receiveframe(">I4", 10)
+    assert(not str and err == "limit exceeded" and part == "\0\0\0\100",
+        "failed on limit")
+    assert(not pcall(data.sendframe, data, string.rep("x", 256), "I1"),
+        "accepted oversized frame")
+    assert(not pcall(data.receiveframe, data, "I3"), "accepted bad prefix")
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function receivelines_test()
+    reconnect()
+    remote [[
+        data:send("one\r\ntwo\nth\rree\r\nfour\nfi")
+        socket.sleep(1)
+        data:send("ve\n")
+    ]]
+    socket.sleep(0.5)
+    local lines = data:receivelines(3)
+    assert(#lines == 3 and lines[1] == "one" and lines[2] == "two"
+        and lines[3] == "three", "failed on first batch")
+    lines = data:receivelines()
+    assert(#lines == 1 and lines[1] == "four", "waited for incomplete line")
+    data:settimeout(0.2)
+    local ok, err, part = data:receivelines()
+    assert(not ok and err == "timeout" and part == "fi",
+        "failed on partial line")
+    data:settimeout(-1)
+    lines = data:receivelines(10, part)
+    assert(#lines == 1 and lines[1] == "five", "failed on resumed line")
+    local ok = pcall(data.receivelines, data, 0)
+    assert(not ok, "accepted invalid maximum")
+    pass("ok")
+end
+
+------------------------------------------------------------------------
+function bytes_test()
+    local b = socket.bytes(16)
+    assert(#b == 16 and b:len() == 16, "wrong size")
+    assert(b:sub() == string.rep("\0", 16), "not zero filled")
+    b:set(3, "hello")
+    assert(b:sub(3, 7) == "hello" and b:sub(-14, -10) == "hello",
+        "failed on set/sub")
+    assert(b:find("ll") == 5 and select(2, b:find("ll")) == 6,
+        "failed on find")
+    assert(not b:find("ll", 6) and not b:find("xyz"), "found missing string")
+    assert(not pcall(b.set, b, 15, "hello"), "wrote past the end")
+    reconnect()
+    b = socket.bytes(20000)
+    remote [[
+        data:send("abc" .. string.rep("d", 19990) .. "efghijk")
+    ]]
+    assert(data:receiveinto(b, 1, 3) == 3 and b:sub(1, 3) == "abc",
+        "failed on small receive")
+    -- larger than the receive buffer, so it goes straight into b
+    assert(data:receiveinto(b, 4, 19990) == 19990, "failed on large receive")
+    assert(b:sub(4, 19993) == string.rep("d", 19990), "large receive corrupted")
+    data:settimeout(0.5)
+    local got, err, partial = data:receiveinto(b, 19991)
+    assert(not got and err == "timeout" and partial == 7
+        and b:sub(19991, 19997) == "efghijk", "failed on partial receive")
+    data:settimeout(-1)
+    assert(not pcall(data.receiveinto, data, b, 19999, 5),
+        "received past the end")
+    remote [[
+        data:send(data:receive(20000))
+    ]]
+    assert(data:sendfrom(b) == 20000, "failed on sendfrom")
+    assert(data:receive(20000) == b:sub(), "sendfrom corrupted")
+    remote [[
+        data:send(data:receive(5) .. "\n")
+    ]]
+    assert(data:sendfrom(b, 1, 5) == 5, "failed on sendfrom slice")
+    assert(data:receive() == "abcdd", "sendfrom slice corrupted")
+    local u = socket.udp()
+    local v = socket.udp()
+    u:setsockname("127.0.0.1", 0)
+    v:setpeername(u:getsockname())
+    b:set(1, "datagram")
+    assert(v:sendfrom(b, 1, 8) == 8, "failed on udp sendfrom")
+    u:settimeout(1)
+    assert(u:receiveinto(b, 11, 4) == 4 and b:sub(11, 14) == "data",
+        "failed on udp receiveinto")
+    u:close()
+    v:close()
+    pass("ok")
+end
 
 ------------------------------------------------------------------------
 function test_nonblocking(size)
@@ -623,22 +1720,39 @@ test("method registration")
 
 local tcp_methods = {
     "accept",
+    "acceptmany",
     "bind",
     "close",
     "connect",
     "dirty",
+    "flush",
+    "getbuffersize",
+    "getdriver",
     "getfamily",
     "getfd",
     "getoption",
+    "getoutputbuffer",
     "getpeername",
     "getsockname",
     "getstats",
     "setstats",
     "listen",
+    "peek",
     "receive",
+    "receiveframe",
+    "receiveframes",
+    "receiveinto",
+    "receivelines",
     "send",
+    "sendframe",
+    "sendfrom",
+    "sendv",
+    "setbuffersize",
+    "setdeadline",
+    "setdriver",
     "setfd",
     "setoption",
+    "setoutputbuffer",
     "setpeername",
     "setsockname",
     "settimeout",
@@ -660,8 +1774,11 @@ local udp_methods = {
     "getsockname",
     "receive",
     "receivefrom",
+    "receiveinto",
     "send",
+    "sendfrom",
     "sendto",
+    "setdeadline",
     "setfd",
     "setoption",
     "setpeername",
@@ -685,6 +1802,24 @@ test_partialrecv()
 test("select function")
 test_selectbugs()
 
+test("poller objects")
+test_poller()
+
+test("notifiers")
+test_notifier()
+
+test("timer wheels")
+test_timers()
+
+test("coroutine scheduler")
+test_scheduler()
+
+test("yield mode")
+test_yield()
+
+test("io_uring rings")
+test_ring()
+
 test("read after close")
 test_readafterclose()
 
@@ -695,6 +1830,8 @@ test("connect function")
 connect_timeout()
 empty_connect()
 connect_errors()
+happy_eyeballs_test()
+connectmany_test()
 
 test("rebinding: ")
 rebind_test()
@@ -705,10 +1842,53 @@ active_close()
 test("accept function: ")
 accept_timeout()
 accept_errors()
+acceptmany_test()
+
+test("socket setup calls")
+setupcalls_test()
+
+test("monotonic clock")
+monotime_test()
+
+test("deadlines")
+deadline_test()
 
 test("getstats test")
 getstats_test()
 
+test("buffer pool")
+bufferpool_test()
+
+test("buffer size")
+buffersize_test()
+
+test("direct receive")
+directrecv_test()
+
+test("output buffer")
+outputbuffer_test()
+
+test("vectored send")
+sendv_test()
+
+test("receive until delimiter")
+delimiter_test()
+
+test("receive available")
+available_test()
+
+test("peek")
+peek_test()
+
+test("frames")
+frame_test()
+
+test("receive lines")
+receivelines_test()
+
+test("bytes objects")
+bytes_test()
+
 test("character line")
 test_asciiline(1)
 test_asciiline(17)
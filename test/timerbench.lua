@@ -0,0 +1,56 @@
+-- Cost of keeping many pending deadlines: a timer wheel against a table
+-- of deadlines scanned on every tick. Timers are spread over ten minutes
+-- and time advances one tick per iteration, so a few expire on each one.
+-- Usage: lua timerbench.lua [ticks [timers...]]
+local socket = require"socket"
+
+local ticks = tonumber(arg and arg[1]) or 2000
+local levels = {}
+for i = 2, (arg and #arg or 0) do levels[#levels+1] = tonumber(arg[i]) end
+if #levels == 0 then levels = { 1000, 10000, 100000 } end
+
+local resolution, spread = 0.01, 600
+local function nop() end
+
+local function viawheel(n)
+    local w = socket.timers(resolution)
+    local t = socket.gettime()
+    for i = 1, n do w:schedule(math.random()*spread, nop) end
+    local sched = (socket.gettime() - t) / n * 1e6
+    local now, fired = socket.monotime(), 0
+    t = socket.gettime()
+    for i = 1, ticks do
+        now = now + resolution
+        fired = fired + w:expire(now)
+        w:next(now)
+    end
+    return (socket.gettime() - t) / ticks * 1e6, sched, fired
+end
+
+local function viascan(n)
+    local deadlines, base = {}, socket.monotime()
+    for i = 1, n do deadlines[i] = base + math.random()*spread end
+    local now, fired = base, 0
+    local t = socket.gettime()
+    for i = 1, ticks do
+        now = now + resolution
+        local nearest = math.huge
+        for id, d in pairs(deadlines) do
+            if d <= now then
+                deadlines[id] = nil
+                nop(id)
+                fired = fired + 1
+            elseif d < nearest then nearest = d end
+        end
+    end
+    return (socket.gettime() - t) / ticks * 1e6, fired
+end
+
+print(string.format("%d ticks of %g s per level", ticks, resolution))
+print("    timers   wheel/tick    scan/tick   schedule  fired/tick")
+for _, n in ipairs(levels) do
+    local wheel, sched, fired = viawheel(n)
+    local scan = viascan(n)
+    print(string.format("%10d %9.2f us %9.1f us %7.2f us %10.1f", n, wheel,
+        scan, sched, fired/ticks))
+end